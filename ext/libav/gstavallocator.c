@@ -0,0 +1,294 @@
+/* GStreamer
+ * Copyright (C) <2018> GStreamer developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* for memfd_create() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <gst/gst.h>
+
+#if defined(HAVE_MEMFD_CREATE) || defined(__linux__)
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_MEMFD_CREATE
+#include <gst/allocators/gstfdmemory.h>
+#endif
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+#define HAVE_HUGE_PAGES 1
+/* the transparent huge page size on x86-64 and on arm64 with 4k pages */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+#include "gstav.h"
+#include "gstavallocator.h"
+
+GType
+gst_ffmpeg_pool_memory_get_type (void)
+{
+  static GType ffmpeg_pool_memory_type = 0;
+
+  if (!ffmpeg_pool_memory_type) {
+    static const GEnumValue ffmpeg_pool_memory[] = {
+      {GST_FFMPEG_POOL_MEMORY_SYSTEM, "Default system memory", "system"},
+      {GST_FFMPEG_POOL_MEMORY_MEMFD,
+          "Anonymous shareable file descriptors (memfd)", "memfd"},
+      {GST_FFMPEG_POOL_MEMORY_HUGE_PAGES,
+          "Transparent huge page backed system memory", "huge-pages"},
+      {0, NULL, NULL},
+    };
+
+    ffmpeg_pool_memory_type =
+        g_enum_register_static ("GstLibAVPoolMemory", ffmpeg_pool_memory);
+  }
+
+  return ffmpeg_pool_memory_type;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/* A GstFdAllocator that creates its own file descriptors with memfd_create().
+ * The resulting memory can be passed to other processes (or to kernel
+ * drivers) without a copy, while still being plain mappable system memory
+ * for libav. */
+typedef struct
+{
+  GstFdAllocator parent;
+} GstFFMpegMemfdAllocator;
+
+typedef struct
+{
+  GstFdAllocatorClass parent_class;
+} GstFFMpegMemfdAllocatorClass;
+
+static GType gst_ffmpeg_memfd_allocator_get_type (void);
+G_DEFINE_TYPE (GstFFMpegMemfdAllocator, gst_ffmpeg_memfd_allocator,
+    GST_TYPE_FD_ALLOCATOR);
+
+static GstMemory *
+gst_ffmpeg_memfd_allocator_alloc (GstAllocator * allocator, gsize size,
+    GstAllocationParams * params)
+{
+  GstMemory *mem;
+  gsize maxsize;
+  gint fd;
+
+  maxsize = size + params->prefix + params->padding;
+
+  fd = memfd_create ("gst-libav", MFD_CLOEXEC);
+  if (fd < 0)
+    goto create_failed;
+
+  if (ftruncate (fd, maxsize) < 0)
+    goto truncate_failed;
+
+  /* the whole file gets mapped, so the data always starts on a page
+   * boundary, which covers any alignment the pool can ask for */
+  mem = gst_fd_allocator_alloc (allocator, fd, maxsize,
+      GST_FD_MEMORY_FLAG_KEEP_MAPPED);
+  if (mem == NULL)
+    goto truncate_failed;
+
+  gst_memory_resize (mem, params->prefix, size);
+
+  return mem;
+
+  /* ERRORS */
+create_failed:
+  {
+    GST_ERROR ("memfd_create failed: %s", g_strerror (errno));
+    return NULL;
+  }
+truncate_failed:
+  {
+    GST_ERROR ("failed to size memfd to %" G_GSIZE_FORMAT " bytes: %s",
+        maxsize, g_strerror (errno));
+    close (fd);
+    return NULL;
+  }
+}
+
+static void
+gst_ffmpeg_memfd_allocator_class_init (GstFFMpegMemfdAllocatorClass * klass)
+{
+  GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS (klass);
+
+  allocator_class->alloc = gst_ffmpeg_memfd_allocator_alloc;
+}
+
+static void
+gst_ffmpeg_memfd_allocator_init (GstFFMpegMemfdAllocator * allocator)
+{
+  /* unlike the plain fd allocator, we can allocate memory ourselves */
+  GST_OBJECT_FLAG_UNSET (allocator, GST_ALLOCATOR_FLAG_CUSTOM_ALLOC);
+}
+
+static GstAllocator *
+gst_ffmpeg_memfd_allocator_get (void)
+{
+  static GstAllocator *memfd_allocator = NULL;
+  static gsize probed = 0;
+
+  if (g_once_init_enter (&probed)) {
+    gint fd;
+
+    /* memfd_create() may be present in libc but not in the running kernel */
+    fd = memfd_create ("gst-libav", MFD_CLOEXEC);
+    if (fd >= 0) {
+      close (fd);
+      memfd_allocator =
+          g_object_new (gst_ffmpeg_memfd_allocator_get_type (), NULL);
+      gst_object_ref_sink (memfd_allocator);
+    } else {
+      GST_WARNING ("memfd is not supported: %s", g_strerror (errno));
+    }
+
+    g_once_init_leave (&probed, 1);
+  }
+
+  return memfd_allocator ? gst_object_ref (memfd_allocator) : NULL;
+}
+#endif
+
+#ifdef HAVE_HUGE_PAGES
+/* An allocator for large frames that places every allocation at the start of
+ * a huge page and asks the kernel to back it with transparent huge pages.
+ * 4K and 8K frames then only need a handful of TLB entries instead of
+ * thousands, which matters for the scattered reference frame accesses of the
+ * decoders. The memory itself is plain wrapped system memory. */
+typedef struct
+{
+  GstAllocator parent;
+} GstFFMpegHugePageAllocator;
+
+typedef struct
+{
+  GstAllocatorClass parent_class;
+} GstFFMpegHugePageAllocatorClass;
+
+static GType gst_ffmpeg_huge_page_allocator_get_type (void);
+G_DEFINE_TYPE (GstFFMpegHugePageAllocator, gst_ffmpeg_huge_page_allocator,
+    GST_TYPE_ALLOCATOR);
+
+static GstMemory *
+gst_ffmpeg_huge_page_allocator_alloc (GstAllocator * allocator, gsize size,
+    GstAllocationParams * params)
+{
+  gpointer data;
+  gsize maxsize, align, advise_size;
+
+  maxsize = size + params->prefix + params->padding;
+
+  /* a huge page aligned start covers any alignment the pool can ask for,
+   * smaller allocations could never be backed and only get the requested
+   * alignment so they don't waste a huge page of address space each */
+  if (maxsize >= HUGE_PAGE_SIZE)
+    align = HUGE_PAGE_SIZE;
+  else
+    align = MAX (params->align + 1, sizeof (gpointer));
+
+  if (posix_memalign (&data, align, maxsize) != 0)
+    goto alloc_failed;
+
+  /* only whole huge pages can be backed, the tail uses regular pages */
+  advise_size = maxsize & ~((gsize) HUGE_PAGE_SIZE - 1);
+  if (advise_size > 0 && madvise (data, advise_size, MADV_HUGEPAGE) < 0)
+    GST_DEBUG ("madvise (MADV_HUGEPAGE) failed: %s", g_strerror (errno));
+
+  if (params->prefix && (params->flags & GST_MEMORY_FLAG_ZERO_PREFIXED))
+    memset (data, 0, params->prefix);
+  if (params->padding && (params->flags & GST_MEMORY_FLAG_ZERO_PADDED))
+    memset ((guint8 *) data + params->prefix + size, 0, params->padding);
+
+  return gst_memory_new_wrapped (params->flags, data, maxsize, params->prefix,
+      size, data, free);
+
+  /* ERRORS */
+alloc_failed:
+  {
+    GST_ERROR ("failed to allocate %" G_GSIZE_FORMAT " bytes aligned to %"
+        G_GSIZE_FORMAT, maxsize, align);
+    return NULL;
+  }
+}
+
+static void
+gst_ffmpeg_huge_page_allocator_class_init (GstFFMpegHugePageAllocatorClass *
+    klass)
+{
+  GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS (klass);
+
+  allocator_class->alloc = gst_ffmpeg_huge_page_allocator_alloc;
+}
+
+static void
+gst_ffmpeg_huge_page_allocator_init (GstFFMpegHugePageAllocator * allocator)
+{
+}
+
+static GstAllocator *
+gst_ffmpeg_huge_page_allocator_get (void)
+{
+  static GstAllocator *huge_page_allocator = NULL;
+
+  if (g_once_init_enter (&huge_page_allocator)) {
+    GstAllocator *allocator;
+
+    allocator = g_object_new (gst_ffmpeg_huge_page_allocator_get_type (), NULL);
+    gst_object_ref_sink (allocator);
+
+    g_once_init_leave (&huge_page_allocator, allocator);
+  }
+
+  return gst_object_ref (huge_page_allocator);
+}
+#endif
+
+GstAllocator *
+gst_ffmpeg_pool_memory_get_allocator (GstFFMpegPoolMemory memory)
+{
+  switch (memory) {
+    case GST_FFMPEG_POOL_MEMORY_MEMFD:
+#ifdef HAVE_MEMFD_CREATE
+      return gst_ffmpeg_memfd_allocator_get ();
+#else
+      GST_WARNING ("memfd support not compiled in, using system memory");
+      return NULL;
+#endif
+    case GST_FFMPEG_POOL_MEMORY_HUGE_PAGES:
+#ifdef HAVE_HUGE_PAGES
+      return gst_ffmpeg_huge_page_allocator_get ();
+#else
+      GST_WARNING ("huge pages are not supported, using system memory");
+      return NULL;
+#endif
+    case GST_FFMPEG_POOL_MEMORY_SYSTEM:
+    default:
+      return NULL;
+  }
+}
@@ -0,0 +1,49 @@
+/* GStreamer
+ * Copyright (C) <2018> GStreamer developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_FFMPEG_ALLOCATOR_H__
+#define __GST_FFMPEG_ALLOCATOR_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Backing memory used by the frame pools of the decoders and encoders.
+ */
+typedef enum
+{
+  GST_FFMPEG_POOL_MEMORY_SYSTEM,
+  GST_FFMPEG_POOL_MEMORY_MEMFD,
+  GST_FFMPEG_POOL_MEMORY_HUGE_PAGES
+} GstFFMpegPoolMemory;
+
+#define GST_TYPE_FFMPEG_POOL_MEMORY (gst_ffmpeg_pool_memory_get_type ())
+GType gst_ffmpeg_pool_memory_get_type (void);
+
+/*
+ * Get the allocator to configure on a pool for the given backing memory.
+ * Returns a new reference, or NULL when the default allocator should be
+ * used (also when the requested memory is not available on this system).
+ */
+GstAllocator *gst_ffmpeg_pool_memory_get_allocator (GstFFMpegPoolMemory memory);
+
+G_END_DECLS
+
+#endif /* __GST_FFMPEG_ALLOCATOR_H__ */
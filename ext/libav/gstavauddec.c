@@ -34,6 +34,7 @@
 #include "gstav.h"
 #include "gstavcodecmap.h"
 #include "gstavutils.h"
+#include "gstavinterleave.h"
 #include "gstavauddec.h"
 
 /* A number of function prototypes are given so we can refer to them later. */
@@ -41,6 +42,10 @@ static void gst_ffmpegauddec_base_init (GstFFMpegAudDecClass * klass);
 static void gst_ffmpegauddec_class_init (GstFFMpegAudDecClass * klass);
 static void gst_ffmpegauddec_init (GstFFMpegAudDec * ffmpegdec);
 static void gst_ffmpegauddec_finalize (GObject * object);
+static void gst_ffmpegauddec_set_property (GObject * object,
+    guint prop_id, const GValue * value, GParamSpec * pspec);
+static void gst_ffmpegauddec_get_property (GObject * object,
+    guint prop_id, GValue * value, GParamSpec * pspec);
 static gboolean gst_ffmpegauddec_propose_allocation (GstAudioDecoder * decoder,
     GstQuery * query);
 
@@ -53,14 +58,56 @@ static GstFlowReturn gst_ffmpegauddec_handle_frame (GstAudioDecoder * decoder,
     GstBuffer * inbuf);
 
 static gboolean gst_ffmpegauddec_negotiate (GstFFMpegAudDec * ffmpegdec,
-    AVCodecContext * context, AVFrame * frame, gboolean force);
-
-static void gst_ffmpegauddec_drain (GstFFMpegAudDec * ffmpegdec);
+    AVCodecContext * context, AVFrame * frame, gboolean force,
+    GstFlowReturn * ret);
+
+static GstFlowReturn gst_ffmpegauddec_drain (GstFFMpegAudDec * ffmpegdec);
+static GstFlowReturn gst_ffmpegauddec_push_aggregate (GstFFMpegAudDec *
+    ffmpegdec);
+static void gst_ffmpegauddec_discard_aggregate (GstFFMpegAudDec * ffmpegdec);
+static GstFlowReturn gst_ffmpegauddec_parallel_output (GstFFMpegAudDec *
+    ffmpegdec);
+static void gst_ffmpegauddec_parallel_discard (GstFFMpegAudDec * ffmpegdec);
+static void gst_ffmpegauddec_parallel_close (GstFFMpegAudDec * ffmpegdec);
+static void gst_ffmpegauddec_configure_context (GstFFMpegAudDec * ffmpegdec,
+    AVCodecContext * context, GstCaps * caps);
+
+#define DEFAULT_OUTPUT_DURATION		0
+#define MAX_OUTPUT_DURATION		GST_SECOND
+#define DEFAULT_DIRECT_RENDERING	TRUE
+#define DEFAULT_ALLOC_PARAM             { 0, 31, 0, 0, }
+#define DEFAULT_PARALLEL_CONTEXTS	0
+#define MAX_PARALLEL_CONTEXTS		64
+
+enum
+{
+  PROP_0,
+  PROP_OUTPUT_DURATION,
+  PROP_DIRECT_RENDERING,
+  PROP_PARALLEL_CONTEXTS,
+};
 
 #define GST_FFDEC_PARAMS_QDATA g_quark_from_static_string("avdec-params")
 
 static GstElementClass *parent_class = NULL;
 
+/* codecs where every packet can be decoded without the previous ones, PCM
+ * and G.711 are left to the native GStreamer elements */
+static gboolean
+gst_ffmpegauddec_is_stateless (enum AVCodecID codec_id)
+{
+  switch (codec_id) {
+    case AV_CODEC_ID_ADPCM_IMA_QT:
+    case AV_CODEC_ID_ADPCM_IMA_WAV:
+    case AV_CODEC_ID_ADPCM_IMA_DK3:
+    case AV_CODEC_ID_ADPCM_IMA_DK4:
+    case AV_CODEC_ID_ADPCM_MS:
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
 static void
 gst_ffmpegauddec_base_init (GstFFMpegAudDecClass * klass)
 {
@@ -98,6 +145,11 @@ gst_ffmpegauddec_base_init (GstFFMpegAudDecClass * klass)
     GST_DEBUG ("Couldn't get source caps for decoder '%s'", in_plugin->name);
     srccaps = gst_caps_from_string ("audio/x-raw");
   }
+#if GST_CHECK_VERSION(1,15,1)
+  /* planar frames can be pushed without interleaving them, older base
+   * classes have no GstAudioMeta and would clip them as interleaved */
+  gst_ffmpeg_audio_caps_add_non_interleaved (srccaps);
+#endif
 
   /* pad templates */
   sinktempl = gst_pad_template_new ("sink", GST_PAD_SINK,
@@ -124,6 +176,34 @@ gst_ffmpegauddec_class_init (GstFFMpegAudDecClass * klass)
   parent_class = g_type_class_peek_parent (klass);
 
   gobject_class->finalize = gst_ffmpegauddec_finalize;
+  gobject_class->set_property = gst_ffmpegauddec_set_property;
+  gobject_class->get_property = gst_ffmpegauddec_get_property;
+
+  g_object_class_install_property (gobject_class, PROP_OUTPUT_DURATION,
+      g_param_spec_uint64 ("output-duration", "Output duration",
+          "Collect decoded samples into buffers of at least this duration "
+          "in nanoseconds before pushing them (0 = push every decoded frame, "
+          "interleaved output only)", 0, MAX_OUTPUT_DURATION,
+          DEFAULT_OUTPUT_DURATION,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  if (klass->in_plugin->capabilities & CODEC_CAP_DR1) {
+    g_object_class_install_property (gobject_class, PROP_DIRECT_RENDERING,
+        g_param_spec_boolean ("direct-rendering", "Direct Rendering",
+            "Decode packed audio directly into output buffers",
+            DEFAULT_DIRECT_RENDERING,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  }
+
+  if (gst_ffmpegauddec_is_stateless (klass->in_plugin->id)) {
+    g_object_class_install_property (gobject_class, PROP_PARALLEL_CONTEXTS,
+        g_param_spec_int ("parallel-contexts", "Parallel decoding contexts",
+            "Number of decoding contexts that input buffers are dispatched "
+            "to in parallel. Output is delayed by up to that many buffers "
+            "(0 = disabled)", 0, MAX_PARALLEL_CONTEXTS,
+            DEFAULT_PARALLEL_CONTEXTS,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  }
 
   gstaudiodecoder_class->start = GST_DEBUG_FUNCPTR (gst_ffmpegauddec_start);
   gstaudiodecoder_class->stop = GST_DEBUG_FUNCPTR (gst_ffmpegauddec_stop);
@@ -155,6 +235,14 @@ gst_ffmpegauddec_init (GstFFMpegAudDec * ffmpegdec)
 
   gst_audio_decoder_set_drainable (GST_AUDIO_DECODER (ffmpegdec), TRUE);
   gst_audio_decoder_set_needs_format (GST_AUDIO_DECODER (ffmpegdec), TRUE);
+
+  ffmpegdec->output_duration = DEFAULT_OUTPUT_DURATION;
+  ffmpegdec->direct_rendering = DEFAULT_DIRECT_RENDERING;
+  ffmpegdec->parallel_contexts = DEFAULT_PARALLEL_CONTEXTS;
+
+  g_queue_init (&ffmpegdec->parallel_jobs);
+  g_mutex_init (&ffmpegdec->parallel_lock);
+  g_cond_init (&ffmpegdec->parallel_cond);
 }
 
 static void
@@ -170,9 +258,56 @@ gst_ffmpegauddec_finalize (GObject * object)
     ffmpegdec->context = NULL;
   }
 
+  g_mutex_clear (&ffmpegdec->parallel_lock);
+  g_cond_clear (&ffmpegdec->parallel_cond);
+
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
+static void
+gst_ffmpegauddec_set_property (GObject * object,
+    guint prop_id, const GValue * value, GParamSpec * pspec)
+{
+  GstFFMpegAudDec *ffmpegdec = (GstFFMpegAudDec *) object;
+
+  switch (prop_id) {
+    case PROP_OUTPUT_DURATION:
+      ffmpegdec->output_duration = g_value_get_uint64 (value);
+      break;
+    case PROP_DIRECT_RENDERING:
+      ffmpegdec->direct_rendering = g_value_get_boolean (value);
+      break;
+    case PROP_PARALLEL_CONTEXTS:
+      ffmpegdec->parallel_contexts = g_value_get_int (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_ffmpegauddec_get_property (GObject * object,
+    guint prop_id, GValue * value, GParamSpec * pspec)
+{
+  GstFFMpegAudDec *ffmpegdec = (GstFFMpegAudDec *) object;
+
+  switch (prop_id) {
+    case PROP_OUTPUT_DURATION:
+      g_value_set_uint64 (value, ffmpegdec->output_duration);
+      break;
+    case PROP_DIRECT_RENDERING:
+      g_value_set_boolean (value, ffmpegdec->direct_rendering);
+      break;
+    case PROP_PARALLEL_CONTEXTS:
+      g_value_set_int (value, ffmpegdec->parallel_contexts);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
 /* With LOCK */
 static gboolean
 gst_ffmpegauddec_close (GstFFMpegAudDec * ffmpegdec, gboolean reset)
@@ -185,10 +320,19 @@ gst_ffmpegauddec_close (GstFFMpegAudDec * ffmpegdec, gboolean reset)
 
   gst_caps_replace (&ffmpegdec->last_caps, NULL);
   gst_buffer_replace (&ffmpegdec->outbuf, NULL);
+  gst_ffmpegauddec_discard_aggregate (ffmpegdec);
 
+  gst_ffmpegauddec_parallel_close (ffmpegdec);
   gst_ffmpeg_avcodec_close (ffmpegdec->context);
   ffmpegdec->opened = FALSE;
 
+  if (ffmpegdec->internal_pool) {
+    gst_buffer_pool_set_active (ffmpegdec->internal_pool, FALSE);
+    gst_object_unref (ffmpegdec->internal_pool);
+    ffmpegdec->internal_pool = NULL;
+    ffmpegdec->pool_size = 0;
+  }
+
   if (ffmpegdec->context->extradata) {
     av_free (ffmpegdec->context->extradata);
     ffmpegdec->context->extradata = NULL;
@@ -244,6 +388,311 @@ gst_ffmpegauddec_stop (GstAudioDecoder * decoder)
   return TRUE;
 }
 
+typedef struct
+{
+  GstBuffer *buffer;
+  GstMapInfo map;
+} GstFFMpegAudDecDRBuffer;
+
+static void
+gst_ffmpegauddec_dr_buffer_free (void *opaque, uint8_t * data)
+{
+  GstFFMpegAudDecDRBuffer *dr = opaque;
+
+  gst_buffer_unmap (dr->buffer, &dr->map);
+  gst_buffer_unref (dr->buffer);
+  g_slice_free (GstFFMpegAudDecDRBuffer, dr);
+}
+
+/* get the pool buffer a frame was decoded into, if any */
+static GstFFMpegAudDecDRBuffer *
+gst_ffmpegauddec_get_dr_buffer (AVFrame * frame)
+{
+  GstFFMpegAudDecDRBuffer *dr = frame->opaque;
+
+  if (dr == NULL || frame->buf[0] == NULL
+      || av_buffer_get_opaque (frame->buf[0]) != dr)
+    return NULL;
+
+  return dr;
+}
+
+static gboolean
+gst_ffmpegauddec_ensure_internal_pool (GstFFMpegAudDec * ffmpegdec, gsize size)
+{
+  GstAllocationParams params = DEFAULT_ALLOC_PARAM;
+  GstStructure *config;
+
+  if (ffmpegdec->internal_pool != NULL && ffmpegdec->pool_size >= size)
+    return TRUE;
+
+  GST_DEBUG_OBJECT (ffmpegdec, "Updating internal pool (%" G_GSIZE_FORMAT
+      " bytes)", size);
+
+  if (ffmpegdec->internal_pool) {
+    gst_buffer_pool_set_active (ffmpegdec->internal_pool, FALSE);
+    gst_object_unref (ffmpegdec->internal_pool);
+  }
+
+  ffmpegdec->internal_pool = gst_buffer_pool_new ();
+  config = gst_buffer_pool_get_config (ffmpegdec->internal_pool);
+  gst_buffer_pool_config_set_params (config, NULL, size, 0, 0);
+  gst_buffer_pool_config_set_allocator (config, NULL, &params);
+  if (!gst_buffer_pool_set_config (ffmpegdec->internal_pool, config)
+      || !gst_buffer_pool_set_active (ffmpegdec->internal_pool, TRUE))
+    goto pool_failed;
+
+  ffmpegdec->pool_size = size;
+
+  return TRUE;
+
+  /* ERRORS */
+pool_failed:
+  {
+    GST_WARNING_OBJECT (ffmpegdec, "failed to set up internal pool");
+    gst_object_unref (ffmpegdec->internal_pool);
+    ffmpegdec->internal_pool = NULL;
+    ffmpegdec->pool_size = 0;
+    return FALSE;
+  }
+}
+
+/* called when libav wants us to allocate the memory for a decoded frame.
+ * Packed frames are decoded into pool buffers that are pushed as they are,
+ * everything else still gets interleaved or aggregated into the output
+ * buffers so we let libav allocate that itself */
+static int
+gst_ffmpegauddec_get_buffer2 (AVCodecContext * context, AVFrame * frame,
+    int flags)
+{
+  GstFFMpegAudDec *ffmpegdec = context->opaque;
+  GstFFMpegAudDecDRBuffer *dr;
+  GstBuffer *buffer;
+  gint channels, linesize, size;
+
+  channels = av_frame_get_channels (frame);
+  if (channels == 0)
+    channels = context->channels;
+
+  if (channels == 0 || channels > 64
+      || (av_sample_fmt_is_planar (frame->format) && channels > 1)
+      || ffmpegdec->output_duration > 0)
+    goto fallback;
+
+  size = av_samples_get_buffer_size (&linesize, channels, frame->nb_samples,
+      frame->format, 0);
+  if (size < 0)
+    goto fallback;
+
+  /* libav may write a little beyond the samples */
+  if (!gst_ffmpegauddec_ensure_internal_pool (ffmpegdec,
+          size + FF_INPUT_BUFFER_PADDING_SIZE))
+    goto fallback;
+
+  if (gst_buffer_pool_acquire_buffer (ffmpegdec->internal_pool, &buffer,
+          NULL) != GST_FLOW_OK)
+    goto fallback;
+
+  dr = g_slice_new (GstFFMpegAudDecDRBuffer);
+  dr->buffer = buffer;
+  if (!gst_buffer_map (buffer, &dr->map, GST_MAP_READWRITE)) {
+    gst_buffer_unref (buffer);
+    g_slice_free (GstFFMpegAudDecDRBuffer, dr);
+    goto fallback;
+  }
+
+  frame->buf[0] = av_buffer_create (dr->map.data, dr->map.size,
+      gst_ffmpegauddec_dr_buffer_free, dr, 0);
+  if (frame->buf[0] == NULL) {
+    gst_ffmpegauddec_dr_buffer_free (dr, NULL);
+    goto fallback;
+  }
+  frame->data[0] = dr->map.data;
+  frame->extended_data = frame->data;
+  frame->linesize[0] = linesize;
+  frame->opaque = dr;
+
+  GST_LOG_OBJECT (ffmpegdec, "decoding %d samples into buffer %p",
+      frame->nb_samples, buffer);
+
+  return 0;
+
+fallback:
+  {
+    return avcodec_default_get_buffer2 (context, frame, flags);
+  }
+}
+
+static void
+gst_avpacket_init (AVPacket * packet, guint8 * data, guint size)
+{
+  memset (packet, 0, sizeof (AVPacket));
+  packet->data = data;
+  packet->size = size;
+}
+
+typedef struct
+{
+  GstBuffer *inbuf;
+  gboolean is_header;
+  /* decoded AVFrames */
+  GQueue frames;
+  gboolean error;
+  gboolean done;
+} GstFFMpegAudDecParallelJob;
+
+static void
+gst_ffmpegauddec_parallel_job_free (GstFFMpegAudDecParallelJob * job)
+{
+  AVFrame *frame;
+
+  while ((frame = g_queue_pop_head (&job->frames)))
+    av_frame_free (&frame);
+  gst_buffer_unref (job->inbuf);
+  g_slice_free (GstFFMpegAudDecParallelJob, job);
+}
+
+/* runs in the thread pool, decodes all packets of one input buffer on any
+ * idle context */
+static void
+gst_ffmpegauddec_parallel_decode (GstFFMpegAudDecParallelJob * job,
+    GstFFMpegAudDec * ffmpegdec)
+{
+  AVCodecContext *context;
+  AVPacket packet;
+  AVFrame *frame;
+  GstMapInfo map;
+  guint8 *data;
+  gint len, have_data;
+
+  /* libav wants padded input */
+  gst_buffer_map (job->inbuf, &map, GST_MAP_READ);
+  data = av_malloc (map.size + FF_INPUT_BUFFER_PADDING_SIZE);
+  memcpy (data, map.data, map.size);
+  memset (data + map.size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+  gst_avpacket_init (&packet, data, map.size);
+  gst_buffer_unmap (job->inbuf, &map);
+
+  context = g_async_queue_pop (ffmpegdec->parallel_idle);
+  frame = av_frame_alloc ();
+  while (packet.size > 0) {
+    len = avcodec_decode_audio4 (context, frame, &have_data, &packet);
+    if (len < 0) {
+      job->error = TRUE;
+      break;
+    }
+    if (have_data) {
+      g_queue_push_tail (&job->frames, frame);
+      frame = av_frame_alloc ();
+    } else if (len == 0) {
+      break;
+    }
+    packet.data += len;
+    packet.size -= len;
+  }
+  g_async_queue_push (ffmpegdec->parallel_idle, context);
+
+  av_frame_free (&frame);
+  av_free (data);
+
+  g_mutex_lock (&ffmpegdec->parallel_lock);
+  job->done = TRUE;
+  g_cond_broadcast (&ffmpegdec->parallel_cond);
+  g_mutex_unlock (&ffmpegdec->parallel_lock);
+}
+
+static void
+gst_ffmpegauddec_parallel_wait (GstFFMpegAudDec * ffmpegdec,
+    GstFFMpegAudDecParallelJob * job)
+{
+  g_mutex_lock (&ffmpegdec->parallel_lock);
+  while (!job->done)
+    g_cond_wait (&ffmpegdec->parallel_cond, &ffmpegdec->parallel_lock);
+  g_mutex_unlock (&ffmpegdec->parallel_lock);
+}
+
+/* waits for all jobs in flight and drops their output */
+static void
+gst_ffmpegauddec_parallel_discard (GstFFMpegAudDec * ffmpegdec)
+{
+  GstFFMpegAudDecParallelJob *job;
+
+  while ((job = g_queue_pop_head (&ffmpegdec->parallel_jobs))) {
+    gst_ffmpegauddec_parallel_wait (ffmpegdec, job);
+    gst_ffmpegauddec_parallel_job_free (job);
+  }
+}
+
+static void
+gst_ffmpegauddec_parallel_close (GstFFMpegAudDec * ffmpegdec)
+{
+  AVCodecContext *context;
+
+  gst_ffmpegauddec_parallel_discard (ffmpegdec);
+
+  if (ffmpegdec->parallel_pool) {
+    g_thread_pool_free (ffmpegdec->parallel_pool, FALSE, TRUE);
+    ffmpegdec->parallel_pool = NULL;
+  }
+
+  if (ffmpegdec->parallel_idle) {
+    while ((context = g_async_queue_try_pop (ffmpegdec->parallel_idle))) {
+      gst_ffmpeg_avcodec_close (context);
+      avcodec_free_context (&context);
+    }
+    g_async_queue_unref (ffmpegdec->parallel_idle);
+    ffmpegdec->parallel_idle = NULL;
+  }
+  ffmpegdec->parallel_n_contexts = 0;
+}
+
+/* with LOCK, the main context must be open already */
+static gboolean
+gst_ffmpegauddec_parallel_open (GstFFMpegAudDec * ffmpegdec, GstCaps * caps)
+{
+  GstFFMpegAudDecClass *oclass;
+  AVCodecContext *context;
+  gint i;
+
+  oclass = (GstFFMpegAudDecClass *) (G_OBJECT_GET_CLASS (ffmpegdec));
+
+  ffmpegdec->parallel_idle = g_async_queue_new ();
+
+  for (i = 0; i < ffmpegdec->parallel_contexts; i++) {
+    context = avcodec_alloc_context3 (oclass->in_plugin);
+    if (context == NULL)
+      goto could_not_open;
+    gst_ffmpegauddec_configure_context (ffmpegdec, context, caps);
+
+    /* the internal pool is not shared with the workers */
+    context->refcounted_frames = 1;
+
+    if (gst_ffmpeg_avcodec_open (context, oclass->in_plugin) < 0)
+      goto could_not_open;
+
+    g_async_queue_push (ffmpegdec->parallel_idle, context);
+    ffmpegdec->parallel_n_contexts++;
+  }
+
+  ffmpegdec->parallel_pool =
+      g_thread_pool_new ((GFunc) gst_ffmpegauddec_parallel_decode, ffmpegdec,
+      ffmpegdec->parallel_n_contexts, TRUE, NULL);
+
+  GST_DEBUG_OBJECT (ffmpegdec, "decoding with %d parallel contexts",
+      ffmpegdec->parallel_n_contexts);
+
+  return TRUE;
+
+  /* ERRORS */
+could_not_open:
+  {
+    GST_WARNING_OBJECT (ffmpegdec, "Failed to open parallel context %d", i);
+    avcodec_free_context (&context);
+    gst_ffmpegauddec_parallel_close (ffmpegdec);
+    return FALSE;
+  }
+}
+
 /* with LOCK */
 static gboolean
 gst_ffmpegauddec_open (GstFFMpegAudDec * ffmpegdec)
@@ -252,6 +701,13 @@ gst_ffmpegauddec_open (GstFFMpegAudDec * ffmpegdec)
 
   oclass = (GstFFMpegAudDecClass *) (G_OBJECT_GET_CLASS (ffmpegdec));
 
+  if (ffmpegdec->direct_rendering
+      && (oclass->in_plugin->capabilities & CODEC_CAP_DR1)) {
+    ffmpegdec->context->get_buffer2 = gst_ffmpegauddec_get_buffer2;
+    /* the frame must not hold on to our buffers after av_frame_unref() */
+    ffmpegdec->context->refcounted_frames = 1;
+  }
+
   if (gst_ffmpeg_avcodec_open (ffmpegdec->context, oclass->in_plugin) < 0)
     goto could_not_open;
 
@@ -292,6 +748,114 @@ gst_ffmpegauddec_propose_allocation (GstAudioDecoder * decoder,
       query);
 }
 
+static enum AVSampleFormat
+gst_ffmpegauddec_pick_sample_fmt (AVCodec * codec, GstAudioFormat format,
+    gboolean planar)
+{
+  const enum AVSampleFormat *fmts;
+  enum AVSampleFormat packed_fmt;
+
+  switch (format) {
+    case GST_AUDIO_FORMAT_U8:
+      packed_fmt = AV_SAMPLE_FMT_U8;
+      break;
+    case GST_AUDIO_FORMAT_S16:
+      packed_fmt = AV_SAMPLE_FMT_S16;
+      break;
+    case GST_AUDIO_FORMAT_S32:
+      packed_fmt = AV_SAMPLE_FMT_S32;
+      break;
+    case GST_AUDIO_FORMAT_F32:
+      packed_fmt = AV_SAMPLE_FMT_FLT;
+      break;
+    case GST_AUDIO_FORMAT_F64:
+      packed_fmt = AV_SAMPLE_FMT_DBL;
+      break;
+    default:
+      return AV_SAMPLE_FMT_NONE;
+  }
+
+  /* take the layout the codec can produce if it tells us */
+  for (fmts = codec->sample_fmts; fmts && *fmts != AV_SAMPLE_FMT_NONE; fmts++) {
+    if (av_get_packed_sample_fmt (*fmts) == packed_fmt)
+      return *fmts;
+  }
+
+  return planar ? av_get_planar_sample_fmt (packed_fmt) : packed_fmt;
+}
+
+/* When downstream can only take fewer channels or a single sample format,
+ * ask the codec for that directly. Codecs that can downmix (AC-3, E-AC-3,
+ * DTS, ...) then skip decoding the channels that would be dropped later on,
+ * others simply ignore the request. */
+static void
+gst_ffmpegauddec_request_output_format (GstFFMpegAudDec * ffmpegdec,
+    AVCodecContext * context)
+{
+  GstFFMpegAudDecClass *oclass;
+  GstCaps *caps;
+  GstStructure *s;
+  const gchar *format, *layout;
+  gint channels;
+
+  oclass = (GstFFMpegAudDecClass *) (G_OBJECT_GET_CLASS (ffmpegdec));
+
+  caps = gst_pad_get_allowed_caps (GST_AUDIO_DECODER_SRC_PAD (ffmpegdec));
+  if (caps == NULL)
+    return;
+  if (gst_caps_is_empty (caps) || gst_caps_is_any (caps))
+    goto done;
+
+  s = gst_caps_get_structure (caps, 0);
+
+  if (gst_structure_get_int (s, "channels", &channels) && channels > 0
+      && channels <= 2 && (context->channels == 0
+          || context->channels > channels)) {
+    GST_DEBUG_OBJECT (ffmpegdec, "requesting %d channels", channels);
+    context->request_channel_layout =
+        av_get_default_channel_layout (channels);
+  }
+
+  format = gst_structure_get_string (s, "format");
+  if (format) {
+    enum AVSampleFormat smpl_fmt;
+
+    layout = gst_structure_get_string (s, "layout");
+    smpl_fmt = gst_ffmpegauddec_pick_sample_fmt (oclass->in_plugin,
+        gst_audio_format_from_string (format),
+        !g_strcmp0 (layout, "non-interleaved"));
+    if (smpl_fmt != AV_SAMPLE_FMT_NONE) {
+      GST_DEBUG_OBJECT (ffmpegdec, "requesting sample format %s",
+          av_get_sample_fmt_name (smpl_fmt));
+      context->request_sample_fmt = smpl_fmt;
+    }
+  }
+
+done:
+  gst_caps_unref (caps);
+}
+
+/* sets up a freshly reset @context for @caps, the main one as well as the
+ * parallel ones */
+static void
+gst_ffmpegauddec_configure_context (GstFFMpegAudDec * ffmpegdec,
+    AVCodecContext * context, GstCaps * caps)
+{
+  GstFFMpegAudDecClass *oclass;
+
+  oclass = (GstFFMpegAudDecClass *) (G_OBJECT_GET_CLASS (ffmpegdec));
+
+  /* get size and so */
+  gst_ffmpeg_caps_with_codecid (oclass->in_plugin->id,
+      oclass->in_plugin->type, caps, context);
+
+  /* workaround encoder bugs */
+  context->workaround_bugs |= FF_BUG_AUTODETECT;
+  context->err_recognition = 1;
+
+  gst_ffmpegauddec_request_output_format (ffmpegdec, context);
+}
+
 static gboolean
 gst_ffmpegauddec_set_format (GstAudioDecoder * decoder, GstCaps * caps)
 {
@@ -324,13 +888,7 @@ gst_ffmpegauddec_set_format (GstAudioDecoder * decoder, GstCaps * caps)
     }
   }
 
-  /* get size and so */
-  gst_ffmpeg_caps_with_codecid (oclass->in_plugin->id,
-      oclass->in_plugin->type, caps, ffmpegdec->context);
-
-  /* workaround encoder bugs */
-  ffmpegdec->context->workaround_bugs |= FF_BUG_AUTODETECT;
-  ffmpegdec->context->err_recognition = 1;
+  gst_ffmpegauddec_configure_context (ffmpegdec, ffmpegdec->context, caps);
 
   /* open codec - we don't select an output pix_fmt yet,
    * simply because we don't know! We only get it
@@ -338,6 +896,15 @@ gst_ffmpegauddec_set_format (GstAudioDecoder * decoder, GstCaps * caps)
   if (!gst_ffmpegauddec_open (ffmpegdec))
     goto open_failed;
 
+  if (ffmpegdec->parallel_contexts > 0
+      && gst_ffmpegauddec_is_stateless (oclass->in_plugin->id)
+      && !gst_ffmpegauddec_parallel_open (ffmpegdec, caps))
+    GST_WARNING_OBJECT (ffmpegdec, "falling back to a single context");
+
+  /* aggregated samples are held back for up to output-duration */
+  gst_audio_decoder_set_latency (decoder, ffmpegdec->output_duration,
+      ffmpegdec->output_duration);
+
 done:
   GST_OBJECT_UNLOCK (ffmpegdec);
 
@@ -363,15 +930,48 @@ settings_changed (GstFFMpegAudDec * ffmpegdec, AVFrame * frame)
   if (format == GST_AUDIO_FORMAT_UNKNOWN)
     return TRUE;
 
+  if (ffmpegdec->frame_planar != av_sample_fmt_is_planar (frame->format))
+    return TRUE;
+
   return !(ffmpegdec->info.rate ==
       av_frame_get_sample_rate (frame) &&
       ffmpegdec->info.channels == channels &&
       ffmpegdec->info.finfo->format == format);
 }
 
+/* only output non-interleaved audio when downstream prefers it, many
+ * elements accept it but handle it less efficiently */
+static gboolean
+gst_ffmpegauddec_prefers_non_interleaved (GstFFMpegAudDec * ffmpegdec)
+{
+  GstCaps *caps;
+  const GValue *layout;
+  gboolean ret = FALSE;
+
+  caps = gst_pad_get_allowed_caps (GST_AUDIO_DECODER_SRC_PAD (ffmpegdec));
+  if (caps == NULL)
+    return FALSE;
+
+  if (!gst_caps_is_empty (caps)) {
+    layout =
+        gst_structure_get_value (gst_caps_get_structure (caps, 0), "layout");
+    if (layout && GST_VALUE_HOLDS_LIST (layout)
+        && gst_value_list_get_size (layout) > 0)
+      layout = gst_value_list_get_value (layout, 0);
+    ret = layout && G_VALUE_HOLDS_STRING (layout)
+        && !g_strcmp0 (g_value_get_string (layout), "non-interleaved");
+  }
+  gst_caps_unref (caps);
+
+  return ret;
+}
+
+/* sets @ret to the flow of the aggregate pushed before the format change,
+ * or to GST_FLOW_NOT_NEGOTIATED */
 static gboolean
 gst_ffmpegauddec_negotiate (GstFFMpegAudDec * ffmpegdec,
-    AVCodecContext * context, AVFrame * frame, gboolean force)
+    AVCodecContext * context, AVFrame * frame, gboolean force,
+    GstFlowReturn * ret)
 {
   GstFFMpegAudDecClass *oclass;
   GstAudioFormat format;
@@ -399,6 +999,20 @@ gst_ffmpegauddec_negotiate (GstFFMpegAudDec * ffmpegdec,
       ffmpegdec->info.finfo->format, av_frame_get_sample_rate (frame), channels,
       format);
 
+  /* push what was collected in the old format. When the current input
+   * frame already added to it, the frame is finished with its old format
+   * samples and the rest of it goes out with the next frame */
+  if (ffmpegdec->aggbuf) {
+    if (ffmpegdec->agg_dirty || ffmpegdec->agg_frames == 0) {
+      ffmpegdec->agg_dirty = FALSE;
+      ffmpegdec->agg_frames++;
+      ffmpegdec->frame_finished = TRUE;
+    }
+    *ret = gst_ffmpegauddec_push_aggregate (ffmpegdec);
+    if (*ret != GST_FLOW_OK)
+      return FALSE;
+  }
+
   gst_ffmpeg_channel_layout_to_gst (av_frame_get_channel_layout (frame),
       channels, pos);
   memcpy (ffmpegdec->ffmpeg_layout, pos,
@@ -410,6 +1024,16 @@ gst_ffmpegauddec_negotiate (GstFFMpegAudDec * ffmpegdec,
       memcmp (pos, ffmpegdec->ffmpeg_layout, sizeof (pos[0]) * channels) != 0;
   gst_audio_info_set_format (&ffmpegdec->info, format,
       av_frame_get_sample_rate (frame), channels, pos);
+  if (ffmpegdec->needs_reorder)
+    gst_audio_get_channel_reorder_map (channels, ffmpegdec->ffmpeg_layout,
+        ffmpegdec->info.position, ffmpegdec->reorder_map);
+
+  ffmpegdec->frame_planar = av_sample_fmt_is_planar (frame->format);
+  if (ffmpegdec->frame_planar && channels > 1
+      && gst_ffmpegauddec_prefers_non_interleaved (ffmpegdec)) {
+    GST_DEBUG_OBJECT (ffmpegdec, "outputting non-interleaved audio");
+    ffmpegdec->info.layout = GST_AUDIO_LAYOUT_NON_INTERLEAVED;
+  }
 
   if (!gst_audio_decoder_set_output_format (GST_AUDIO_DECODER (ffmpegdec),
           &ffmpegdec->info))
@@ -436,6 +1060,7 @@ no_caps:
             "packages come from the same source/repository.",
             oclass->in_plugin->name), (NULL));
 #endif
+    *ret = GST_FLOW_NOT_NEGOTIATED;
     return FALSE;
   }
 caps_failed:
@@ -444,155 +1069,345 @@ caps_failed:
         ("Could not set caps for libav decoder (%s), not fixed?",
             oclass->in_plugin->name));
     memset (&ffmpegdec->info, 0, sizeof (ffmpegdec->info));
+    *ret = GST_FLOW_NOT_NEGOTIATED;
 
     return FALSE;
   }
 }
 
+static gboolean
+gst_ffmpegauddec_aggregating (GstFFMpegAudDec * ffmpegdec)
+{
+  return ffmpegdec->output_duration > 0
+      && GST_AUDIO_INFO_LAYOUT (&ffmpegdec->info) ==
+      GST_AUDIO_LAYOUT_INTERLEAVED;
+}
+
+/* Get a pointer to @size bytes at the end of the aggregate output buffer,
+ * allocating it (or making it larger) as needed */
+static guint8 *
+gst_ffmpegauddec_reserve_aggregate (GstFFMpegAudDec * ffmpegdec, gsize size)
+{
+  guint8 *data;
+
+  if (ffmpegdec->aggbuf == NULL) {
+    ffmpegdec->agg_target_size =
+        gst_util_uint64_scale_ceil (ffmpegdec->output_duration,
+        GST_AUDIO_INFO_RATE (&ffmpegdec->info),
+        GST_SECOND) * GST_AUDIO_INFO_BPF (&ffmpegdec->info);
+    /* leave room for one more frame so that the target can be reached
+     * without pushing early */
+    ffmpegdec->agg_max_size = ffmpegdec->agg_target_size + size;
+    ffmpegdec->aggbuf =
+        gst_audio_decoder_allocate_output_buffer (GST_AUDIO_DECODER
+        (ffmpegdec), ffmpegdec->agg_max_size);
+    gst_buffer_map (ffmpegdec->aggbuf, &ffmpegdec->aggmap, GST_MAP_WRITE);
+    ffmpegdec->agg_size = 0;
+  } else if (ffmpegdec->agg_size + size > ffmpegdec->agg_max_size) {
+    GstBuffer *newbuf;
+    GstMapInfo newmap;
+
+    /* frames bigger than expected, we only push at input frame boundaries
+     * so the buffer has to grow */
+    GST_DEBUG_OBJECT (ffmpegdec, "growing aggregate buffer");
+    ffmpegdec->agg_max_size = MAX (ffmpegdec->agg_max_size * 2,
+        ffmpegdec->agg_size + size);
+    newbuf =
+        gst_audio_decoder_allocate_output_buffer (GST_AUDIO_DECODER
+        (ffmpegdec), ffmpegdec->agg_max_size);
+    gst_buffer_map (newbuf, &newmap, GST_MAP_WRITE);
+    memcpy (newmap.data, ffmpegdec->aggmap.data, ffmpegdec->agg_size);
+    gst_buffer_copy_into (newbuf, ffmpegdec->aggbuf, GST_BUFFER_COPY_FLAGS, 0,
+        -1);
+    gst_buffer_unmap (ffmpegdec->aggbuf, &ffmpegdec->aggmap);
+    gst_buffer_unref (ffmpegdec->aggbuf);
+    ffmpegdec->aggbuf = newbuf;
+    ffmpegdec->aggmap = newmap;
+  }
+
+  data = ffmpegdec->aggmap.data + ffmpegdec->agg_size;
+  ffmpegdec->agg_size += size;
+  ffmpegdec->agg_dirty = TRUE;
+
+  return data;
+}
+
+/* Push the aggregate output buffer for all the input frames that were
+ * completely decoded into it */
+static GstFlowReturn
+gst_ffmpegauddec_push_aggregate (GstFFMpegAudDec * ffmpegdec)
+{
+  GstBuffer *outbuf;
+  gint frames;
+
+  if (ffmpegdec->aggbuf == NULL)
+    return GST_FLOW_OK;
+
+  outbuf = ffmpegdec->aggbuf;
+  frames = ffmpegdec->agg_frames;
+  gst_buffer_unmap (outbuf, &ffmpegdec->aggmap);
+  gst_buffer_resize (outbuf, 0, ffmpegdec->agg_size);
+
+  ffmpegdec->aggbuf = NULL;
+  ffmpegdec->agg_size = 0;
+  ffmpegdec->agg_frames = 0;
+
+  GST_LOG_OBJECT (ffmpegdec, "pushing %" G_GSIZE_FORMAT " aggregated bytes "
+      "for %d frames", gst_buffer_get_size (outbuf), frames);
+
+  return gst_audio_decoder_finish_frame (GST_AUDIO_DECODER (ffmpegdec),
+      outbuf, frames);
+}
+
 static void
-gst_avpacket_init (AVPacket * packet, guint8 * data, guint size)
+gst_ffmpegauddec_discard_aggregate (GstFFMpegAudDec * ffmpegdec)
 {
-  memset (packet, 0, sizeof (AVPacket));
-  packet->data = data;
-  packet->size = size;
+  if (ffmpegdec->aggbuf) {
+    gst_buffer_unmap (ffmpegdec->aggbuf, &ffmpegdec->aggmap);
+    gst_buffer_unref (ffmpegdec->aggbuf);
+    ffmpegdec->aggbuf = NULL;
+  }
+  ffmpegdec->agg_size = 0;
+  ffmpegdec->agg_frames = 0;
+  ffmpegdec->agg_dirty = FALSE;
+  ffmpegdec->frame_finished = FALSE;
 }
 
-static gint
-gst_ffmpegauddec_audio_frame (GstFFMpegAudDec * ffmpegdec,
-    AVCodec * in_plugin, guint8 * data, guint size, gint * have_data,
+/* Called at the end of every input frame. Returns whether the frame was
+ * taken into the aggregate, in which case it must not be finished */
+static gboolean
+gst_ffmpegauddec_end_aggregate_frame (GstFFMpegAudDec * ffmpegdec,
+    GstFlowReturn * ret)
+{
+  if (!ffmpegdec->agg_dirty)
+    return FALSE;
+
+  ffmpegdec->agg_dirty = FALSE;
+  ffmpegdec->agg_frames++;
+
+  if (ffmpegdec->agg_size >= ffmpegdec->agg_target_size
+      || !gst_ffmpegauddec_aggregating (ffmpegdec))
+    *ret = gst_ffmpegauddec_push_aggregate (ffmpegdec);
+
+  return TRUE;
+}
+
+/* Turn the decoded ffmpegdec->frame into an output buffer, or add it to the
+ * aggregate. The frame is unreffed afterwards. */
+static gboolean
+gst_ffmpegauddec_output_frame (GstFFMpegAudDec * ffmpegdec,
     GstBuffer ** outbuf, GstFlowReturn * ret)
 {
-  gint len = -1;
-  AVPacket packet;
+  GstFFMpegAudDecDRBuffer *dr;
+  gsize dr_size = 0;
+  gint nsamples, channels, byte_per_sample;
+  gsize output_size;
+  gboolean res = TRUE;
 
-  GST_DEBUG_OBJECT (ffmpegdec, "size: %d", size);
+  *outbuf = NULL;
 
-  gst_avpacket_init (&packet, data, size);
-  len =
-      avcodec_decode_audio4 (ffmpegdec->context, ffmpegdec->frame, have_data,
-      &packet);
+  if (!gst_ffmpegauddec_negotiate (ffmpegdec, ffmpegdec->context,
+          ffmpegdec->frame, FALSE, ret)) {
+    res = FALSE;
+    goto beach;
+  }
 
-  GST_DEBUG_OBJECT (ffmpegdec,
-      "Decode audio: len=%d, have_data=%d", len, *have_data);
+  channels = ffmpegdec->info.channels;
+  nsamples = ffmpegdec->frame->nb_samples;
+  byte_per_sample = ffmpegdec->info.finfo->width / 8;
 
-  if (len >= 0 && *have_data) {
-    gint nsamples, channels, byte_per_sample;
-    gsize output_size;
+  /* ffmpegdec->frame->linesize[0] might contain padding, allocate only what's needed */
+  output_size = nsamples * byte_per_sample * channels;
 
-    if (!gst_ffmpegauddec_negotiate (ffmpegdec, ffmpegdec->context,
-            ffmpegdec->frame, FALSE)) {
-      *outbuf = NULL;
-      *ret = GST_FLOW_NOT_NEGOTIATED;
-      len = -1;
-      goto beach;
-    }
+  GST_DEBUG_OBJECT (ffmpegdec, "Creating output buffer");
+  if (GST_AUDIO_INFO_LAYOUT (&ffmpegdec->info) ==
+      GST_AUDIO_LAYOUT_NON_INTERLEAVED) {
+    GstMapInfo minfo;
+    gsize plane_size;
+    gint i;
 
-    channels = ffmpegdec->info.channels;
-    nsamples = ffmpegdec->frame->nb_samples;
-    byte_per_sample = ffmpegdec->info.finfo->width / 8;
+    /* copy the planes as they are, already in GStreamer channel order */
+    *outbuf =
+        gst_audio_decoder_allocate_output_buffer (GST_AUDIO_DECODER
+        (ffmpegdec), output_size);
+    plane_size = nsamples * byte_per_sample;
 
-    /* ffmpegdec->frame->linesize[0] might contain padding, allocate only what's needed */
-    output_size = nsamples * byte_per_sample * channels;
+    gst_buffer_map (*outbuf, &minfo, GST_MAP_WRITE);
+    for (i = 0; i < channels; i++) {
+      gint out = ffmpegdec->needs_reorder ? ffmpegdec->reorder_map[i] : i;
 
-    GST_DEBUG_OBJECT (ffmpegdec, "Creating output buffer");
-    if (av_sample_fmt_is_planar (ffmpegdec->context->sample_fmt)
-        && channels > 1) {
-      gint i, j;
-      GstMapInfo minfo;
+      memcpy (minfo.data + out * plane_size,
+          ffmpegdec->frame->extended_data[i], plane_size);
+    }
+    gst_buffer_unmap (*outbuf, &minfo);
+#if GST_CHECK_VERSION(1,15,1)
+    gst_buffer_add_audio_meta (*outbuf, &ffmpegdec->info, nsamples, NULL);
+#endif
+  } else if ((dr = gst_ffmpegauddec_get_dr_buffer (ffmpegdec->frame))
+      && !gst_ffmpegauddec_aggregating (ffmpegdec)) {
+    /* decoded straight into a pool buffer, push that one without a copy
+     * once libav released it */
+    if (ffmpegdec->needs_reorder)
+      gst_audio_reorder_channels (ffmpegdec->frame->data[0], output_size,
+          ffmpegdec->info.finfo->format, channels,
+          ffmpegdec->ffmpeg_layout, ffmpegdec->info.position);
+    *outbuf = gst_buffer_ref (dr->buffer);
+    dr_size = output_size;
+  } else {
+    GstMapInfo minfo;
+    guint8 *dest;
 
-      /* note: linesize[0] might contain padding, allocate only what's needed */
+    /* note: linesize[0] might contain padding, allocate only what's needed */
+    if (gst_ffmpegauddec_aggregating (ffmpegdec)) {
+      dest = gst_ffmpegauddec_reserve_aggregate (ffmpegdec, output_size);
+    } else {
       *outbuf =
           gst_audio_decoder_allocate_output_buffer (GST_AUDIO_DECODER
           (ffmpegdec), output_size);
-
       gst_buffer_map (*outbuf, &minfo, GST_MAP_WRITE);
+      dest = minfo.data;
+    }
+
+    if (ffmpegdec->frame_planar && channels > 1) {
+      gpointer planes[64];
+      gint i;
 
-      switch (ffmpegdec->info.finfo->width) {
-        case 8:{
-          guint8 *odata = minfo.data;
-
-          for (i = 0; i < nsamples; i++) {
-            for (j = 0; j < channels; j++) {
-              odata[j] =
-                  ((const guint8 *) ffmpegdec->frame->extended_data[j])[i];
-            }
-            odata += channels;
-          }
-          break;
-        }
-        case 16:{
-          guint16 *odata = (guint16 *) minfo.data;
-
-          for (i = 0; i < nsamples; i++) {
-            for (j = 0; j < channels; j++) {
-              odata[j] =
-                  ((const guint16 *) ffmpegdec->frame->extended_data[j])[i];
-            }
-            odata += channels;
-          }
-          break;
-        }
-        case 32:{
-          guint32 *odata = (guint32 *) minfo.data;
-
-          for (i = 0; i < nsamples; i++) {
-            for (j = 0; j < channels; j++) {
-              odata[j] =
-                  ((const guint32 *) ffmpegdec->frame->extended_data[j])[i];
-            }
-            odata += channels;
-          }
-          break;
-        }
-        case 64:{
-          guint64 *odata = (guint64 *) minfo.data;
-
-          for (i = 0; i < nsamples; i++) {
-            for (j = 0; j < channels; j++) {
-              odata[j] =
-                  ((const guint64 *) ffmpegdec->frame->extended_data[j])[i];
-            }
-            odata += channels;
-          }
-          break;
-        }
-        default:
-          g_assert_not_reached ();
-          break;
+      /* pick the planes in GStreamer channel order, the interleaved
+       * output then needs no reordering afterwards */
+      for (i = 0; i < channels; i++) {
+        gint out = ffmpegdec->needs_reorder ? ffmpegdec->reorder_map[i] : i;
+
+        planes[out] = ffmpegdec->frame->extended_data[i];
       }
-      gst_buffer_unmap (*outbuf, &minfo);
+      gst_ffmpeg_audio_interleave (dest, (const gpointer *) planes,
+          ffmpegdec->info.finfo->width, channels, nsamples);
     } else {
-      *outbuf =
-          gst_audio_decoder_allocate_output_buffer (GST_AUDIO_DECODER
-          (ffmpegdec), output_size);
-      gst_buffer_fill (*outbuf, 0, ffmpegdec->frame->data[0], output_size);
+      memcpy (dest, ffmpegdec->frame->data[0], output_size);
+
+      /* Reorder channels to the GStreamer channel order */
+      if (ffmpegdec->needs_reorder)
+        gst_audio_reorder_channels (dest, output_size,
+            ffmpegdec->info.finfo->format, channels,
+            ffmpegdec->ffmpeg_layout, ffmpegdec->info.position);
     }
 
-    GST_DEBUG_OBJECT (ffmpegdec, "Buffer created. Size: %" G_GSIZE_FORMAT,
-        output_size);
+    if (*outbuf)
+      gst_buffer_unmap (*outbuf, &minfo);
+  }
 
-    /* Reorder channels to the GStreamer channel order */
-    if (ffmpegdec->needs_reorder) {
-      *outbuf = gst_buffer_make_writable (*outbuf);
-      gst_audio_buffer_reorder_channels (*outbuf, ffmpegdec->info.finfo->format,
-          ffmpegdec->info.channels, ffmpegdec->ffmpeg_layout,
-          ffmpegdec->info.position);
-    }
+  GST_DEBUG_OBJECT (ffmpegdec, "Decoded %" G_GSIZE_FORMAT " bytes",
+      output_size);
+
+  /* Mark corrupted frames as corrupted */
+  if (ffmpegdec->frame->flags & AV_FRAME_FLAG_CORRUPT)
+    GST_BUFFER_FLAG_SET (*outbuf ? *outbuf : ffmpegdec->aggbuf,
+        GST_BUFFER_FLAG_CORRUPTED);
+
+beach:
+  av_frame_unref (ffmpegdec->frame);
+  if (dr_size > 0) {
+    /* pool buffers are sized for the largest frame */
+    *outbuf = gst_buffer_make_writable (*outbuf);
+    gst_buffer_resize (*outbuf, 0, dr_size);
+  }
+
+  return res;
+}
 
-    /* Mark corrupted frames as corrupted */
-    if (ffmpegdec->frame->flags & AV_FRAME_FLAG_CORRUPT)
-      GST_BUFFER_FLAG_SET (*outbuf, GST_BUFFER_FLAG_CORRUPTED);
+static gint
+gst_ffmpegauddec_audio_frame (GstFFMpegAudDec * ffmpegdec,
+    AVCodec * in_plugin, guint8 * data, guint size, gint * have_data,
+    GstBuffer ** outbuf, GstFlowReturn * ret)
+{
+  gint len = -1;
+  AVPacket packet;
+
+  GST_DEBUG_OBJECT (ffmpegdec, "size: %d", size);
+
+  gst_avpacket_init (&packet, data, size);
+  len =
+      avcodec_decode_audio4 (ffmpegdec->context, ffmpegdec->frame, have_data,
+      &packet);
+
+  GST_DEBUG_OBJECT (ffmpegdec,
+      "Decode audio: len=%d, have_data=%d", len, *have_data);
+
+  if (len >= 0 && *have_data) {
+    if (!gst_ffmpegauddec_output_frame (ffmpegdec, outbuf, ret))
+      len = -1;
   } else {
+    av_frame_unref (ffmpegdec->frame);
     *outbuf = NULL;
   }
 
-beach:
-  av_frame_unref (ffmpegdec->frame);
   GST_DEBUG_OBJECT (ffmpegdec, "return flow %d, out %p, len %d",
       *ret, *outbuf, len);
   return len;
 }
 
+/* Non-interleaved buffers can't simply be appended, the planes of both
+ * buffers have to be joined instead */
+static GstBuffer *
+gst_ffmpegauddec_append_planar (GstFFMpegAudDec * ffmpegdec, GstBuffer * buf1,
+    GstBuffer * buf2)
+{
+  GstBuffer *outbuf;
+  GstMapInfo map1, map2, omap;
+  gsize size1, size2;
+  gint i, channels, bpf;
+
+  channels = GST_AUDIO_INFO_CHANNELS (&ffmpegdec->info);
+  bpf = GST_AUDIO_INFO_BPF (&ffmpegdec->info);
+
+  gst_buffer_map (buf1, &map1, GST_MAP_READ);
+  gst_buffer_map (buf2, &map2, GST_MAP_READ);
+  size1 = map1.size / channels;
+  size2 = map2.size / channels;
+
+  outbuf =
+      gst_audio_decoder_allocate_output_buffer (GST_AUDIO_DECODER (ffmpegdec),
+      map1.size + map2.size);
+  gst_buffer_map (outbuf, &omap, GST_MAP_WRITE);
+  for (i = 0; i < channels; i++) {
+    guint8 *out = omap.data + i * (size1 + size2);
+
+    memcpy (out, map1.data + i * size1, size1);
+    memcpy (out + size1, map2.data + i * size2, size2);
+  }
+  gst_buffer_unmap (outbuf, &omap);
+  gst_buffer_unmap (buf2, &map2);
+  gst_buffer_unmap (buf1, &map1);
+
+#if GST_CHECK_VERSION(1,15,1)
+  gst_buffer_add_audio_meta (outbuf, &ffmpegdec->info,
+      (size1 + size2) * channels / bpf, NULL);
+#endif
+  if (GST_BUFFER_FLAG_IS_SET (buf1, GST_BUFFER_FLAG_CORRUPTED) ||
+      GST_BUFFER_FLAG_IS_SET (buf2, GST_BUFFER_FLAG_CORRUPTED))
+    GST_BUFFER_FLAG_SET (outbuf, GST_BUFFER_FLAG_CORRUPTED);
+
+  gst_buffer_unref (buf1);
+  gst_buffer_unref (buf2);
+
+  return outbuf;
+}
+
+/* keep the output until the input frame is finished */
+static void
+gst_ffmpegauddec_store (GstFFMpegAudDec * ffmpegdec, GstBuffer * outbuf)
+{
+  GST_LOG_OBJECT (ffmpegdec, "Decoded data, now storing buffer %p", outbuf);
+
+  if (ffmpegdec->outbuf && GST_AUDIO_INFO_LAYOUT (&ffmpegdec->info) ==
+      GST_AUDIO_LAYOUT_NON_INTERLEAVED)
+    ffmpegdec->outbuf =
+        gst_ffmpegauddec_append_planar (ffmpegdec, ffmpegdec->outbuf, outbuf);
+  else if (ffmpegdec->outbuf)
+    ffmpegdec->outbuf = gst_buffer_append (ffmpegdec->outbuf, outbuf);
+  else
+    ffmpegdec->outbuf = outbuf;
+}
+
 /* gst_ffmpegauddec_frame:
  * ffmpegdec:
  * data: pointer to the data to decode
@@ -637,12 +1452,7 @@ gst_ffmpegauddec_frame (GstFFMpegAudDec * ffmpegdec,
   }
 
   if (outbuf) {
-    GST_LOG_OBJECT (ffmpegdec, "Decoded data, now storing buffer %p", outbuf);
-
-    if (ffmpegdec->outbuf)
-      ffmpegdec->outbuf = gst_buffer_append (ffmpegdec->outbuf, outbuf);
-    else
-      ffmpegdec->outbuf = outbuf;
+    gst_ffmpegauddec_store (ffmpegdec, outbuf);
   } else {
     GST_DEBUG_OBJECT (ffmpegdec, "We didn't get a decoded buffer");
   }
@@ -658,13 +1468,22 @@ no_codec:
   }
 }
 
-static void
+static GstFlowReturn
 gst_ffmpegauddec_drain (GstFFMpegAudDec * ffmpegdec)
 {
   GstFFMpegAudDecClass *oclass;
+  GstFlowReturn ret = GST_FLOW_OK;
 
   oclass = (GstFFMpegAudDecClass *) (G_OBJECT_GET_CLASS (ffmpegdec));
 
+  /* the main context never decodes while the workers are used, jobs that
+   * can't be pushed anymore are dropped */
+  if (ffmpegdec->parallel_pool) {
+    while (ret == GST_FLOW_OK && !g_queue_is_empty (&ffmpegdec->parallel_jobs))
+      ret = gst_ffmpegauddec_parallel_output (ffmpegdec);
+    gst_ffmpegauddec_parallel_discard (ffmpegdec);
+  }
+
   if (oclass->in_plugin->capabilities & CODEC_CAP_DELAY) {
     gint have_data, len;
 
@@ -672,18 +1491,32 @@ gst_ffmpegauddec_drain (GstFFMpegAudDec * ffmpegdec)
         "codec has delay capabilities, calling until libav has drained everything");
 
     do {
-      GstFlowReturn ret;
-
       len = gst_ffmpegauddec_frame (ffmpegdec, NULL, 0, &have_data, &ret);
 
-    } while (len >= 0 && have_data == 1);
+    } while (ret == GST_FLOW_OK && len >= 0 && have_data == 1);
     avcodec_flush_buffers (ffmpegdec->context);
   }
 
-  if (ffmpegdec->outbuf)
-    gst_audio_decoder_finish_frame (GST_AUDIO_DECODER (ffmpegdec),
-        ffmpegdec->outbuf, 1);
+  /* the remaining samples have no input frame of their own */
+  if (ffmpegdec->agg_dirty || (ffmpegdec->aggbuf && !ffmpegdec->agg_frames)) {
+    ffmpegdec->agg_dirty = FALSE;
+    ffmpegdec->agg_frames++;
+  }
+  if (ret == GST_FLOW_OK)
+    ret = gst_ffmpegauddec_push_aggregate (ffmpegdec);
+  else
+    gst_ffmpegauddec_discard_aggregate (ffmpegdec);
+
+  if (ffmpegdec->outbuf) {
+    if (ret == GST_FLOW_OK)
+      ret = gst_audio_decoder_finish_frame (GST_AUDIO_DECODER (ffmpegdec),
+          ffmpegdec->outbuf, 1);
+    else
+      gst_buffer_unref (ffmpegdec->outbuf);
+  }
   ffmpegdec->outbuf = NULL;
+
+  return ret;
 }
 
 static void
@@ -694,6 +1527,125 @@ gst_ffmpegauddec_flush (GstAudioDecoder * decoder, gboolean hard)
   if (ffmpegdec->opened) {
     avcodec_flush_buffers (ffmpegdec->context);
   }
+  gst_ffmpegauddec_discard_aggregate (ffmpegdec);
+  gst_ffmpegauddec_parallel_discard (ffmpegdec);
+}
+
+/* finish the current input frame with everything decoded from it, frames
+ * without output are only finished when @drop is set */
+static void
+gst_ffmpegauddec_finish_input (GstFFMpegAudDec * ffmpegdec, gboolean drop,
+    GstFlowReturn * ret)
+{
+  if (ffmpegdec->frame_finished) {
+    /* already finished with its old format samples, what it decoded in
+     * the new format is kept for the next frame */
+    ffmpegdec->frame_finished = FALSE;
+    ffmpegdec->agg_dirty = FALSE;
+    return;
+  }
+
+  if (gst_ffmpegauddec_end_aggregate_frame (ffmpegdec, ret)) {
+    /* the frame will be finished together with the aggregate buffer */
+  } else if (ffmpegdec->outbuf) {
+    /* anything still aggregated goes first */
+    *ret = gst_ffmpegauddec_push_aggregate (ffmpegdec);
+    if (*ret == GST_FLOW_OK)
+      *ret =
+          gst_audio_decoder_finish_frame (GST_AUDIO_DECODER (ffmpegdec),
+          ffmpegdec->outbuf, 1);
+    else
+      gst_buffer_unref (ffmpegdec->outbuf);
+  } else if (drop) {
+    *ret = gst_ffmpegauddec_push_aggregate (ffmpegdec);
+    if (*ret == GST_FLOW_OK)
+      *ret =
+          gst_audio_decoder_finish_frame (GST_AUDIO_DECODER (ffmpegdec), NULL,
+          1);
+  }
+  ffmpegdec->outbuf = NULL;
+}
+
+/* with STREAM_LOCK, waits for the oldest job in flight and finishes its
+ * input frame with the decoded samples */
+static GstFlowReturn
+gst_ffmpegauddec_parallel_output (GstFFMpegAudDec * ffmpegdec)
+{
+  GstFFMpegAudDecParallelJob *job;
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstBuffer *outbuf;
+  AVFrame *frame;
+
+  job = g_queue_pop_head (&ffmpegdec->parallel_jobs);
+  gst_ffmpegauddec_parallel_wait (ffmpegdec, job);
+
+  while (!job->error && (frame = g_queue_pop_head (&job->frames))) {
+    av_frame_move_ref (ffmpegdec->frame, frame);
+    av_frame_free (&frame);
+
+    if (!gst_ffmpegauddec_output_frame (ffmpegdec, &outbuf, &ret))
+      job->error = TRUE;
+    else if (outbuf)
+      gst_ffmpegauddec_store (ffmpegdec, outbuf);
+  }
+
+  if (job->error)
+    GST_WARNING_OBJECT (ffmpegdec, "decoding error");
+
+  gst_ffmpegauddec_finish_input (ffmpegdec, job->error || job->is_header,
+      &ret);
+  gst_ffmpegauddec_parallel_job_free (job);
+
+  return ret;
+}
+
+static gboolean
+gst_ffmpegauddec_parallel_head_done (GstFFMpegAudDec * ffmpegdec)
+{
+  GstFFMpegAudDecParallelJob *job;
+  gboolean done;
+
+  job = g_queue_peek_head (&ffmpegdec->parallel_jobs);
+  if (job == NULL)
+    return FALSE;
+
+  g_mutex_lock (&ffmpegdec->parallel_lock);
+  done = job->done;
+  g_mutex_unlock (&ffmpegdec->parallel_lock);
+
+  return done;
+}
+
+/* Packets of stateless codecs don't depend on each other, so every input
+ * buffer is handed to the thread pool. Output is finished in input order as
+ * soon as it is ready, we only block when all contexts are busy. */
+static GstFlowReturn
+gst_ffmpegauddec_parallel_handle_frame (GstFFMpegAudDec * ffmpegdec,
+    GstBuffer * inbuf)
+{
+  GstFFMpegAudDecParallelJob *job;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  while (ret == GST_FLOW_OK &&
+      g_queue_get_length (&ffmpegdec->parallel_jobs) >=
+      ffmpegdec->parallel_n_contexts)
+    ret = gst_ffmpegauddec_parallel_output (ffmpegdec);
+
+  if (ret != GST_FLOW_OK)
+    return ret;
+
+  job = g_slice_new0 (GstFFMpegAudDecParallelJob);
+  job->inbuf = gst_buffer_ref (inbuf);
+  job->is_header = GST_BUFFER_FLAG_IS_SET (inbuf, GST_BUFFER_FLAG_HEADER);
+  g_queue_init (&job->frames);
+
+  g_queue_push_tail (&ffmpegdec->parallel_jobs, job);
+  g_thread_pool_push (ffmpegdec->parallel_pool, job, NULL);
+
+  while (ret == GST_FLOW_OK && gst_ffmpegauddec_parallel_head_done (ffmpegdec))
+    ret = gst_ffmpegauddec_parallel_output (ffmpegdec);
+
+  return ret;
 }
 
 static GstFlowReturn
@@ -712,10 +1664,11 @@ gst_ffmpegauddec_handle_frame (GstAudioDecoder * decoder, GstBuffer * inbuf)
   if (G_UNLIKELY (!ffmpegdec->opened))
     goto not_negotiated;
 
-  if (inbuf == NULL) {
-    gst_ffmpegauddec_drain (ffmpegdec);
-    return GST_FLOW_OK;
-  }
+  if (inbuf == NULL)
+    return gst_ffmpegauddec_drain (ffmpegdec);
+
+  if (ffmpegdec->parallel_pool)
+    return gst_ffmpegauddec_parallel_handle_frame (ffmpegdec, inbuf);
 
   inbuf = gst_buffer_ref (inbuf);
   is_header = GST_BUFFER_FLAG_IS_SET (inbuf, GST_BUFFER_FLAG_HEADER);
@@ -819,14 +1772,7 @@ gst_ffmpegauddec_handle_frame (GstAudioDecoder * decoder, GstBuffer * inbuf)
   gst_buffer_unmap (inbuf, &map);
   gst_buffer_unref (inbuf);
 
-  if (ffmpegdec->outbuf)
-    ret =
-        gst_audio_decoder_finish_frame (GST_AUDIO_DECODER (ffmpegdec),
-        ffmpegdec->outbuf, 1);
-  else if (len < 0 || is_header)
-    ret =
-        gst_audio_decoder_finish_frame (GST_AUDIO_DECODER (ffmpegdec), NULL, 1);
-  ffmpegdec->outbuf = NULL;
+  gst_ffmpegauddec_finish_input (ffmpegdec, len < 0 || is_header, &ret);
 
   if (bsize > 0) {
     GST_DEBUG_OBJECT (ffmpegdec, "Dropping %d bytes of data", bsize);
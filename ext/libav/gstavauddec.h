@@ -50,6 +50,37 @@ struct _GstFFMpegAudDec
   GstAudioInfo info;
   GstAudioChannelPosition ffmpeg_layout[64];
   gboolean needs_reorder;
+  /* output channel of each libav channel when reordering */
+  gint reorder_map[64];
+  /* whether the frames we negotiated for were planar */
+  gboolean frame_planar;
+
+  /* properties */
+  GstClockTime output_duration;
+  gboolean direct_rendering;
+
+  /* pool that packed frames are decoded into with direct rendering */
+  GstBufferPool *internal_pool;
+  gsize pool_size;
+
+  /* decoded samples collected until output_duration is reached */
+  GstBuffer *aggbuf;
+  GstMapInfo aggmap;
+  gsize agg_size, agg_max_size, agg_target_size;
+  /* input frames in aggbuf, and whether the current one added data */
+  gint agg_frames;
+  gboolean agg_dirty;
+  /* the current input frame was finished early by a format change */
+  gboolean frame_finished;
+
+  /* stateless codecs: whole input buffers are decoded in parallel */
+  gint parallel_contexts;
+  GThreadPool *parallel_pool;
+  GAsyncQueue *parallel_idle;
+  gint parallel_n_contexts;
+  GQueue parallel_jobs;
+  GMutex parallel_lock;
+  GCond parallel_cond;
 };
 
 typedef struct _GstFFMpegAudDecClass GstFFMpegAudDecClass;
@@ -37,9 +37,13 @@
 #include "gstav.h"
 #include "gstavcodecmap.h"
 #include "gstavutils.h"
+#include "gstavinterleave.h"
 #include "gstavaudenc.h"
 
 #define DEFAULT_AUDIO_BITRATE 128000
+#define DEFAULT_FRAMES_PER_BUFFER 1
+#define DEFAULT_PARALLEL_CONTEXTS 0
+#define MAX_PARALLEL_CONTEXTS 64
 
 enum
 {
@@ -53,6 +57,8 @@ enum
   PROP_BIT_RATE,
   PROP_RTP_PAYLOAD_SIZE,
   PROP_COMPLIANCE,
+  PROP_FRAMES_PER_BUFFER,
+  PROP_PARALLEL_CONTEXTS,
 };
 
 /* A number of function prototypes are given so we can refer to them later. */
@@ -74,12 +80,81 @@ static void gst_ffmpegaudenc_set_property (GObject * object,
 static void gst_ffmpegaudenc_get_property (GObject * object,
     guint prop_id, GValue * value, GParamSpec * pspec);
 
+static gboolean gst_ffmpegaudenc_parallel_open (GstFFMpegAudEnc *
+    ffmpegaudenc, GstAudioInfo * info, GstCaps * allowed_caps);
+static void gst_ffmpegaudenc_parallel_discard (GstFFMpegAudEnc * ffmpegaudenc);
+static void gst_ffmpegaudenc_parallel_close (GstFFMpegAudEnc * ffmpegaudenc);
+static void gst_ffmpegaudenc_open_pool (GstFFMpegAudEnc * ffmpegaudenc,
+    GstAudioInfo * info);
+static void gst_ffmpegaudenc_close_pool (GstFFMpegAudEnc * ffmpegaudenc);
+
 #define GST_FFENC_PARAMS_QDATA g_quark_from_static_string("avenc-params")
 
 static GstElementClass *parent_class = NULL;
 
 /*static guint gst_ffmpegaudenc_signals[LAST_SIGNAL] = { 0 }; */
 
+/* encoders that carry no state from one frame to the next, so frames can be
+ * encoded on independent contexts with identical output */
+static gboolean
+gst_ffmpegaudenc_is_stateless (enum AVCodecID codec_id)
+{
+  switch (codec_id) {
+    case AV_CODEC_ID_ALAC:
+    case AV_CODEC_ID_TTA:
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+#if GST_CHECK_VERSION(1,15,1)
+/* planar encoders can take non-interleaved audio without copying it, but
+ * only in the formats they accept as planar. Older base classes have no
+ * GstAudioMeta and would clip such buffers as if they were interleaved */
+static void
+gst_ffmpegaudenc_add_non_interleaved (GstCaps * caps, AVCodec * codec)
+{
+  const enum AVSampleFormat *fmts = codec->sample_fmts;
+  GValue va = { 0, };
+  GValue v = { 0, };
+  GstAudioFormat format;
+  GstCaps *planar;
+  guint i;
+
+  if (!fmts)
+    return;
+
+  g_value_init (&va, GST_TYPE_LIST);
+  g_value_init (&v, G_TYPE_STRING);
+  for (; *fmts != -1; fmts++) {
+    if (!av_sample_fmt_is_planar (*fmts))
+      continue;
+    format = gst_ffmpeg_smpfmt_to_audioformat (*fmts);
+    if (format == GST_AUDIO_FORMAT_UNKNOWN)
+      continue;
+    g_value_set_string (&v, gst_audio_format_to_string (format));
+    gst_value_list_append_value (&va, &v);
+  }
+
+  if (gst_value_list_get_size (&va) > 0) {
+    planar = gst_caps_copy (caps);
+    for (i = 0; i < gst_caps_get_size (planar); i++) {
+      GstStructure *s = gst_caps_get_structure (planar, i);
+
+      gst_structure_set (s, "layout", G_TYPE_STRING, "non-interleaved", NULL);
+      if (gst_value_list_get_size (&va) == 1)
+        gst_structure_set_value (s, "format", &v);
+      else
+        gst_structure_set_value (s, "format", &va);
+    }
+    gst_caps_append (caps, planar);
+  }
+  g_value_unset (&v);
+  g_value_unset (&va);
+}
+#endif
+
 static void
 gst_ffmpegaudenc_base_init (GstFFMpegAudEncClass * klass)
 {
@@ -114,6 +189,10 @@ gst_ffmpegaudenc_base_init (GstFFMpegAudEncClass * klass)
   if (!sinkcaps) {
     GST_DEBUG ("Couldn't get sink caps for encoder '%s'", in_plugin->name);
     sinkcaps = gst_caps_new_empty_simple ("unknown/unknown");
+  } else {
+#if GST_CHECK_VERSION(1,15,1)
+    gst_ffmpegaudenc_add_non_interleaved (sinkcaps, in_plugin);
+#endif
   }
 
   /* pad templates */
@@ -158,6 +237,24 @@ gst_ffmpegaudenc_class_init (GstFFMpegAudEncClass * klass)
           "Adherence of the encoder to the specifications",
           GST_TYPE_FFMPEG_COMPLIANCE, FFMPEG_DEFAULT_COMPLIANCE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (G_OBJECT_CLASS (klass),
+      PROP_FRAMES_PER_BUFFER, g_param_spec_int ("frames-per-buffer",
+          "Frames per buffer",
+          "Maximum number of codec frames to encode per input buffer, for "
+          "codecs with a fixed frame size", 1, G_MAXINT,
+          DEFAULT_FRAMES_PER_BUFFER,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  if (gst_ffmpegaudenc_is_stateless (klass->in_plugin->id)) {
+    g_object_class_install_property (G_OBJECT_CLASS (klass),
+        PROP_PARALLEL_CONTEXTS, g_param_spec_int ("parallel-contexts",
+            "Parallel encoding contexts",
+            "Number of encoding contexts that frames are dispatched to in "
+            "parallel. Output is delayed by up to that many frames "
+            "(0 = disabled)", 0, MAX_PARALLEL_CONTEXTS,
+            DEFAULT_PARALLEL_CONTEXTS,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  }
 
   gobject_class->finalize = gst_ffmpegaudenc_finalize;
 
@@ -184,6 +281,12 @@ gst_ffmpegaudenc_init (GstFFMpegAudEnc * ffmpegaudenc)
   ffmpegaudenc->frame = av_frame_alloc ();
 
   ffmpegaudenc->compliance = FFMPEG_DEFAULT_COMPLIANCE;
+  ffmpegaudenc->frames_per_buffer = DEFAULT_FRAMES_PER_BUFFER;
+  ffmpegaudenc->parallel_contexts = DEFAULT_PARALLEL_CONTEXTS;
+
+  g_queue_init (&ffmpegaudenc->parallel_jobs);
+  g_mutex_init (&ffmpegaudenc->parallel_lock);
+  g_cond_init (&ffmpegaudenc->parallel_cond);
 
   gst_audio_encoder_set_drainable (GST_AUDIO_ENCODER (ffmpegaudenc), TRUE);
 }
@@ -194,7 +297,14 @@ gst_ffmpegaudenc_finalize (GObject * object)
   GstFFMpegAudEnc *ffmpegaudenc = (GstFFMpegAudEnc *) object;
 
   /* clean up remaining allocated data */
+  gst_ffmpegaudenc_parallel_close (ffmpegaudenc);
+  gst_ffmpegaudenc_close_pool (ffmpegaudenc);
+  g_mutex_clear (&ffmpegaudenc->parallel_lock);
+  g_cond_clear (&ffmpegaudenc->parallel_cond);
   av_frame_free (&ffmpegaudenc->frame);
+  av_freep (&ffmpegaudenc->staging);
+  if (ffmpegaudenc->fifo)
+    av_audio_fifo_free (ffmpegaudenc->fifo);
   gst_ffmpeg_avcodec_close (ffmpegaudenc->context);
   av_free (ffmpegaudenc->context);
 
@@ -224,9 +334,16 @@ gst_ffmpegaudenc_stop (GstAudioEncoder * encoder)
   GstFFMpegAudEnc *ffmpegaudenc = (GstFFMpegAudEnc *) encoder;
 
   /* close old session */
+  gst_ffmpegaudenc_parallel_close (ffmpegaudenc);
+  gst_ffmpegaudenc_close_pool (ffmpegaudenc);
   gst_ffmpeg_avcodec_close (ffmpegaudenc->context);
   ffmpegaudenc->opened = FALSE;
 
+  if (ffmpegaudenc->fifo) {
+    av_audio_fifo_free (ffmpegaudenc->fifo);
+    ffmpegaudenc->fifo = NULL;
+  }
+
   return TRUE;
 }
 
@@ -238,74 +355,120 @@ gst_ffmpegaudenc_flush (GstAudioEncoder * encoder)
   if (ffmpegaudenc->opened) {
     avcodec_flush_buffers (ffmpegaudenc->context);
   }
+  if (ffmpegaudenc->fifo)
+    av_audio_fifo_reset (ffmpegaudenc->fifo);
+  gst_ffmpegaudenc_parallel_discard (ffmpegaudenc);
 }
 
-static gboolean
-gst_ffmpegaudenc_set_format (GstAudioEncoder * encoder, GstAudioInfo * info)
+/* samples are held back for the priming samples, until a frame is complete
+ * and for every frame in flight on a parallel context */
+static void
+gst_ffmpegaudenc_update_latency (GstFFMpegAudEnc * ffmpegaudenc)
+{
+  AVCodecContext *ctx = ffmpegaudenc->context;
+  GstClockTime latency;
+  guint64 samples;
+
+  if (ctx->sample_rate <= 0)
+    return;
+
+  samples = MAX (ctx->initial_padding, 0);
+  if (ctx->frame_size > 1)
+    samples += (guint64) ctx->frame_size *
+        (1 + ffmpegaudenc->parallel_n_contexts);
+
+  latency = gst_util_uint64_scale_ceil (samples, GST_SECOND, ctx->sample_rate);
+
+  GST_DEBUG_OBJECT (ffmpegaudenc, "latency %" G_GUINT64_FORMAT " samples, %"
+      GST_TIME_FORMAT, samples, GST_TIME_ARGS (latency));
+  gst_audio_encoder_set_latency (GST_AUDIO_ENCODER (ffmpegaudenc), latency,
+      latency);
+}
+
+/* applies the settings and the input format to @context, the main context
+ * and the parallel contexts are all set up this way */
+static void
+gst_ffmpegaudenc_configure_context (GstFFMpegAudEnc * ffmpegaudenc,
+    AVCodecContext * context, GstAudioInfo * info, GstCaps * allowed_caps)
 {
-  GstFFMpegAudEnc *ffmpegaudenc = (GstFFMpegAudEnc *) encoder;
-  GstCaps *other_caps;
-  GstCaps *allowed_caps;
-  GstCaps *icaps;
-  gsize frame_size;
   GstFFMpegAudEncClass *oclass =
       (GstFFMpegAudEncClass *) G_OBJECT_GET_CLASS (ffmpegaudenc);
 
-  /* close old session */
-  if (ffmpegaudenc->opened) {
-    gst_ffmpeg_avcodec_close (ffmpegaudenc->context);
-    ffmpegaudenc->opened = FALSE;
-    if (avcodec_get_context_defaults3 (ffmpegaudenc->context,
-            oclass->in_plugin) < 0) {
-      GST_DEBUG_OBJECT (ffmpegaudenc, "Failed to set context defaults");
-      return FALSE;
-    }
-  }
-
   /* if we set it in _getcaps we should set it also in _link */
-  ffmpegaudenc->context->strict_std_compliance = ffmpegaudenc->compliance;
+  context->strict_std_compliance = ffmpegaudenc->compliance;
 
   /* user defined properties */
   if (ffmpegaudenc->bitrate > 0) {
     GST_INFO_OBJECT (ffmpegaudenc, "Setting avcontext to bitrate %d",
         ffmpegaudenc->bitrate);
-    ffmpegaudenc->context->bit_rate = ffmpegaudenc->bitrate;
-    ffmpegaudenc->context->bit_rate_tolerance = ffmpegaudenc->bitrate;
+    context->bit_rate = ffmpegaudenc->bitrate;
+    context->bit_rate_tolerance = ffmpegaudenc->bitrate;
   } else {
     GST_INFO_OBJECT (ffmpegaudenc,
         "Using avcontext default bitrate %" G_GINT64_FORMAT,
-        (gint64) ffmpegaudenc->context->bit_rate);
+        (gint64) context->bit_rate);
   }
 
   /* RTP payload used for GOB production (for Asterisk) */
   if (ffmpegaudenc->rtp_payload_size) {
-    ffmpegaudenc->context->rtp_payload_size = ffmpegaudenc->rtp_payload_size;
+    context->rtp_payload_size = ffmpegaudenc->rtp_payload_size;
   }
 
   /* some other defaults */
-  ffmpegaudenc->context->rc_strategy = 2;
-  ffmpegaudenc->context->b_frame_strategy = 0;
-  ffmpegaudenc->context->coder_type = 0;
-  ffmpegaudenc->context->context_model = 0;
-  ffmpegaudenc->context->scenechange_threshold = 0;
+  context->rc_strategy = 2;
+  context->b_frame_strategy = 0;
+  context->coder_type = 0;
+  context->context_model = 0;
+  context->scenechange_threshold = 0;
 
   /* fetch pix_fmt and so on */
-  gst_ffmpeg_audioinfo_to_context (info, ffmpegaudenc->context);
-  if (!ffmpegaudenc->context->time_base.den) {
-    ffmpegaudenc->context->time_base.den = GST_AUDIO_INFO_RATE (info);
-    ffmpegaudenc->context->time_base.num = 1;
-    ffmpegaudenc->context->ticks_per_frame = 1;
+  gst_ffmpeg_audioinfo_to_context (info, context);
+
+  if (ffmpegaudenc->non_interleaved)
+    context->sample_fmt = av_get_planar_sample_fmt (context->sample_fmt);
+  if (!context->time_base.den) {
+    context->time_base.den = GST_AUDIO_INFO_RATE (info);
+    context->time_base.num = 1;
+    context->ticks_per_frame = 1;
   }
 
-  if (ffmpegaudenc->context->channel_layout) {
-    gst_ffmpeg_channel_layout_to_gst (ffmpegaudenc->context->channel_layout,
-        ffmpegaudenc->context->channels, ffmpegaudenc->ffmpeg_layout);
-    ffmpegaudenc->needs_reorder =
-        (memcmp (ffmpegaudenc->ffmpeg_layout, info->position,
-            sizeof (GstAudioChannelPosition) *
-            ffmpegaudenc->context->channels) != 0);
+  gst_ffmpeg_caps_with_codecid (oclass->in_plugin->id,
+      oclass->in_plugin->type, allowed_caps, context);
+}
+
+static gboolean
+gst_ffmpegaudenc_set_format (GstAudioEncoder * encoder, GstAudioInfo * info)
+{
+  GstFFMpegAudEnc *ffmpegaudenc = (GstFFMpegAudEnc *) encoder;
+  GstCaps *other_caps;
+  GstCaps *allowed_caps;
+  GstCaps *icaps;
+  gsize frame_size;
+  GstFFMpegAudEncClass *oclass =
+      (GstFFMpegAudEncClass *) G_OBJECT_GET_CLASS (ffmpegaudenc);
+
+  /* close old session */
+  if (ffmpegaudenc->opened) {
+    gst_ffmpegaudenc_parallel_close (ffmpegaudenc);
+    gst_ffmpegaudenc_close_pool (ffmpegaudenc);
+    gst_ffmpeg_avcodec_close (ffmpegaudenc->context);
+    ffmpegaudenc->opened = FALSE;
+    if (avcodec_get_context_defaults3 (ffmpegaudenc->context,
+            oclass->in_plugin) < 0) {
+      GST_DEBUG_OBJECT (ffmpegaudenc, "Failed to set context defaults");
+      return FALSE;
+    }
+  }
+  if (ffmpegaudenc->fifo) {
+    av_audio_fifo_free (ffmpegaudenc->fifo);
+    ffmpegaudenc->fifo = NULL;
   }
 
+  /* the sink caps only offer non-interleaved audio in formats the codec
+   * takes as planar, so the planes can be passed as they are */
+  ffmpegaudenc->non_interleaved =
+      GST_AUDIO_INFO_LAYOUT (info) == GST_AUDIO_LAYOUT_NON_INTERLEAVED;
+
   /* some codecs support more than one format, first auto-choose one */
   GST_DEBUG_OBJECT (ffmpegaudenc, "picking an output format ...");
   allowed_caps = gst_pad_get_allowed_caps (GST_AUDIO_ENCODER_SRC_PAD (encoder));
@@ -317,8 +480,22 @@ gst_ffmpegaudenc_set_format (GstAudioEncoder * encoder, GstAudioInfo * info)
         gst_pad_get_pad_template_caps (GST_AUDIO_ENCODER_SRC_PAD (encoder));
   }
   GST_DEBUG_OBJECT (ffmpegaudenc, "chose caps %" GST_PTR_FORMAT, allowed_caps);
-  gst_ffmpeg_caps_with_codecid (oclass->in_plugin->id,
-      oclass->in_plugin->type, allowed_caps, ffmpegaudenc->context);
+
+  gst_ffmpegaudenc_configure_context (ffmpegaudenc, ffmpegaudenc->context,
+      info, allowed_caps);
+
+  if (ffmpegaudenc->context->channel_layout) {
+    gst_ffmpeg_channel_layout_to_gst (ffmpegaudenc->context->channel_layout,
+        ffmpegaudenc->context->channels, ffmpegaudenc->ffmpeg_layout);
+    ffmpegaudenc->needs_reorder =
+        (memcmp (ffmpegaudenc->ffmpeg_layout, info->position,
+            sizeof (GstAudioChannelPosition) *
+            ffmpegaudenc->context->channels) != 0);
+    if (ffmpegaudenc->needs_reorder)
+      gst_audio_get_channel_reorder_map (ffmpegaudenc->context->channels,
+          info->position, ffmpegaudenc->ffmpeg_layout,
+          ffmpegaudenc->reorder_map);
+  }
 
   /* open codec */
   if (gst_ffmpeg_avcodec_open (ffmpegaudenc->context, oclass->in_plugin) < 0) {
@@ -357,9 +534,9 @@ gst_ffmpegaudenc_set_format (GstAudioEncoder * encoder, GstAudioInfo * info)
   }
 
   icaps = gst_caps_intersect (allowed_caps, other_caps);
-  gst_caps_unref (allowed_caps);
   gst_caps_unref (other_caps);
   if (gst_caps_is_empty (icaps)) {
+    gst_caps_unref (allowed_caps);
     gst_caps_unref (icaps);
     return FALSE;
   }
@@ -368,6 +545,7 @@ gst_ffmpegaudenc_set_format (GstAudioEncoder * encoder, GstAudioInfo * info)
   if (!gst_audio_encoder_set_output_format (GST_AUDIO_ENCODER (ffmpegaudenc),
           icaps)) {
     gst_ffmpeg_avcodec_close (ffmpegaudenc->context);
+    gst_caps_unref (allowed_caps);
     gst_caps_unref (icaps);
     if (avcodec_get_context_defaults3 (ffmpegaudenc->context,
             oclass->in_plugin) < 0)
@@ -377,12 +555,28 @@ gst_ffmpegaudenc_set_format (GstAudioEncoder * encoder, GstAudioInfo * info)
   gst_caps_unref (icaps);
 
   frame_size = ffmpegaudenc->context->frame_size;
-  if (frame_size > 1) {
+  if (ffmpegaudenc->non_interleaved) {
+    /* the base class would cut planar buffers at the wrong places, so take
+     * whatever arrives and frame it ourselves if the codec needs that */
+    gst_audio_encoder_set_frame_samples_min (GST_AUDIO_ENCODER (ffmpegaudenc),
+        0);
+    gst_audio_encoder_set_frame_samples_max (GST_AUDIO_ENCODER (ffmpegaudenc),
+        0);
+    gst_audio_encoder_set_frame_max (GST_AUDIO_ENCODER (ffmpegaudenc), 0);
+    if (frame_size > 1 && !(oclass->in_plugin->capabilities &
+            CODEC_CAP_VARIABLE_FRAME_SIZE))
+      ffmpegaudenc->fifo =
+          av_audio_fifo_alloc (ffmpegaudenc->context->sample_fmt,
+          ffmpegaudenc->context->channels, frame_size);
+  } else if (frame_size > 1) {
     gst_audio_encoder_set_frame_samples_min (GST_AUDIO_ENCODER (ffmpegaudenc),
         frame_size);
     gst_audio_encoder_set_frame_samples_max (GST_AUDIO_ENCODER (ffmpegaudenc),
         frame_size);
-    gst_audio_encoder_set_frame_max (GST_AUDIO_ENCODER (ffmpegaudenc), 1);
+    /* several frames per call save a map and the base class bookkeeping
+     * for every frame of codecs with small frames */
+    gst_audio_encoder_set_frame_max (GST_AUDIO_ENCODER (ffmpegaudenc),
+        ffmpegaudenc->frames_per_buffer);
   } else {
     gst_audio_encoder_set_frame_samples_min (GST_AUDIO_ENCODER (ffmpegaudenc),
         0);
@@ -391,6 +585,24 @@ gst_ffmpegaudenc_set_format (GstAudioEncoder * encoder, GstAudioInfo * info)
     gst_audio_encoder_set_frame_max (GST_AUDIO_ENCODER (ffmpegaudenc), 0);
   }
 
+  /* size the staging area for planar codecs up front */
+  if (av_sample_fmt_is_planar (ffmpegaudenc->context->sample_fmt)
+      && frame_size > 1)
+    av_fast_malloc (&ffmpegaudenc->staging, &ffmpegaudenc->staging_size,
+        frame_size * GST_AUDIO_INFO_BPF (info));
+
+  /* falls back to encoding on the streaming thread if this fails */
+  if (ffmpegaudenc->parallel_contexts > 0
+      && gst_ffmpegaudenc_is_stateless (oclass->in_plugin->id))
+    gst_ffmpegaudenc_parallel_open (ffmpegaudenc, info, allowed_caps);
+  gst_caps_unref (allowed_caps);
+
+  /* the parallel contexts hand over packets allocated by libav */
+  if (!ffmpegaudenc->parallel_pool)
+    gst_ffmpegaudenc_open_pool (ffmpegaudenc, info);
+
+  gst_ffmpegaudenc_update_latency (ffmpegaudenc);
+
   /* Store some tags */
   {
     GstTagList *tags = gst_tag_list_new_empty ();
@@ -415,231 +627,680 @@ gst_ffmpegaudenc_set_format (GstAudioEncoder * encoder, GstAudioInfo * info)
 }
 
 static void
-gst_ffmpegaudenc_free_avpacket (gpointer pkt)
+gst_ffmpegaudenc_free_avbuffer (gpointer buf)
 {
-  av_packet_unref ((AVPacket *) pkt);
-  g_slice_free (AVPacket, pkt);
+  AVBufferRef *ref = buf;
+
+  av_buffer_unref (&ref);
 }
 
-typedef struct
+/* Lossless codecs produce packets of about the raw size of a frame, so
+ * buffers of the worst case size waste little and libav can write every
+ * packet into one of them instead of allocating it. Most reserve at most
+ * twice the raw size, the others encode to their own buffer and copy the
+ * packet over. */
+static void
+gst_ffmpegaudenc_open_pool (GstFFMpegAudEnc * ffmpegaudenc,
+    GstAudioInfo * info)
 {
-  GstBuffer *buffer;
-  GstMapInfo map;
+  AVCodecContext *ctx = ffmpegaudenc->context;
+  const AVCodecDescriptor *desc;
+  GstStructure *config;
+  guint size;
+
+  desc = avcodec_descriptor_get (ctx->codec_id);
+  if (!desc || !(desc->props & AV_CODEC_PROP_LOSSLESS))
+    return;
+  if (ctx->frame_size <= 1
+      || (ctx->codec->capabilities & CODEC_CAP_VARIABLE_FRAME_SIZE))
+    return;
+
+  size = 2 * ctx->frame_size * GST_AUDIO_INFO_BPF (info) +
+      AV_INPUT_BUFFER_MIN_SIZE;
+
+  ffmpegaudenc->pool = gst_buffer_pool_new ();
+  config = gst_buffer_pool_get_config (ffmpegaudenc->pool);
+  gst_buffer_pool_config_set_params (config, NULL, size, 0, 0);
+  if (!gst_buffer_pool_set_config (ffmpegaudenc->pool, config)
+      || !gst_buffer_pool_set_active (ffmpegaudenc->pool, TRUE)) {
+    GST_WARNING_OBJECT (ffmpegaudenc, "Failed to activate the output pool");
+    gst_object_unref (ffmpegaudenc->pool);
+    ffmpegaudenc->pool = NULL;
+  }
+}
+
+static void
+gst_ffmpegaudenc_close_pool (GstFFMpegAudEnc * ffmpegaudenc)
+{
+  if (ffmpegaudenc->pool) {
+    gst_buffer_pool_set_active (ffmpegaudenc->pool, FALSE);
+    gst_object_unref (ffmpegaudenc->pool);
+    ffmpegaudenc->pool = NULL;
+  }
+}
+
+/* the planes of our frames belong to the input or the staging area, and
+ * with many channels so does the extended_data array, none of which libav
+ * may free */
+static void
+gst_ffmpegaudenc_unref_frame (AVFrame * frame)
+{
+  frame->extended_data = frame->data;
+  av_frame_unref (frame);
+}
+
+/* lays out @channels planes of @linesize bytes in the staging area, which
+ * is reused for every frame since libav doesn't keep the frames we give it
+ * and only grows when a larger frame comes along */
+static gboolean
+gst_ffmpegaudenc_stage_planes (GstFFMpegAudEnc * ffmpegaudenc, gint channels,
+    gint linesize)
+{
+  gint i;
 
-  guint8 **ext_data_array, *ext_data;
-} BufferInfo;
+  av_fast_malloc (&ffmpegaudenc->staging, &ffmpegaudenc->staging_size,
+      channels * linesize);
+  if (!ffmpegaudenc->staging)
+    return FALSE;
+
+  for (i = 0; i < channels; i++)
+    ffmpegaudenc->planes[i] = ffmpegaudenc->staging + i * linesize;
+
+  return TRUE;
+}
+
+/* sets up @frame for @nsamples samples in the codec's format */
+static void
+gst_ffmpegaudenc_init_frame (GstFFMpegAudEnc * ffmpegaudenc, AVFrame * frame,
+    gint nsamples)
+{
+  AVCodecContext *ctx = ffmpegaudenc->context;
+
+  frame->format = ctx->sample_fmt;
+  frame->sample_rate = ctx->sample_rate;
+  frame->channels = ctx->channels;
+  frame->channel_layout = ctx->channel_layout;
+  frame->nb_samples = nsamples;
+}
 
+/* points @frame at the planes in ffmpegaudenc->planes */
 static void
-buffer_info_free (void *opaque, guint8 * data)
+gst_ffmpegaudenc_set_planes (GstFFMpegAudEnc * ffmpegaudenc, AVFrame * frame,
+    gint channels, gint linesize)
 {
-  BufferInfo *info = opaque;
+  gint i;
+
+  for (i = 0; i < MIN (channels, AV_NUM_DATA_POINTERS); i++)
+    frame->data[i] = ffmpegaudenc->planes[i];
+  if (channels > AV_NUM_DATA_POINTERS)
+    frame->extended_data = ffmpegaudenc->planes;
+  else
+    frame->extended_data = frame->data;
+  frame->linesize[0] = linesize;
+}
 
-  if (info->buffer) {
-    gst_buffer_unmap (info->buffer, &info->map);
-    gst_buffer_unref (info->buffer);
+/* pushes the encoded @pkt, which represents @nsamples input samples. The
+ * packet was written into @outbuf if that is not NULL */
+static GstFlowReturn
+gst_ffmpegaudenc_finish_packet (GstFFMpegAudEnc * ffmpegaudenc,
+    AVPacket * pkt, GstBuffer * outbuf, gint nsamples)
+{
+  GST_LOG_OBJECT (ffmpegaudenc, "pushing size %d", pkt->size);
+
+  if (outbuf) {
+    gst_buffer_resize (outbuf, 0, pkt->size);
+  } else if (pkt->buf) {
+    /* the output buffer takes over the packet's reference */
+    outbuf =
+        gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, pkt->data,
+        pkt->size, 0, pkt->size, pkt->buf, gst_ffmpegaudenc_free_avbuffer);
+    pkt->buf = NULL;
   } else {
-    av_free (info->ext_data);
-    av_free (info->ext_data_array);
+    outbuf = gst_buffer_new_allocate (NULL, pkt->size, NULL);
+    gst_buffer_fill (outbuf, 0, pkt->data, pkt->size);
   }
-  g_slice_free (BufferInfo, info);
+  av_packet_unref (pkt);
+
+  return gst_audio_encoder_finish_frame (GST_AUDIO_ENCODER (ffmpegaudenc),
+      outbuf, nsamples);
 }
 
-static GstFlowReturn
-gst_ffmpegaudenc_encode_audio (GstFFMpegAudEnc * ffmpegaudenc,
-    GstBuffer * buffer, gint * have_data)
+typedef struct
 {
-  GstAudioEncoder *enc;
-  AVCodecContext *ctx;
+  AVFrame *frame;
+  gint nsamples;
+  AVPacket pkt;
+  gint have_data;
   gint res;
-  GstFlowReturn ret;
-  GstAudioInfo *info;
-  AVPacket *pkt;
-  AVFrame *frame = ffmpegaudenc->frame;
-  gboolean planar;
-  gint nsamples = -1;
+  gboolean done;
+} GstFFMpegAudEncParallelJob;
 
-  enc = GST_AUDIO_ENCODER (ffmpegaudenc);
-
-  ctx = ffmpegaudenc->context;
+static void
+gst_ffmpegaudenc_parallel_job_free (GstFFMpegAudEncParallelJob * job)
+{
+  av_frame_free (&job->frame);
+  av_packet_unref (&job->pkt);
+  g_slice_free (GstFFMpegAudEncParallelJob, job);
+}
 
-  pkt = g_slice_new0 (AVPacket);
+/* runs in the thread pool, encodes one frame on any idle context */
+static void
+gst_ffmpegaudenc_parallel_encode (GstFFMpegAudEncParallelJob * job,
+    GstFFMpegAudEnc * ffmpegaudenc)
+{
+  AVCodecContext *context;
 
-  if (buffer != NULL) {
-    BufferInfo *buffer_info = g_slice_new0 (BufferInfo);
-    guint8 *audio_in;
-    guint in_size;
+  context = g_async_queue_pop (ffmpegaudenc->parallel_idle);
+  job->res = avcodec_encode_audio2 (context, &job->pkt, job->frame,
+      &job->have_data);
+  g_async_queue_push (ffmpegaudenc->parallel_idle, context);
 
-    buffer_info->buffer = buffer;
-    gst_buffer_map (buffer, &buffer_info->map, GST_MAP_READ);
-    audio_in = buffer_info->map.data;
-    in_size = buffer_info->map.size;
+  av_frame_free (&job->frame);
 
-    GST_LOG_OBJECT (ffmpegaudenc, "encoding buffer %p size:%u", audio_in,
-        in_size);
+  g_mutex_lock (&ffmpegaudenc->parallel_lock);
+  job->done = TRUE;
+  g_cond_broadcast (&ffmpegaudenc->parallel_cond);
+  g_mutex_unlock (&ffmpegaudenc->parallel_lock);
+}
 
-    info = gst_audio_encoder_get_audio_info (enc);
-    planar = av_sample_fmt_is_planar (ffmpegaudenc->context->sample_fmt);
-    frame->format = ffmpegaudenc->context->sample_fmt;
-    frame->sample_rate = ffmpegaudenc->context->sample_rate;
-    frame->channels = ffmpegaudenc->context->channels;
-    frame->channel_layout = ffmpegaudenc->context->channel_layout;
+static void
+gst_ffmpegaudenc_parallel_wait (GstFFMpegAudEnc * ffmpegaudenc,
+    GstFFMpegAudEncParallelJob * job)
+{
+  g_mutex_lock (&ffmpegaudenc->parallel_lock);
+  while (!job->done)
+    g_cond_wait (&ffmpegaudenc->parallel_cond, &ffmpegaudenc->parallel_lock);
+  g_mutex_unlock (&ffmpegaudenc->parallel_lock);
+}
 
-    if (planar && info->channels > 1) {
-      gint channels;
-      gint i, j;
+/* waits for all jobs in flight and drops their output */
+static void
+gst_ffmpegaudenc_parallel_discard (GstFFMpegAudEnc * ffmpegaudenc)
+{
+  GstFFMpegAudEncParallelJob *job;
 
-      nsamples = frame->nb_samples = in_size / info->bpf;
-      channels = info->channels;
+  while ((job = g_queue_pop_head (&ffmpegaudenc->parallel_jobs))) {
+    gst_ffmpegaudenc_parallel_wait (ffmpegaudenc, job);
+    gst_ffmpegaudenc_parallel_job_free (job);
+  }
+}
 
-      frame->buf[0] =
-          av_buffer_create (NULL, 0, buffer_info_free, buffer_info, 0);
+static void
+gst_ffmpegaudenc_parallel_close (GstFFMpegAudEnc * ffmpegaudenc)
+{
+  AVCodecContext *context;
 
-      if (info->channels > AV_NUM_DATA_POINTERS) {
-        buffer_info->ext_data_array = frame->extended_data =
-            av_malloc_array (info->channels, sizeof (uint8_t *));
-      } else {
-        frame->extended_data = frame->data;
-      }
+  gst_ffmpegaudenc_parallel_discard (ffmpegaudenc);
 
-      buffer_info->ext_data = frame->extended_data[0] = av_malloc (in_size);
-      frame->linesize[0] = in_size / channels;
-      for (i = 1; i < channels; i++)
-        frame->extended_data[i] =
-            frame->extended_data[i - 1] + frame->linesize[0];
-
-      switch (info->finfo->width) {
-        case 8:{
-          const guint8 *idata = (const guint8 *) audio_in;
-
-          for (i = 0; i < nsamples; i++) {
-            for (j = 0; j < channels; j++) {
-              ((guint8 *) frame->extended_data[j])[i] = idata[j];
-            }
-            idata += channels;
-          }
-          break;
-        }
-        case 16:{
-          const guint16 *idata = (const guint16 *) audio_in;
-
-          for (i = 0; i < nsamples; i++) {
-            for (j = 0; j < channels; j++) {
-              ((guint16 *) frame->extended_data[j])[i] = idata[j];
-            }
-            idata += channels;
-          }
-          break;
-        }
-        case 32:{
-          const guint32 *idata = (const guint32 *) audio_in;
-
-          for (i = 0; i < nsamples; i++) {
-            for (j = 0; j < channels; j++) {
-              ((guint32 *) frame->extended_data[j])[i] = idata[j];
-            }
-            idata += channels;
-          }
-
-          break;
-        }
-        case 64:{
-          const guint64 *idata = (const guint64 *) audio_in;
-
-          for (i = 0; i < nsamples; i++) {
-            for (j = 0; j < channels; j++) {
-              ((guint64 *) frame->extended_data[j])[i] = idata[j];
-            }
-            idata += channels;
-          }
-
-          break;
-        }
-        default:
-          g_assert_not_reached ();
-          break;
-      }
+  if (ffmpegaudenc->parallel_pool) {
+    g_thread_pool_free (ffmpegaudenc->parallel_pool, FALSE, TRUE);
+    ffmpegaudenc->parallel_pool = NULL;
+  }
 
-      gst_buffer_unmap (buffer, &buffer_info->map);
-      gst_buffer_unref (buffer);
-      buffer_info->buffer = NULL;
-    } else {
-      frame->data[0] = audio_in;
-      frame->extended_data = frame->data;
-      frame->linesize[0] = in_size;
-      frame->nb_samples = nsamples = in_size / info->bpf;
-      frame->buf[0] =
-          av_buffer_create (NULL, 0, buffer_info_free, buffer_info, 0);
+  if (ffmpegaudenc->parallel_idle) {
+    while ((context = g_async_queue_try_pop (ffmpegaudenc->parallel_idle))) {
+      gst_ffmpeg_avcodec_close (context);
+      avcodec_free_context (&context);
     }
+    g_async_queue_unref (ffmpegaudenc->parallel_idle);
+    ffmpegaudenc->parallel_idle = NULL;
+  }
+  ffmpegaudenc->parallel_n_contexts = 0;
+}
+
+/* the contexts are set up like the main context, which must be open
+ * already */
+static gboolean
+gst_ffmpegaudenc_parallel_open (GstFFMpegAudEnc * ffmpegaudenc,
+    GstAudioInfo * info, GstCaps * allowed_caps)
+{
+  GstFFMpegAudEncClass *oclass;
+  AVCodecContext *context;
+  gint i;
+
+  oclass = (GstFFMpegAudEncClass *) (G_OBJECT_GET_CLASS (ffmpegaudenc));
+
+  ffmpegaudenc->parallel_idle = g_async_queue_new ();
+
+  for (i = 0; i < ffmpegaudenc->parallel_contexts; i++) {
+    context = avcodec_alloc_context3 (oclass->in_plugin);
+    gst_ffmpegaudenc_configure_context (ffmpegaudenc, context, info,
+        allowed_caps);
+
+    if (gst_ffmpeg_avcodec_open (context, oclass->in_plugin) < 0)
+      goto could_not_open;
+
+    g_async_queue_push (ffmpegaudenc->parallel_idle, context);
+    ffmpegaudenc->parallel_n_contexts++;
+  }
+
+  ffmpegaudenc->parallel_pool =
+      g_thread_pool_new ((GFunc) gst_ffmpegaudenc_parallel_encode,
+      ffmpegaudenc, ffmpegaudenc->parallel_n_contexts, TRUE, NULL);
+
+  GST_DEBUG_OBJECT (ffmpegaudenc, "encoding with %d parallel contexts",
+      ffmpegaudenc->parallel_n_contexts);
+
+  return TRUE;
+
+  /* ERRORS */
+could_not_open:
+  {
+    GST_WARNING_OBJECT (ffmpegaudenc, "Failed to open parallel context %d",
+        i);
+    avcodec_free_context (&context);
+    gst_ffmpegaudenc_parallel_close (ffmpegaudenc);
+    return FALSE;
+  }
+}
+
+/* waits for the oldest job in flight and finishes its input samples */
+static GstFlowReturn
+gst_ffmpegaudenc_parallel_output (GstFFMpegAudEnc * ffmpegaudenc)
+{
+  GstFFMpegAudEncParallelJob *job;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  job = g_queue_pop_head (&ffmpegaudenc->parallel_jobs);
+  gst_ffmpegaudenc_parallel_wait (ffmpegaudenc, job);
+
+  if (job->res < 0) {
+    char error_str[128] = { 0, };
+
+    av_strerror (job->res, error_str, sizeof (error_str));
+    GST_ERROR_OBJECT (ffmpegaudenc, "Failed to encode buffer: %d - %s",
+        job->res, error_str);
+  } else if (job->have_data) {
+    /* stateless encoders output exactly the frame they were given */
+    ret = gst_ffmpegaudenc_finish_packet (ffmpegaudenc, &job->pkt, NULL,
+        job->nsamples);
+  }
+  gst_ffmpegaudenc_parallel_job_free (job);
+
+  return ret;
+}
+
+static gboolean
+gst_ffmpegaudenc_parallel_head_done (GstFFMpegAudEnc * ffmpegaudenc)
+{
+  GstFFMpegAudEncParallelJob *job;
+  gboolean done;
 
+  job = g_queue_peek_head (&ffmpegaudenc->parallel_jobs);
+  if (job == NULL)
+    return FALSE;
+
+  g_mutex_lock (&ffmpegaudenc->parallel_lock);
+  done = job->done;
+  g_mutex_unlock (&ffmpegaudenc->parallel_lock);
+
+  return done;
+}
+
+/* Frames of stateless encoders don't depend on each other, so every frame
+ * is handed to the thread pool. Output is finished in input order as soon as
+ * it is ready, we only block when all contexts are busy. */
+static GstFlowReturn
+gst_ffmpegaudenc_parallel_push (GstFFMpegAudEnc * ffmpegaudenc,
+    AVFrame * frame, gint nsamples)
+{
+  GstFFMpegAudEncParallelJob *job;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  while (ret == GST_FLOW_OK &&
+      g_queue_get_length (&ffmpegaudenc->parallel_jobs) >=
+      ffmpegaudenc->parallel_n_contexts)
+    ret = gst_ffmpegaudenc_parallel_output (ffmpegaudenc);
+
+  if (ret != GST_FLOW_OK) {
+    gst_ffmpegaudenc_unref_frame (frame);
+    return ret;
+  }
+
+  job = g_slice_new0 (GstFFMpegAudEncParallelJob);
+  job->nsamples = nsamples;
+  av_init_packet (&job->pkt);
+  job->pkt.data = NULL;
+  job->pkt.size = 0;
+
+  /* the input is only mapped for the duration of this call, the job gets
+   * its own copy of the samples */
+  job->frame = av_frame_alloc ();
+  if (av_frame_ref (job->frame, frame) < 0) {
+    gst_ffmpegaudenc_unref_frame (frame);
+    gst_ffmpegaudenc_parallel_job_free (job);
+    GST_ELEMENT_ERROR (ffmpegaudenc, RESOURCE, FAILED, (NULL),
+        ("Failed to allocate an audio frame"));
+    return GST_FLOW_ERROR;
+  }
+  gst_ffmpegaudenc_unref_frame (frame);
+
+  g_queue_push_tail (&ffmpegaudenc->parallel_jobs, job);
+  g_thread_pool_push (ffmpegaudenc->parallel_pool, job, NULL);
+
+  while (ret == GST_FLOW_OK
+      && gst_ffmpegaudenc_parallel_head_done (ffmpegaudenc))
+    ret = gst_ffmpegaudenc_parallel_output (ffmpegaudenc);
+
+  return ret;
+}
+
+/* feeds @frame, or NULL when draining, to the encoder and pushes whatever
+ * comes out */
+static GstFlowReturn
+gst_ffmpegaudenc_encode_frame (GstFFMpegAudEnc * ffmpegaudenc,
+    AVFrame * frame, gint nsamples, gint * have_data)
+{
+  GstAudioEncoder *enc;
+  AVCodecContext *ctx;
+  gint res;
+  GstFlowReturn ret;
+  AVPacket pkt;
+  GstBuffer *outbuf = NULL;
+  GstMapInfo map;
+
+  enc = GST_AUDIO_ENCODER (ffmpegaudenc);
+
+  ctx = ffmpegaudenc->context;
+
+  if (frame != NULL && ffmpegaudenc->parallel_pool) {
+    *have_data = 0;
+    return gst_ffmpegaudenc_parallel_push (ffmpegaudenc, frame, nsamples);
+  }
+
+  av_init_packet (&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  /* libav copies the packet into the data we provide */
+  if (ffmpegaudenc->pool && gst_buffer_pool_acquire_buffer (ffmpegaudenc->pool,
+          &outbuf, NULL) == GST_FLOW_OK) {
+    gst_buffer_map (outbuf, &map, GST_MAP_WRITE);
+    pkt.data = map.data;
+    pkt.size = map.size;
+  }
+
+  if (frame != NULL) {
     /* we have a frame to feed the encoder */
-    res = avcodec_encode_audio2 (ctx, pkt, frame, have_data);
+    res = avcodec_encode_audio2 (ctx, &pkt, frame, have_data);
 
-    av_frame_unref (frame);
+    gst_ffmpegaudenc_unref_frame (frame);
   } else {
     GST_LOG_OBJECT (ffmpegaudenc, "draining");
     /* flushing the encoder */
-    res = avcodec_encode_audio2 (ctx, pkt, NULL, have_data);
+    res = avcodec_encode_audio2 (ctx, &pkt, NULL, have_data);
   }
 
+  if (outbuf)
+    gst_buffer_unmap (outbuf, &map);
+
   if (res < 0) {
     char error_str[128] = { 0, };
 
-    g_slice_free (AVPacket, pkt);
     av_strerror (res, error_str, sizeof (error_str));
     GST_ERROR_OBJECT (enc, "Failed to encode buffer: %d - %s", res, error_str);
+    if (outbuf)
+      gst_buffer_unref (outbuf);
     return GST_FLOW_OK;
   }
   GST_LOG_OBJECT (ffmpegaudenc, "got output size %d", res);
 
   if (*have_data) {
-    GstBuffer *outbuf;
     const AVCodec *codec;
 
-    GST_LOG_OBJECT (ffmpegaudenc, "pushing size %d", pkt->size);
-
-    outbuf =
-        gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, pkt->data,
-        pkt->size, 0, pkt->size, pkt, gst_ffmpegaudenc_free_avpacket);
-
     codec = ffmpegaudenc->context->codec;
-    if ((codec->capabilities & CODEC_CAP_VARIABLE_FRAME_SIZE) || !buffer) {
+    if ((codec->capabilities & CODEC_CAP_VARIABLE_FRAME_SIZE) || !frame) {
       /* FIXME: Not really correct, as -1 means "all the samples we got
          given so far", which may not be true depending on the codec,
          but we have no way to know AFAICT */
-      ret = gst_audio_encoder_finish_frame (enc, outbuf, -1);
-    } else {
-      ret = gst_audio_encoder_finish_frame (enc, outbuf, nsamples);
+      nsamples = -1;
     }
+    ret = gst_ffmpegaudenc_finish_packet (ffmpegaudenc, &pkt, outbuf,
+        nsamples);
   } else {
     GST_LOG_OBJECT (ffmpegaudenc, "no output produced");
-    g_slice_free (AVPacket, pkt);
+    if (outbuf)
+      gst_buffer_unref (outbuf);
+    av_packet_unref (&pkt);
     ret = GST_FLOW_OK;
   }
 
   return ret;
 }
 
-static void
+/* encodes the complete frames collected in the fifo, and the remaining
+ * samples too when draining */
+static GstFlowReturn
+gst_ffmpegaudenc_encode_fifo (GstFFMpegAudEnc * ffmpegaudenc,
+    gboolean draining, gint * have_data)
+{
+  AVCodecContext *ctx = ffmpegaudenc->context;
+  AVFrame *frame = ffmpegaudenc->frame;
+  GstFlowReturn ret = GST_FLOW_OK;
+  gint nsamples, linesize;
+
+  *have_data = 0;
+
+  while (ret == GST_FLOW_OK) {
+    nsamples = av_audio_fifo_size (ffmpegaudenc->fifo);
+    if (nsamples == 0 || (nsamples < ctx->frame_size && !draining))
+      break;
+    nsamples = MIN (nsamples, ctx->frame_size);
+
+    linesize = nsamples * av_get_bytes_per_sample (ctx->sample_fmt);
+    if (!gst_ffmpegaudenc_stage_planes (ffmpegaudenc, ctx->channels,
+            linesize))
+      goto alloc_failed;
+
+    gst_ffmpegaudenc_init_frame (ffmpegaudenc, frame, nsamples);
+    gst_ffmpegaudenc_set_planes (ffmpegaudenc, frame, ctx->channels,
+        linesize);
+
+    av_audio_fifo_read (ffmpegaudenc->fifo, (void **) frame->extended_data,
+        nsamples);
+
+    ret = gst_ffmpegaudenc_encode_frame (ffmpegaudenc, frame, nsamples,
+        have_data);
+  }
+
+  return ret;
+
+  /* ERRORS */
+alloc_failed:
+  {
+    GST_ELEMENT_ERROR (ffmpegaudenc, RESOURCE, FAILED, (NULL),
+        ("Failed to allocate an audio frame"));
+    return GST_FLOW_ERROR;
+  }
+}
+
+/* finds the planes of a non-interleaved buffer and stores them in
+ * ffmpegaudenc->planes in libav channel order, returns the number of
+ * samples in each of them */
+static gint
+gst_ffmpegaudenc_get_planes (GstFFMpegAudEnc * ffmpegaudenc,
+    GstBuffer * buffer, GstMapInfo * map, GstAudioInfo * info)
+{
+  gint channels = info->channels;
+  gint nsamples = map->size / info->bpf;
+  gsize plane_size = map->size / channels;
+  gsize offset;
+  gint i, c;
+#if GST_CHECK_VERSION(1,15,1)
+  GstAudioMeta *meta = gst_buffer_get_audio_meta (buffer);
+
+  if (meta)
+    nsamples = meta->samples;
+#endif
+
+  for (i = 0; i < channels; i++) {
+    offset = i * plane_size;
+#if GST_CHECK_VERSION(1,15,1)
+    if (meta)
+      offset = meta->offsets[i];
+#endif
+    /* reordering is just a matter of passing the planes in another order */
+    c = ffmpegaudenc->needs_reorder ? ffmpegaudenc->reorder_map[i] : i;
+    ffmpegaudenc->planes[c] = map->data + offset;
+  }
+
+  return nsamples;
+}
+
+static GstFlowReturn
+gst_ffmpegaudenc_encode_audio (GstFFMpegAudEnc * ffmpegaudenc,
+    GstBuffer * buffer, gint * have_data)
+{
+  GstAudioEncoder *enc;
+  AVCodecContext *ctx;
+  GstAudioInfo *info;
+  AVFrame *frame = ffmpegaudenc->frame;
+  GstFlowReturn ret;
+  gboolean planar;
+  gint nsamples = -1;
+  GstMapInfo map;
+  guint8 *audio_in;
+  guint in_size;
+
+  if (buffer == NULL)
+    return gst_ffmpegaudenc_encode_frame (ffmpegaudenc, NULL, nsamples,
+        have_data);
+
+  enc = GST_AUDIO_ENCODER (ffmpegaudenc);
+
+  ctx = ffmpegaudenc->context;
+
+  /* libav doesn't keep non-refcounted frames beyond the encode call, so the
+   * input stays mapped until then and nothing has to be allocated for it */
+  gst_buffer_map (buffer, &map, GST_MAP_READ);
+  audio_in = map.data;
+  in_size = map.size;
+
+  GST_LOG_OBJECT (ffmpegaudenc, "encoding buffer %p size:%u", audio_in,
+      in_size);
+
+  info = gst_audio_encoder_get_audio_info (enc);
+  planar = av_sample_fmt_is_planar (ctx->sample_fmt);
+
+  if (ffmpegaudenc->non_interleaved) {
+    nsamples = gst_ffmpegaudenc_get_planes (ffmpegaudenc, buffer, &map, info);
+
+    if (ffmpegaudenc->fifo && (av_audio_fifo_size (ffmpegaudenc->fifo) > 0
+            || nsamples != ctx->frame_size)) {
+      /* not exactly one frame, collect the samples until there is one */
+      if (av_audio_fifo_write (ffmpegaudenc->fifo,
+              (void **) ffmpegaudenc->planes, nsamples) < nsamples)
+        goto fifo_failed;
+      gst_buffer_unmap (buffer, &map);
+      gst_buffer_unref (buffer);
+
+      return gst_ffmpegaudenc_encode_fifo (ffmpegaudenc, FALSE, have_data);
+    }
+
+    gst_ffmpegaudenc_init_frame (ffmpegaudenc, frame, nsamples);
+    gst_ffmpegaudenc_set_planes (ffmpegaudenc, frame, info->channels,
+        nsamples * (info->bpf / info->channels));
+
+    ret = gst_ffmpegaudenc_encode_frame (ffmpegaudenc, frame, nsamples,
+        have_data);
+  } else {
+    gint channels = info->channels;
+    gint total = in_size / info->bpf;
+    gint offset, chunk = total;
+
+    /* with frames-per-buffer the base class hands over several codec frames
+     * at once, feed them one by one */
+    if (ctx->frame_size > 1
+        && !(ctx->codec->capabilities & CODEC_CAP_VARIABLE_FRAME_SIZE))
+      chunk = ctx->frame_size;
+
+    ret = GST_FLOW_OK;
+    for (offset = 0; offset < total && ret == GST_FLOW_OK; offset += nsamples) {
+      nsamples = MIN (chunk, total - offset);
+      gst_ffmpegaudenc_init_frame (ffmpegaudenc, frame, nsamples);
+
+      if (planar && channels > 1) {
+        gint linesize = nsamples * (info->bpf / channels);
+
+        if (!gst_ffmpegaudenc_stage_planes (ffmpegaudenc, channels, linesize))
+          goto alloc_failed;
+        gst_ffmpegaudenc_set_planes (ffmpegaudenc, frame, channels, linesize);
+
+        gst_ffmpeg_audio_deinterleave ((gpointer *) frame->extended_data,
+            audio_in + offset * info->bpf, info->finfo->width, channels,
+            nsamples);
+      } else {
+        frame->data[0] = audio_in + offset * info->bpf;
+        frame->extended_data = frame->data;
+        frame->linesize[0] = nsamples * info->bpf;
+      }
+
+      ret = gst_ffmpegaudenc_encode_frame (ffmpegaudenc, frame, nsamples,
+          have_data);
+    }
+  }
+
+  gst_buffer_unmap (buffer, &map);
+  gst_buffer_unref (buffer);
+
+  return ret;
+
+  /* ERRORS */
+alloc_failed:
+  {
+    GST_ELEMENT_ERROR (ffmpegaudenc, RESOURCE, FAILED, (NULL),
+        ("Failed to allocate an audio frame"));
+    gst_buffer_unmap (buffer, &map);
+    gst_buffer_unref (buffer);
+    return GST_FLOW_ERROR;
+  }
+fifo_failed:
+  {
+    GST_ELEMENT_ERROR (ffmpegaudenc, RESOURCE, FAILED, (NULL),
+        ("Failed to queue %d samples", nsamples));
+    gst_buffer_unmap (buffer, &map);
+    gst_buffer_unref (buffer);
+    return GST_FLOW_ERROR;
+  }
+}
+
+static GstFlowReturn
 gst_ffmpegaudenc_drain (GstFFMpegAudEnc * ffmpegaudenc)
 {
   GstFFMpegAudEncClass *oclass;
+  GstFlowReturn ret = GST_FLOW_OK;
 
   oclass = (GstFFMpegAudEncClass *) (G_OBJECT_GET_CLASS (ffmpegaudenc));
 
-  if (oclass->in_plugin->capabilities & CODEC_CAP_DELAY) {
+  /* encode the samples that did not make up a whole frame yet */
+  if (ffmpegaudenc->fifo) {
+    gint have_data;
+
+    ret = gst_ffmpegaudenc_encode_fifo (ffmpegaudenc, TRUE, &have_data);
+  }
+
+  /* the main context never encodes while the workers are used, jobs that
+   * can't be pushed anymore are dropped */
+  while (ret == GST_FLOW_OK
+      && !g_queue_is_empty (&ffmpegaudenc->parallel_jobs))
+    ret = gst_ffmpegaudenc_parallel_output (ffmpegaudenc);
+  gst_ffmpegaudenc_parallel_discard (ffmpegaudenc);
+
+  if (ret == GST_FLOW_OK
+      && (oclass->in_plugin->capabilities & CODEC_CAP_DELAY)) {
     gint have_data, try = 0;
 
     GST_LOG_OBJECT (ffmpegaudenc,
         "codec has delay capabilities, calling until libav has drained everything");
 
     do {
-      GstFlowReturn ret;
-
       ret = gst_ffmpegaudenc_encode_audio (ffmpegaudenc, NULL, &have_data);
       if (ret != GST_FLOW_OK || have_data == 0)
         break;
     } while (try++ < 10);
   }
+
+  return ret;
 }
 
 static GstFlowReturn
@@ -654,10 +1315,8 @@ gst_ffmpegaudenc_handle_frame (GstAudioEncoder * encoder, GstBuffer * inbuf)
   if (G_UNLIKELY (!ffmpegaudenc->opened))
     goto not_negotiated;
 
-  if (!inbuf) {
-    gst_ffmpegaudenc_drain (ffmpegaudenc);
-    return GST_FLOW_OK;
-  }
+  if (!inbuf)
+    return gst_ffmpegaudenc_drain (ffmpegaudenc);
 
   inbuf = gst_buffer_ref (inbuf);
 
@@ -667,7 +1326,7 @@ gst_ffmpegaudenc_handle_frame (GstAudioEncoder * encoder, GstBuffer * inbuf)
       GST_TIME_ARGS (GST_BUFFER_DURATION (inbuf)), gst_buffer_get_size (inbuf));
 
   /* Reorder channels to the GStreamer channel order */
-  if (ffmpegaudenc->needs_reorder) {
+  if (ffmpegaudenc->needs_reorder && !ffmpegaudenc->non_interleaved) {
     GstAudioInfo *info = gst_audio_encoder_get_audio_info (encoder);
 
     inbuf = gst_buffer_make_writable (inbuf);
@@ -724,6 +1383,12 @@ gst_ffmpegaudenc_set_property (GObject * object,
     case PROP_COMPLIANCE:
       ffmpegaudenc->compliance = g_value_get_enum (value);
       break;
+    case PROP_FRAMES_PER_BUFFER:
+      ffmpegaudenc->frames_per_buffer = g_value_get_int (value);
+      break;
+    case PROP_PARALLEL_CONTEXTS:
+      ffmpegaudenc->parallel_contexts = g_value_get_int (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -751,6 +1416,12 @@ gst_ffmpegaudenc_get_property (GObject * object,
     case PROP_COMPLIANCE:
       g_value_set_enum (value, ffmpegaudenc->compliance);
       break;
+    case PROP_FRAMES_PER_BUFFER:
+      g_value_set_int (value, ffmpegaudenc->frames_per_buffer);
+      break;
+    case PROP_PARALLEL_CONTEXTS:
+      g_value_set_int (value, ffmpegaudenc->parallel_contexts);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -29,6 +29,7 @@ G_BEGIN_DECLS
 #include <gst/gst.h>
 #include <gst/audio/gstaudioencoder.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
 
 typedef struct _GstFFMpegAudEnc GstFFMpegAudEnc;
 
@@ -43,6 +44,7 @@ struct _GstFFMpegAudEnc
   gint bitrate;
   gint rtp_payload_size;
   gint compliance;
+  gint frames_per_buffer;
 
   /* other settings are copied over straight,
    * include a context here, rather than copy-and-past it from avcodec.h */
@@ -52,6 +54,30 @@ struct _GstFFMpegAudEnc
 
   GstAudioChannelPosition ffmpeg_layout[64];
   gboolean needs_reorder;
+  gint reorder_map[64];
+
+  /* non-interleaved input is handed to libav plane by plane, codecs with a
+   * fixed frame size get it framed through the fifo */
+  gboolean non_interleaved;
+  AVAudioFifo *fifo;
+
+  /* plane pointers of the frame being encoded, and the staging area used
+   * when the planes have to be assembled first */
+  guint8 *planes[64];
+  guint8 *staging;
+  unsigned int staging_size;
+
+  /* output buffers libav writes the packets of lossless codecs to */
+  GstBufferPool *pool;
+
+  /* stateless codecs: frames are encoded in parallel */
+  gint parallel_contexts;
+  GThreadPool *parallel_pool;
+  GAsyncQueue *parallel_idle;
+  gint parallel_n_contexts;
+  GQueue parallel_jobs;
+  GMutex parallel_lock;
+  GCond parallel_cond;
 };
 
 typedef struct _GstFFMpegAudEncClass GstFFMpegAudEncClass;
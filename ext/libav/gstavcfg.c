@@ -275,6 +275,7 @@ gst_ffmpeg_flags_get_type (void)
       {CODEC_FLAG_AC_PRED, "H263 Advanced Intra Coding / MPEG4 AC prediction",
           "aic"},
       {CODEC_FLAG_CLOSED_GOP, "Closed GOP", "closedgop"},
+      {CODEC_FLAG_PSNR, "Compute PSNR of the encoded frames", "psnr"},
       {0, NULL, NULL},
     };
 
@@ -383,11 +384,12 @@ gst_ffmpeg_cfg_init (void)
 
   pspec = g_param_spec_float ("quantizer", "Constant Quantizer",
       "Constant Quantizer", 0, 30, 0.01f,
-      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING);
   gst_ffmpeg_add_pspec (pspec, quantizer, FALSE, mpeg, NULL);
 
   pspec = g_param_spec_string ("multipass-cache-file", "Multipass Cache File",
-      "Filename for multipass cache file", "stats.log",
+      "Filename for multipass cache file (NULL = keep the statistics in "
+      "memory only, see multipass-stats)", "stats.log",
       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
   gst_ffmpeg_add_pspec (pspec, filename, FALSE, mpeg, NULL);
 
@@ -454,12 +456,12 @@ gst_ffmpeg_cfg_init (void)
 
   pspec = g_param_spec_int ("qmin", "Minimum Quantizer",
       "Minimum Quantizer", 1, 31, 2,
-      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING);
   gst_ffmpeg_add_pspec (pspec, config.qmin, FALSE, mpeg, NULL);
 
   pspec = g_param_spec_int ("qmax", "Maximum Quantizer",
       "Maximum Quantizer", 1, 31, 31,
-      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING);
   gst_ffmpeg_add_pspec (pspec, config.qmax, FALSE, mpeg, NULL);
 
   pspec = g_param_spec_int ("max-qdiff", "Maximum Quantizer Difference",
@@ -516,17 +518,17 @@ gst_ffmpeg_cfg_init (void)
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT (57, 3, 0)
   pspec = g_param_spec_int ("rc-max-rate", "Ratecontrol Maximum Bitrate",
       "Ratecontrol Maximum Bitrate", 0, G_MAXINT, 0,
-      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING);
 #else
   pspec = g_param_spec_int64 ("rc-max-rate", "Ratecontrol Maximum Bitrate",
       "Ratecontrol Maximum Bitrate", 0, G_MAXINT64, 0,
-      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING);
 #endif
   gst_ffmpeg_add_pspec (pspec, config.rc_max_rate, FALSE, mpeg, NULL);
 
   pspec = g_param_spec_int64 ("rc-min-rate", "Ratecontrol Minimum Bitrate",
       "Ratecontrol Minimum Bitrate", 0, G_MAXINT64, 0,
-      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING);
   gst_ffmpeg_add_pspec (pspec, config.rc_min_rate, FALSE, mpeg, NULL);
 
   pspec =
@@ -634,6 +634,9 @@ gst_ff_aud_caps_new (AVCodecContext * context, AVCodec * codec,
       case AV_CODEC_ID_TRUEHD:
         maxchannels = 8;
         break;
+      case AV_CODEC_ID_WAVPACK:
+        maxchannels = 64;
+        break;
       default:
         break;
     }
@@ -2399,6 +2402,23 @@ gst_ffmpeg_codectype_to_audio_caps (AVCodecContext * context,
   return caps;
 }
 
+void
+gst_ffmpeg_audio_caps_add_non_interleaved (GstCaps * caps)
+{
+  GValue va = { 0, };
+  GValue v = { 0, };
+
+  g_value_init (&va, GST_TYPE_LIST);
+  g_value_init (&v, G_TYPE_STRING);
+  g_value_set_string (&v, "interleaved");
+  gst_value_list_append_value (&va, &v);
+  g_value_set_string (&v, "non-interleaved");
+  gst_value_list_append_value (&va, &v);
+  gst_caps_set_value (caps, "layout", &va);
+  g_value_unset (&v);
+  g_value_unset (&va);
+}
+
 GstCaps *
 gst_ffmpeg_codectype_to_video_caps (AVCodecContext * context,
     enum AVCodecID codec_id, gboolean encode, AVCodec * codec)
@@ -170,4 +170,10 @@ gboolean
 gst_ffmpeg_channel_layout_to_gst (guint64 channel_layout, gint channels,
     GstAudioChannelPosition * pos);
 
+/*
+ * Allow both interleaved and non-interleaved layouts in raw audio caps.
+ */
+void
+gst_ffmpeg_audio_caps_add_non_interleaved (GstCaps * caps);
+
 #endif /* __GST_FFMPEG_CODECMAP_H__ */
@@ -0,0 +1,1050 @@
+/* GStreamer
+ * Copyright (C) <2018> GStreamer developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* SSE2 is part of the x86-64 baseline, AVX2 is selected at runtime */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_INTERLEAVE_SSE2 1
+#endif
+
+#if defined(__x86_64__) && (defined(__clang__) || \
+    (defined(__GNUC__) && __GNUC__ >= 5))
+#include <immintrin.h>
+#define HAVE_INTERLEAVE_AVX2 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_INTERLEAVE_NEON 1
+#endif
+
+#include "gstav.h"
+#include "gstavinterleave.h"
+
+/* samples per channel handled in one go by the generic code, small enough
+ * that the output block stays in the L1 cache for up to 8 channels */
+#define GENERIC_BLOCK_SIZE 256
+
+typedef void (*InterleaveFunc) (gpointer dest, const gpointer * planes,
+    gint nsamples);
+typedef void (*DeinterleaveFunc) (gpointer * planes, gconstpointer src,
+    gint nsamples);
+
+/* indexed by sample width (8, 16, 32, 64) and channels (2, 6, 8) */
+static InterleaveFunc interleave_funcs[4][3];
+static DeinterleaveFunc deinterleave_funcs[4][3];
+
+#define DEFINE_INTERLEAVE_C(type, bits)                                       \
+static inline void                                                            \
+interleave_##bits##_c (gpointer dest, const gpointer * planes,                \
+    gint channels, gint nsamples)                                             \
+{                                                                             \
+  gint i, c, block, n;                                                        \
+                                                                              \
+  /* write one channel at a time so the reads stay sequential */              \
+  for (block = 0; block < nsamples; block += GENERIC_BLOCK_SIZE) {            \
+    n = MIN (nsamples - block, GENERIC_BLOCK_SIZE);                           \
+    for (c = 0; c < channels; c++) {                                          \
+      const type *in = (const type *) planes[c] + block;                      \
+      type *out = (type *) dest + block * channels + c;                       \
+                                                                              \
+      for (i = 0; i < n; i++)                                                 \
+        out[i * channels] = in[i];                                            \
+    }                                                                         \
+  }                                                                           \
+}                                                                             \
+                                                                              \
+static void                                                                   \
+interleave_2ch_##bits##_c (gpointer dest, const gpointer * planes,            \
+    gint nsamples)                                                            \
+{                                                                             \
+  const type *l = planes[0], *r = planes[1];                                  \
+  type *out = dest;                                                           \
+  gint i;                                                                     \
+                                                                              \
+  for (i = 0; i < nsamples; i++) {                                            \
+    out[2 * i] = l[i];                                                        \
+    out[2 * i + 1] = r[i];                                                    \
+  }                                                                           \
+}                                                                             \
+                                                                              \
+static void                                                                   \
+interleave_6ch_##bits##_c (gpointer dest, const gpointer * planes,            \
+    gint nsamples)                                                            \
+{                                                                             \
+  interleave_##bits##_c (dest, planes, 6, nsamples);                          \
+}                                                                             \
+                                                                              \
+static void                                                                   \
+interleave_8ch_##bits##_c (gpointer dest, const gpointer * planes,            \
+    gint nsamples)                                                            \
+{                                                                             \
+  interleave_##bits##_c (dest, planes, 8, nsamples);                          \
+}
+
+DEFINE_INTERLEAVE_C (guint8, 8)
+DEFINE_INTERLEAVE_C (guint16, 16)
+DEFINE_INTERLEAVE_C (guint32, 32)
+DEFINE_INTERLEAVE_C (guint64, 64)
+
+#define DEFINE_DEINTERLEAVE_C(type, bits)                                     \
+static inline void                                                            \
+deinterleave_##bits##_c (gpointer * planes, gconstpointer src,                \
+    gint channels, gint nsamples)                                             \
+{                                                                             \
+  gint i, c, block, n;                                                        \
+                                                                              \
+  /* read one channel at a time so the writes stay sequential */              \
+  for (block = 0; block < nsamples; block += GENERIC_BLOCK_SIZE) {            \
+    n = MIN (nsamples - block, GENERIC_BLOCK_SIZE);                           \
+    for (c = 0; c < channels; c++) {                                          \
+      const type *in = (const type *) src + block * channels + c;             \
+      type *out = (type *) planes[c] + block;                                 \
+                                                                              \
+      for (i = 0; i < n; i++)                                                 \
+        out[i] = in[i * channels];                                            \
+    }                                                                         \
+  }                                                                           \
+}                                                                             \
+                                                                              \
+static void                                                                   \
+deinterleave_2ch_##bits##_c (gpointer * planes, gconstpointer src,            \
+    gint nsamples)                                                            \
+{                                                                             \
+  type *l = planes[0], *r = planes[1];                                        \
+  const type *in = src;                                                       \
+  gint i;                                                                     \
+                                                                              \
+  for (i = 0; i < nsamples; i++) {                                            \
+    l[i] = in[2 * i];                                                         \
+    r[i] = in[2 * i + 1];                                                     \
+  }                                                                           \
+}                                                                             \
+                                                                              \
+static void                                                                   \
+deinterleave_6ch_##bits##_c (gpointer * planes, gconstpointer src,            \
+    gint nsamples)                                                            \
+{                                                                             \
+  deinterleave_##bits##_c (planes, src, 6, nsamples);                         \
+}                                                                             \
+                                                                              \
+static void                                                                   \
+deinterleave_8ch_##bits##_c (gpointer * planes, gconstpointer src,            \
+    gint nsamples)                                                            \
+{                                                                             \
+  deinterleave_##bits##_c (planes, src, 8, nsamples);                         \
+}
+
+DEFINE_DEINTERLEAVE_C (guint8, 8)
+DEFINE_DEINTERLEAVE_C (guint16, 16)
+DEFINE_DEINTERLEAVE_C (guint32, 32)
+DEFINE_DEINTERLEAVE_C (guint64, 64)
+
+#ifdef HAVE_INTERLEAVE_SSE2
+static void
+interleave_2ch_16_sse2 (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint16 *l = planes[0], *r = planes[1];
+  guint16 *out = dest;
+  gint i;
+
+  for (i = 0; i + 8 <= nsamples; i += 8) {
+    __m128i a = _mm_loadu_si128 ((const __m128i *) (l + i));
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (r + i));
+
+    _mm_storeu_si128 ((__m128i *) (out + 2 * i), _mm_unpacklo_epi16 (a, b));
+    _mm_storeu_si128 ((__m128i *) (out + 2 * i + 8),
+        _mm_unpackhi_epi16 (a, b));
+  }
+  for (; i < nsamples; i++) {
+    out[2 * i] = l[i];
+    out[2 * i + 1] = r[i];
+  }
+}
+
+static void
+interleave_2ch_32_sse2 (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint32 *l = planes[0], *r = planes[1];
+  guint32 *out = dest;
+  gint i;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    __m128i a = _mm_loadu_si128 ((const __m128i *) (l + i));
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (r + i));
+
+    _mm_storeu_si128 ((__m128i *) (out + 2 * i), _mm_unpacklo_epi32 (a, b));
+    _mm_storeu_si128 ((__m128i *) (out + 2 * i + 4),
+        _mm_unpackhi_epi32 (a, b));
+  }
+  for (; i < nsamples; i++) {
+    out[2 * i] = l[i];
+    out[2 * i + 1] = r[i];
+  }
+}
+
+static void
+interleave_2ch_64_sse2 (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint64 *l = planes[0], *r = planes[1];
+  guint64 *out = dest;
+  gint i;
+
+  for (i = 0; i + 2 <= nsamples; i += 2) {
+    __m128i a = _mm_loadu_si128 ((const __m128i *) (l + i));
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (r + i));
+
+    _mm_storeu_si128 ((__m128i *) (out + 2 * i), _mm_unpacklo_epi64 (a, b));
+    _mm_storeu_si128 ((__m128i *) (out + 2 * i + 2),
+        _mm_unpackhi_epi64 (a, b));
+  }
+  for (; i < nsamples; i++) {
+    out[2 * i] = l[i];
+    out[2 * i + 1] = r[i];
+  }
+}
+
+/* transposes 4 samples of 4 channels into 4 frames */
+#define TRANSPOSE_4X4_SSE2(c0, c1, c2, c3, s0, s1, s2, s3) G_STMT_START {     \
+  __m128i t0 = _mm_unpacklo_epi32 (c0, c1);                                   \
+  __m128i t1 = _mm_unpacklo_epi32 (c2, c3);                                   \
+  __m128i t2 = _mm_unpackhi_epi32 (c0, c1);                                   \
+  __m128i t3 = _mm_unpackhi_epi32 (c2, c3);                                   \
+  s0 = _mm_unpacklo_epi64 (t0, t1);                                           \
+  s1 = _mm_unpackhi_epi64 (t0, t1);                                           \
+  s2 = _mm_unpacklo_epi64 (t2, t3);                                           \
+  s3 = _mm_unpackhi_epi64 (t2, t3);                                           \
+} G_STMT_END
+
+static void
+interleave_6ch_32_sse2 (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint32 *const *in = (const guint32 * const *) planes;
+  guint32 *out = dest;
+  gint i, c;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    __m128i c0 = _mm_loadu_si128 ((const __m128i *) (in[0] + i));
+    __m128i c1 = _mm_loadu_si128 ((const __m128i *) (in[1] + i));
+    __m128i c2 = _mm_loadu_si128 ((const __m128i *) (in[2] + i));
+    __m128i c3 = _mm_loadu_si128 ((const __m128i *) (in[3] + i));
+    __m128i c4 = _mm_loadu_si128 ((const __m128i *) (in[4] + i));
+    __m128i c5 = _mm_loadu_si128 ((const __m128i *) (in[5] + i));
+    __m128i s0, s1, s2, s3, u0, u1;
+    guint32 *o = out + 6 * i;
+
+    TRANSPOSE_4X4_SSE2 (c0, c1, c2, c3, s0, s1, s2, s3);
+    /* channels 4 and 5 of frames 0 and 1, 2 and 3 */
+    u0 = _mm_unpacklo_epi32 (c4, c5);
+    u1 = _mm_unpackhi_epi32 (c4, c5);
+
+    /* 4 frames of 6 channels are exactly 6 vectors */
+    _mm_storeu_si128 ((__m128i *) (o + 0), s0);
+    _mm_storeu_si128 ((__m128i *) (o + 4), _mm_unpacklo_epi64 (u0, s1));
+    _mm_storeu_si128 ((__m128i *) (o + 8), _mm_unpackhi_epi64 (s1, u0));
+    _mm_storeu_si128 ((__m128i *) (o + 12), s2);
+    _mm_storeu_si128 ((__m128i *) (o + 16), _mm_unpacklo_epi64 (u1, s3));
+    _mm_storeu_si128 ((__m128i *) (o + 20), _mm_unpackhi_epi64 (s3, u1));
+  }
+  for (; i < nsamples; i++)
+    for (c = 0; c < 6; c++)
+      out[6 * i + c] = in[c][i];
+}
+
+static void
+interleave_8ch_32_sse2 (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint32 *const *in = (const guint32 * const *) planes;
+  guint32 *out = dest;
+  gint i, c;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    __m128i c0 = _mm_loadu_si128 ((const __m128i *) (in[0] + i));
+    __m128i c1 = _mm_loadu_si128 ((const __m128i *) (in[1] + i));
+    __m128i c2 = _mm_loadu_si128 ((const __m128i *) (in[2] + i));
+    __m128i c3 = _mm_loadu_si128 ((const __m128i *) (in[3] + i));
+    __m128i c4 = _mm_loadu_si128 ((const __m128i *) (in[4] + i));
+    __m128i c5 = _mm_loadu_si128 ((const __m128i *) (in[5] + i));
+    __m128i c6 = _mm_loadu_si128 ((const __m128i *) (in[6] + i));
+    __m128i c7 = _mm_loadu_si128 ((const __m128i *) (in[7] + i));
+    __m128i s0, s1, s2, s3, r0, r1, r2, r3;
+    guint32 *o = out + 8 * i;
+
+    TRANSPOSE_4X4_SSE2 (c0, c1, c2, c3, s0, s1, s2, s3);
+    TRANSPOSE_4X4_SSE2 (c4, c5, c6, c7, r0, r1, r2, r3);
+
+    _mm_storeu_si128 ((__m128i *) (o + 0), s0);
+    _mm_storeu_si128 ((__m128i *) (o + 4), r0);
+    _mm_storeu_si128 ((__m128i *) (o + 8), s1);
+    _mm_storeu_si128 ((__m128i *) (o + 12), r1);
+    _mm_storeu_si128 ((__m128i *) (o + 16), s2);
+    _mm_storeu_si128 ((__m128i *) (o + 20), r2);
+    _mm_storeu_si128 ((__m128i *) (o + 24), s3);
+    _mm_storeu_si128 ((__m128i *) (o + 28), r3);
+  }
+  for (; i < nsamples; i++)
+    for (c = 0; c < 8; c++)
+      out[8 * i + c] = in[c][i];
+}
+
+static void
+deinterleave_2ch_16_sse2 (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint16 *l = planes[0], *r = planes[1];
+  const guint16 *in = src;
+  gint i;
+
+  for (i = 0; i + 8 <= nsamples; i += 8) {
+    __m128i a = _mm_loadu_si128 ((const __m128i *) (in + 2 * i));
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (in + 2 * i + 8));
+    /* sign extension of the shifted values packs back to the same bits */
+    __m128i la = _mm_srai_epi32 (_mm_slli_epi32 (a, 16), 16);
+    __m128i lb = _mm_srai_epi32 (_mm_slli_epi32 (b, 16), 16);
+    __m128i ra = _mm_srai_epi32 (a, 16);
+    __m128i rb = _mm_srai_epi32 (b, 16);
+
+    _mm_storeu_si128 ((__m128i *) (l + i), _mm_packs_epi32 (la, lb));
+    _mm_storeu_si128 ((__m128i *) (r + i), _mm_packs_epi32 (ra, rb));
+  }
+  for (; i < nsamples; i++) {
+    l[i] = in[2 * i];
+    r[i] = in[2 * i + 1];
+  }
+}
+
+static void
+deinterleave_2ch_32_sse2 (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint32 *l = planes[0], *r = planes[1];
+  const guint32 *in = src;
+  gint i;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    __m128 a = _mm_loadu_ps ((const float *) (in + 2 * i));
+    __m128 b = _mm_loadu_ps ((const float *) (in + 2 * i + 4));
+
+    /* shuffles only move the bits, so this is fine for any 32 bit type */
+    _mm_storeu_ps ((float *) (l + i), _mm_shuffle_ps (a, b,
+            _MM_SHUFFLE (2, 0, 2, 0)));
+    _mm_storeu_ps ((float *) (r + i), _mm_shuffle_ps (a, b,
+            _MM_SHUFFLE (3, 1, 3, 1)));
+  }
+  for (; i < nsamples; i++) {
+    l[i] = in[2 * i];
+    r[i] = in[2 * i + 1];
+  }
+}
+
+static void
+deinterleave_2ch_64_sse2 (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint64 *l = planes[0], *r = planes[1];
+  const guint64 *in = src;
+  gint i;
+
+  for (i = 0; i + 2 <= nsamples; i += 2) {
+    __m128i a = _mm_loadu_si128 ((const __m128i *) (in + 2 * i));
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (in + 2 * i + 2));
+
+    _mm_storeu_si128 ((__m128i *) (l + i), _mm_unpacklo_epi64 (a, b));
+    _mm_storeu_si128 ((__m128i *) (r + i), _mm_unpackhi_epi64 (a, b));
+  }
+  for (; i < nsamples; i++) {
+    l[i] = in[2 * i];
+    r[i] = in[2 * i + 1];
+  }
+}
+
+/* the upper half of a and the lower half of b */
+#define MIDDLE_64_SSE2(a, b)                                                  \
+  _mm_castpd_si128 (_mm_shuffle_pd (_mm_castsi128_pd (a),                     \
+          _mm_castsi128_pd (b), 1))
+/* the lower half of a and the upper half of b */
+#define OUTER_64_SSE2(a, b)                                                   \
+  _mm_castpd_si128 (_mm_shuffle_pd (_mm_castsi128_pd (a),                     \
+          _mm_castsi128_pd (b), 2))
+
+static void
+deinterleave_6ch_32_sse2 (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint32 **out = (guint32 **) planes;
+  const guint32 *in = src;
+  gint i, c;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    const guint32 *f = in + 6 * i;
+    __m128i v0 = _mm_loadu_si128 ((const __m128i *) (f + 0));
+    __m128i v1 = _mm_loadu_si128 ((const __m128i *) (f + 4));
+    __m128i v2 = _mm_loadu_si128 ((const __m128i *) (f + 8));
+    __m128i v3 = _mm_loadu_si128 ((const __m128i *) (f + 12));
+    __m128i v4 = _mm_loadu_si128 ((const __m128i *) (f + 16));
+    __m128i v5 = _mm_loadu_si128 ((const __m128i *) (f + 20));
+    __m128i s0, s1, s2, s3, a, b;
+
+    /* channels 0-3 of the 4 frames */
+    TRANSPOSE_4X4_SSE2 (v0, MIDDLE_64_SSE2 (v1, v2), v3,
+        MIDDLE_64_SSE2 (v4, v5), s0, s1, s2, s3);
+    /* channels 4 and 5 of frames 0 and 1, 2 and 3 */
+    a = _mm_shuffle_epi32 (OUTER_64_SSE2 (v1, v2), _MM_SHUFFLE (3, 1, 2, 0));
+    b = _mm_shuffle_epi32 (OUTER_64_SSE2 (v4, v5), _MM_SHUFFLE (3, 1, 2, 0));
+
+    _mm_storeu_si128 ((__m128i *) (out[0] + i), s0);
+    _mm_storeu_si128 ((__m128i *) (out[1] + i), s1);
+    _mm_storeu_si128 ((__m128i *) (out[2] + i), s2);
+    _mm_storeu_si128 ((__m128i *) (out[3] + i), s3);
+    _mm_storeu_si128 ((__m128i *) (out[4] + i), _mm_unpacklo_epi64 (a, b));
+    _mm_storeu_si128 ((__m128i *) (out[5] + i), _mm_unpackhi_epi64 (a, b));
+  }
+  for (; i < nsamples; i++)
+    for (c = 0; c < 6; c++)
+      out[c][i] = in[6 * i + c];
+}
+
+static void
+deinterleave_8ch_32_sse2 (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint32 **out = (guint32 **) planes;
+  const guint32 *in = src;
+  gint i, c;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    const guint32 *f = in + 8 * i;
+    __m128i s0, s1, s2, s3, r0, r1, r2, r3;
+
+    /* the transpose is its own inverse */
+    TRANSPOSE_4X4_SSE2 (_mm_loadu_si128 ((const __m128i *) (f + 0)),
+        _mm_loadu_si128 ((const __m128i *) (f + 8)),
+        _mm_loadu_si128 ((const __m128i *) (f + 16)),
+        _mm_loadu_si128 ((const __m128i *) (f + 24)), s0, s1, s2, s3);
+    TRANSPOSE_4X4_SSE2 (_mm_loadu_si128 ((const __m128i *) (f + 4)),
+        _mm_loadu_si128 ((const __m128i *) (f + 12)),
+        _mm_loadu_si128 ((const __m128i *) (f + 20)),
+        _mm_loadu_si128 ((const __m128i *) (f + 28)), r0, r1, r2, r3);
+
+    _mm_storeu_si128 ((__m128i *) (out[0] + i), s0);
+    _mm_storeu_si128 ((__m128i *) (out[1] + i), s1);
+    _mm_storeu_si128 ((__m128i *) (out[2] + i), s2);
+    _mm_storeu_si128 ((__m128i *) (out[3] + i), s3);
+    _mm_storeu_si128 ((__m128i *) (out[4] + i), r0);
+    _mm_storeu_si128 ((__m128i *) (out[5] + i), r1);
+    _mm_storeu_si128 ((__m128i *) (out[6] + i), r2);
+    _mm_storeu_si128 ((__m128i *) (out[7] + i), r3);
+  }
+  for (; i < nsamples; i++)
+    for (c = 0; c < 8; c++)
+      out[c][i] = in[8 * i + c];
+}
+#endif
+
+#ifdef HAVE_INTERLEAVE_AVX2
+__attribute__ ((target ("avx2")))
+static void
+interleave_2ch_16_avx2 (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint16 *l = planes[0], *r = planes[1];
+  guint16 *out = dest;
+  gint i;
+
+  for (i = 0; i + 16 <= nsamples; i += 16) {
+    __m256i a = _mm256_loadu_si256 ((const __m256i *) (l + i));
+    __m256i b = _mm256_loadu_si256 ((const __m256i *) (r + i));
+    /* the unpacks work within each 128 bit lane */
+    __m256i lo = _mm256_unpacklo_epi16 (a, b);
+    __m256i hi = _mm256_unpackhi_epi16 (a, b);
+
+    _mm256_storeu_si256 ((__m256i *) (out + 2 * i),
+        _mm256_permute2x128_si256 (lo, hi, 0x20));
+    _mm256_storeu_si256 ((__m256i *) (out + 2 * i + 16),
+        _mm256_permute2x128_si256 (lo, hi, 0x31));
+  }
+  for (; i < nsamples; i++) {
+    out[2 * i] = l[i];
+    out[2 * i + 1] = r[i];
+  }
+}
+
+__attribute__ ((target ("avx2")))
+static void
+interleave_2ch_32_avx2 (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint32 *l = planes[0], *r = planes[1];
+  guint32 *out = dest;
+  gint i;
+
+  for (i = 0; i + 8 <= nsamples; i += 8) {
+    __m256i a = _mm256_loadu_si256 ((const __m256i *) (l + i));
+    __m256i b = _mm256_loadu_si256 ((const __m256i *) (r + i));
+    __m256i lo = _mm256_unpacklo_epi32 (a, b);
+    __m256i hi = _mm256_unpackhi_epi32 (a, b);
+
+    _mm256_storeu_si256 ((__m256i *) (out + 2 * i),
+        _mm256_permute2x128_si256 (lo, hi, 0x20));
+    _mm256_storeu_si256 ((__m256i *) (out + 2 * i + 8),
+        _mm256_permute2x128_si256 (lo, hi, 0x31));
+  }
+  for (; i < nsamples; i++) {
+    out[2 * i] = l[i];
+    out[2 * i + 1] = r[i];
+  }
+}
+
+/* transposes 8 vectors of 8 values in place */
+__attribute__ ((target ("avx2")))
+static inline void
+transpose_8x8_avx2 (__m256i v[8])
+{
+  __m256i t0, t1, t2, t3, t4, t5, t6, t7;
+  __m256i u0, u1, u2, u3, u4, u5, u6, u7;
+
+  t0 = _mm256_unpacklo_epi32 (v[0], v[1]);
+  t1 = _mm256_unpackhi_epi32 (v[0], v[1]);
+  t2 = _mm256_unpacklo_epi32 (v[2], v[3]);
+  t3 = _mm256_unpackhi_epi32 (v[2], v[3]);
+  t4 = _mm256_unpacklo_epi32 (v[4], v[5]);
+  t5 = _mm256_unpackhi_epi32 (v[4], v[5]);
+  t6 = _mm256_unpacklo_epi32 (v[6], v[7]);
+  t7 = _mm256_unpackhi_epi32 (v[6], v[7]);
+
+  /* values 0-3 and 4-7 of rows n and n + 4 */
+  u0 = _mm256_unpacklo_epi64 (t0, t2);
+  u1 = _mm256_unpackhi_epi64 (t0, t2);
+  u2 = _mm256_unpacklo_epi64 (t1, t3);
+  u3 = _mm256_unpackhi_epi64 (t1, t3);
+  u4 = _mm256_unpacklo_epi64 (t4, t6);
+  u5 = _mm256_unpackhi_epi64 (t4, t6);
+  u6 = _mm256_unpacklo_epi64 (t5, t7);
+  u7 = _mm256_unpackhi_epi64 (t5, t7);
+
+  v[0] = _mm256_permute2x128_si256 (u0, u4, 0x20);
+  v[1] = _mm256_permute2x128_si256 (u1, u5, 0x20);
+  v[2] = _mm256_permute2x128_si256 (u2, u6, 0x20);
+  v[3] = _mm256_permute2x128_si256 (u3, u7, 0x20);
+  v[4] = _mm256_permute2x128_si256 (u0, u4, 0x31);
+  v[5] = _mm256_permute2x128_si256 (u1, u5, 0x31);
+  v[6] = _mm256_permute2x128_si256 (u2, u6, 0x31);
+  v[7] = _mm256_permute2x128_si256 (u3, u7, 0x31);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+interleave_8ch_32_avx2 (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint32 *const *in = (const guint32 * const *) planes;
+  guint32 *out = dest;
+  gint i, c;
+
+  for (i = 0; i + 8 <= nsamples; i += 8) {
+    __m256i v[8];
+
+    for (c = 0; c < 8; c++)
+      v[c] = _mm256_loadu_si256 ((const __m256i *) (in[c] + i));
+    transpose_8x8_avx2 (v);
+    for (c = 0; c < 8; c++)
+      _mm256_storeu_si256 ((__m256i *) (out + 8 * (i + c)), v[c]);
+  }
+  for (; i < nsamples; i++)
+    for (c = 0; c < 8; c++)
+      out[8 * i + c] = in[c][i];
+}
+
+__attribute__ ((target ("avx2")))
+static void
+deinterleave_2ch_16_avx2 (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint16 *l = planes[0], *r = planes[1];
+  const guint16 *in = src;
+  /* even samples to the lower, odd samples to the upper half of each lane */
+  const __m256i split = _mm256_setr_epi8 (0, 1, 4, 5, 8, 9, 12, 13,
+      2, 3, 6, 7, 10, 11, 14, 15, 0, 1, 4, 5, 8, 9, 12, 13,
+      2, 3, 6, 7, 10, 11, 14, 15);
+  gint i;
+
+  for (i = 0; i + 16 <= nsamples; i += 16) {
+    __m256i a = _mm256_loadu_si256 ((const __m256i *) (in + 2 * i));
+    __m256i b = _mm256_loadu_si256 ((const __m256i *) (in + 2 * i + 16));
+
+    /* left samples in the lower, right samples in the upper lane */
+    a = _mm256_permute4x64_epi64 (_mm256_shuffle_epi8 (a, split),
+        _MM_SHUFFLE (3, 1, 2, 0));
+    b = _mm256_permute4x64_epi64 (_mm256_shuffle_epi8 (b, split),
+        _MM_SHUFFLE (3, 1, 2, 0));
+
+    _mm256_storeu_si256 ((__m256i *) (l + i),
+        _mm256_permute2x128_si256 (a, b, 0x20));
+    _mm256_storeu_si256 ((__m256i *) (r + i),
+        _mm256_permute2x128_si256 (a, b, 0x31));
+  }
+  for (; i < nsamples; i++) {
+    l[i] = in[2 * i];
+    r[i] = in[2 * i + 1];
+  }
+}
+
+__attribute__ ((target ("avx2")))
+static void
+deinterleave_2ch_32_avx2 (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint32 *l = planes[0], *r = planes[1];
+  const guint32 *in = src;
+  const __m256i split = _mm256_setr_epi32 (0, 2, 4, 6, 1, 3, 5, 7);
+  gint i;
+
+  for (i = 0; i + 8 <= nsamples; i += 8) {
+    __m256i a = _mm256_loadu_si256 ((const __m256i *) (in + 2 * i));
+    __m256i b = _mm256_loadu_si256 ((const __m256i *) (in + 2 * i + 8));
+
+    a = _mm256_permutevar8x32_epi32 (a, split);
+    b = _mm256_permutevar8x32_epi32 (b, split);
+
+    _mm256_storeu_si256 ((__m256i *) (l + i),
+        _mm256_permute2x128_si256 (a, b, 0x20));
+    _mm256_storeu_si256 ((__m256i *) (r + i),
+        _mm256_permute2x128_si256 (a, b, 0x31));
+  }
+  for (; i < nsamples; i++) {
+    l[i] = in[2 * i];
+    r[i] = in[2 * i + 1];
+  }
+}
+
+__attribute__ ((target ("avx2")))
+static void
+deinterleave_8ch_32_avx2 (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint32 **out = (guint32 **) planes;
+  const guint32 *in = src;
+  gint i, c;
+
+  for (i = 0; i + 8 <= nsamples; i += 8) {
+    __m256i v[8];
+
+    for (c = 0; c < 8; c++)
+      v[c] = _mm256_loadu_si256 ((const __m256i *) (in + 8 * (i + c)));
+    transpose_8x8_avx2 (v);
+    for (c = 0; c < 8; c++)
+      _mm256_storeu_si256 ((__m256i *) (out[c] + i), v[c]);
+  }
+  for (; i < nsamples; i++)
+    for (c = 0; c < 8; c++)
+      out[c][i] = in[8 * i + c];
+}
+#endif
+
+#ifdef HAVE_INTERLEAVE_NEON
+static void
+interleave_2ch_16_neon (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint16 *l = planes[0], *r = planes[1];
+  guint16 *out = dest;
+  gint i;
+
+  for (i = 0; i + 8 <= nsamples; i += 8) {
+    uint16x8x2_t v;
+
+    v.val[0] = vld1q_u16 (l + i);
+    v.val[1] = vld1q_u16 (r + i);
+    vst2q_u16 (out + 2 * i, v);
+  }
+  for (; i < nsamples; i++) {
+    out[2 * i] = l[i];
+    out[2 * i + 1] = r[i];
+  }
+}
+
+static void
+interleave_2ch_32_neon (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint32 *l = planes[0], *r = planes[1];
+  guint32 *out = dest;
+  gint i;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    uint32x4x2_t v;
+
+    v.val[0] = vld1q_u32 (l + i);
+    v.val[1] = vld1q_u32 (r + i);
+    vst2q_u32 (out + 2 * i, v);
+  }
+  for (; i < nsamples; i++) {
+    out[2 * i] = l[i];
+    out[2 * i + 1] = r[i];
+  }
+}
+
+/* transposes 4 samples of 4 channels into 4 frames, a function rather than
+ * a macro so its temporaries can't shadow the arguments */
+static inline uint32x4x4_t
+transpose_4x4_neon (uint32x4_t c0, uint32x4_t c1, uint32x4_t c2,
+    uint32x4_t c3)
+{
+  uint32x4x2_t t0 = vzipq_u32 (c0, c2);
+  uint32x4x2_t t1 = vzipq_u32 (c1, c3);
+  uint32x4x2_t u0 = vzipq_u32 (t0.val[0], t1.val[0]);
+  uint32x4x2_t u1 = vzipq_u32 (t0.val[1], t1.val[1]);
+  uint32x4x4_t s;
+
+  s.val[0] = u0.val[0];
+  s.val[1] = u0.val[1];
+  s.val[2] = u1.val[0];
+  s.val[3] = u1.val[1];
+
+  return s;
+}
+
+static void
+interleave_6ch_32_neon (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint32 *const *in = (const guint32 * const *) planes;
+  guint32 *out = dest;
+  gint i, c;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    uint32x4x4_t s;
+    uint32x4x2_t u;
+    guint32 *o = out + 6 * i;
+
+    s = transpose_4x4_neon (vld1q_u32 (in[0] + i), vld1q_u32 (in[1] + i),
+        vld1q_u32 (in[2] + i), vld1q_u32 (in[3] + i));
+    /* channels 4 and 5 of frames 0 and 1, 2 and 3 */
+    u = vzipq_u32 (vld1q_u32 (in[4] + i), vld1q_u32 (in[5] + i));
+
+    vst1q_u32 (o + 0, s.val[0]);
+    vst1q_u32 (o + 4, vcombine_u32 (vget_low_u32 (u.val[0]),
+            vget_low_u32 (s.val[1])));
+    vst1q_u32 (o + 8, vcombine_u32 (vget_high_u32 (s.val[1]),
+            vget_high_u32 (u.val[0])));
+    vst1q_u32 (o + 12, s.val[2]);
+    vst1q_u32 (o + 16, vcombine_u32 (vget_low_u32 (u.val[1]),
+            vget_low_u32 (s.val[3])));
+    vst1q_u32 (o + 20, vcombine_u32 (vget_high_u32 (s.val[3]),
+            vget_high_u32 (u.val[1])));
+  }
+  for (; i < nsamples; i++)
+    for (c = 0; c < 6; c++)
+      out[6 * i + c] = in[c][i];
+}
+
+static void
+interleave_8ch_32_neon (gpointer dest, const gpointer * planes, gint nsamples)
+{
+  const guint32 *const *in = (const guint32 * const *) planes;
+  guint32 *out = dest;
+  gint i, c;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    uint32x4x4_t s, r;
+    guint32 *o = out + 8 * i;
+
+    s = transpose_4x4_neon (vld1q_u32 (in[0] + i), vld1q_u32 (in[1] + i),
+        vld1q_u32 (in[2] + i), vld1q_u32 (in[3] + i));
+    r = transpose_4x4_neon (vld1q_u32 (in[4] + i), vld1q_u32 (in[5] + i),
+        vld1q_u32 (in[6] + i), vld1q_u32 (in[7] + i));
+
+    vst1q_u32 (o + 0, s.val[0]);
+    vst1q_u32 (o + 4, r.val[0]);
+    vst1q_u32 (o + 8, s.val[1]);
+    vst1q_u32 (o + 12, r.val[1]);
+    vst1q_u32 (o + 16, s.val[2]);
+    vst1q_u32 (o + 20, r.val[2]);
+    vst1q_u32 (o + 24, s.val[3]);
+    vst1q_u32 (o + 28, r.val[3]);
+  }
+  for (; i < nsamples; i++)
+    for (c = 0; c < 8; c++)
+      out[8 * i + c] = in[c][i];
+}
+
+static void
+deinterleave_2ch_16_neon (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint16 *l = planes[0], *r = planes[1];
+  const guint16 *in = src;
+  gint i;
+
+  for (i = 0; i + 8 <= nsamples; i += 8) {
+    uint16x8x2_t v = vld2q_u16 (in + 2 * i);
+
+    vst1q_u16 (l + i, v.val[0]);
+    vst1q_u16 (r + i, v.val[1]);
+  }
+  for (; i < nsamples; i++) {
+    l[i] = in[2 * i];
+    r[i] = in[2 * i + 1];
+  }
+}
+
+static void
+deinterleave_2ch_32_neon (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint32 *l = planes[0], *r = planes[1];
+  const guint32 *in = src;
+  gint i;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    uint32x4x2_t v = vld2q_u32 (in + 2 * i);
+
+    vst1q_u32 (l + i, v.val[0]);
+    vst1q_u32 (r + i, v.val[1]);
+  }
+  for (; i < nsamples; i++) {
+    l[i] = in[2 * i];
+    r[i] = in[2 * i + 1];
+  }
+}
+
+static void
+deinterleave_6ch_32_neon (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint32 **out = (guint32 **) planes;
+  const guint32 *in = src;
+  gint i, c;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    const guint32 *f = in + 6 * i;
+    uint32x4_t v1 = vld1q_u32 (f + 4), v2 = vld1q_u32 (f + 8);
+    uint32x4_t v4 = vld1q_u32 (f + 16), v5 = vld1q_u32 (f + 20);
+    uint32x4x4_t s;
+    uint32x4x2_t u;
+
+    /* channels 0-3 of the 4 frames */
+    s = transpose_4x4_neon (vld1q_u32 (f + 0),
+        vcombine_u32 (vget_high_u32 (v1), vget_low_u32 (v2)),
+        vld1q_u32 (f + 12),
+        vcombine_u32 (vget_high_u32 (v4), vget_low_u32 (v5)));
+    /* channels 4 and 5 */
+    u = vuzpq_u32 (vcombine_u32 (vget_low_u32 (v1), vget_high_u32 (v2)),
+        vcombine_u32 (vget_low_u32 (v4), vget_high_u32 (v5)));
+
+    vst1q_u32 (out[0] + i, s.val[0]);
+    vst1q_u32 (out[1] + i, s.val[1]);
+    vst1q_u32 (out[2] + i, s.val[2]);
+    vst1q_u32 (out[3] + i, s.val[3]);
+    vst1q_u32 (out[4] + i, u.val[0]);
+    vst1q_u32 (out[5] + i, u.val[1]);
+  }
+  for (; i < nsamples; i++)
+    for (c = 0; c < 6; c++)
+      out[c][i] = in[6 * i + c];
+}
+
+static void
+deinterleave_8ch_32_neon (gpointer * planes, gconstpointer src, gint nsamples)
+{
+  guint32 **out = (guint32 **) planes;
+  const guint32 *in = src;
+  gint i, c;
+
+  for (i = 0; i + 4 <= nsamples; i += 4) {
+    const guint32 *f = in + 8 * i;
+    uint32x4x4_t s, r;
+
+    s = transpose_4x4_neon (vld1q_u32 (f + 0), vld1q_u32 (f + 8),
+        vld1q_u32 (f + 16), vld1q_u32 (f + 24));
+    r = transpose_4x4_neon (vld1q_u32 (f + 4), vld1q_u32 (f + 12),
+        vld1q_u32 (f + 20), vld1q_u32 (f + 28));
+
+    vst1q_u32 (out[0] + i, s.val[0]);
+    vst1q_u32 (out[1] + i, s.val[1]);
+    vst1q_u32 (out[2] + i, s.val[2]);
+    vst1q_u32 (out[3] + i, s.val[3]);
+    vst1q_u32 (out[4] + i, r.val[0]);
+    vst1q_u32 (out[5] + i, r.val[1]);
+    vst1q_u32 (out[6] + i, r.val[2]);
+    vst1q_u32 (out[7] + i, r.val[3]);
+  }
+  for (; i < nsamples; i++)
+    for (c = 0; c < 8; c++)
+      out[c][i] = in[8 * i + c];
+}
+#endif
+
+static void
+interleave_init (void)
+{
+  interleave_funcs[0][0] = interleave_2ch_8_c;
+  interleave_funcs[0][1] = interleave_6ch_8_c;
+  interleave_funcs[0][2] = interleave_8ch_8_c;
+  interleave_funcs[1][0] = interleave_2ch_16_c;
+  interleave_funcs[1][1] = interleave_6ch_16_c;
+  interleave_funcs[1][2] = interleave_8ch_16_c;
+  interleave_funcs[2][0] = interleave_2ch_32_c;
+  interleave_funcs[2][1] = interleave_6ch_32_c;
+  interleave_funcs[2][2] = interleave_8ch_32_c;
+  interleave_funcs[3][0] = interleave_2ch_64_c;
+  interleave_funcs[3][1] = interleave_6ch_64_c;
+  interleave_funcs[3][2] = interleave_8ch_64_c;
+
+  deinterleave_funcs[0][0] = deinterleave_2ch_8_c;
+  deinterleave_funcs[0][1] = deinterleave_6ch_8_c;
+  deinterleave_funcs[0][2] = deinterleave_8ch_8_c;
+  deinterleave_funcs[1][0] = deinterleave_2ch_16_c;
+  deinterleave_funcs[1][1] = deinterleave_6ch_16_c;
+  deinterleave_funcs[1][2] = deinterleave_8ch_16_c;
+  deinterleave_funcs[2][0] = deinterleave_2ch_32_c;
+  deinterleave_funcs[2][1] = deinterleave_6ch_32_c;
+  deinterleave_funcs[2][2] = deinterleave_8ch_32_c;
+  deinterleave_funcs[3][0] = deinterleave_2ch_64_c;
+  deinterleave_funcs[3][1] = deinterleave_6ch_64_c;
+  deinterleave_funcs[3][2] = deinterleave_8ch_64_c;
+
+#ifdef HAVE_INTERLEAVE_SSE2
+  interleave_funcs[1][0] = interleave_2ch_16_sse2;
+  interleave_funcs[2][0] = interleave_2ch_32_sse2;
+  interleave_funcs[2][1] = interleave_6ch_32_sse2;
+  interleave_funcs[2][2] = interleave_8ch_32_sse2;
+  interleave_funcs[3][0] = interleave_2ch_64_sse2;
+  deinterleave_funcs[1][0] = deinterleave_2ch_16_sse2;
+  deinterleave_funcs[2][0] = deinterleave_2ch_32_sse2;
+  deinterleave_funcs[2][1] = deinterleave_6ch_32_sse2;
+  deinterleave_funcs[2][2] = deinterleave_8ch_32_sse2;
+  deinterleave_funcs[3][0] = deinterleave_2ch_64_sse2;
+  GST_DEBUG ("using SSE2 (de)interleave functions");
+#endif
+
+#ifdef HAVE_INTERLEAVE_AVX2
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2")) {
+    interleave_funcs[1][0] = interleave_2ch_16_avx2;
+    interleave_funcs[2][0] = interleave_2ch_32_avx2;
+    interleave_funcs[2][2] = interleave_8ch_32_avx2;
+    deinterleave_funcs[1][0] = deinterleave_2ch_16_avx2;
+    deinterleave_funcs[2][0] = deinterleave_2ch_32_avx2;
+    deinterleave_funcs[2][2] = deinterleave_8ch_32_avx2;
+    GST_DEBUG ("using AVX2 (de)interleave functions");
+  }
+#endif
+
+#ifdef HAVE_INTERLEAVE_NEON
+  interleave_funcs[1][0] = interleave_2ch_16_neon;
+  interleave_funcs[2][0] = interleave_2ch_32_neon;
+  interleave_funcs[2][1] = interleave_6ch_32_neon;
+  interleave_funcs[2][2] = interleave_8ch_32_neon;
+  deinterleave_funcs[1][0] = deinterleave_2ch_16_neon;
+  deinterleave_funcs[2][0] = deinterleave_2ch_32_neon;
+  deinterleave_funcs[2][1] = deinterleave_6ch_32_neon;
+  deinterleave_funcs[2][2] = deinterleave_8ch_32_neon;
+  GST_DEBUG ("using NEON (de)interleave functions");
+#endif
+}
+
+/* index into the function tables for a sample width */
+static gint
+width_index (gint width)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized)) {
+    interleave_init ();
+    g_once_init_leave (&initialized, 1);
+  }
+
+  switch (width) {
+    case 8:
+      return 0;
+    case 16:
+      return 1;
+    case 32:
+      return 2;
+    case 64:
+      return 3;
+    default:
+      g_assert_not_reached ();
+      return 0;
+  }
+}
+
+/* index into the function tables, or -1 for the generic code */
+static gint
+channels_index (gint channels)
+{
+  switch (channels) {
+    case 2:
+      return 0;
+    case 6:
+      return 1;
+    case 8:
+      return 2;
+    default:
+      return -1;
+  }
+}
+
+void
+gst_ffmpeg_audio_interleave (gpointer dest, const gpointer * planes,
+    gint width, gint channels, gint nsamples)
+{
+  gint w, c;
+
+  w = width_index (width);
+  c = channels_index (channels);
+
+  if (c >= 0) {
+    interleave_funcs[w][c] (dest, planes, nsamples);
+    return;
+  }
+
+  switch (width) {
+    case 8:
+      interleave_8_c (dest, planes, channels, nsamples);
+      break;
+    case 16:
+      interleave_16_c (dest, planes, channels, nsamples);
+      break;
+    case 32:
+      interleave_32_c (dest, planes, channels, nsamples);
+      break;
+    case 64:
+      interleave_64_c (dest, planes, channels, nsamples);
+      break;
+  }
+}
+
+void
+gst_ffmpeg_audio_deinterleave (gpointer * planes, gconstpointer src,
+    gint width, gint channels, gint nsamples)
+{
+  gint w, c;
+
+  w = width_index (width);
+  c = channels_index (channels);
+
+  if (c >= 0) {
+    deinterleave_funcs[w][c] (planes, src, nsamples);
+    return;
+  }
+
+  switch (width) {
+    case 8:
+      deinterleave_8_c (planes, src, channels, nsamples);
+      break;
+    case 16:
+      deinterleave_16_c (planes, src, channels, nsamples);
+      break;
+    case 32:
+      deinterleave_32_c (planes, src, channels, nsamples);
+      break;
+    case 64:
+      deinterleave_64_c (planes, src, channels, nsamples);
+      break;
+  }
+}
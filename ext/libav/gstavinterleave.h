@@ -0,0 +1,46 @@
+/* GStreamer
+ * Copyright (C) <2018> GStreamer developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_FFMPEG_INTERLEAVE_H__
+#define __GST_FFMPEG_INTERLEAVE_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Interleave @nsamples samples of @width bits (8, 16, 32 or 64) from the
+ * @channels planes in @planes into @dest. Uses SIMD kernels for the common
+ * stereo, 5.1 and 7.1 layouts when the CPU supports them.
+ */
+void
+gst_ffmpeg_audio_interleave (gpointer dest, const gpointer * planes,
+                             gint width, gint channels, gint nsamples);
+
+/*
+ * The reverse of gst_ffmpeg_audio_interleave(): split @nsamples interleaved
+ * frames from @src into the @channels planes in @planes.
+ */
+void
+gst_ffmpeg_audio_deinterleave (gpointer * planes, gconstpointer src,
+                               gint width, gint channels, gint nsamples);
+
+G_END_DECLS
+
+#endif /* __GST_FFMPEG_INTERLEAVE_H__ */
@@ -20,10 +20,21 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+/* for sched_setaffinity() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "gstav.h"
 #include "gstavutils.h"
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 #ifdef __APPLE__
 #include <sys/sysctl.h>
 #endif
@@ -493,3 +504,139 @@ gst_ffmpeg_auto_max_threads (void)
 
   return (int) (n_threads);
 }
+
+#ifdef __linux__
+#define NUMA_MAX_NODES 1024
+#define NUMA_MASK_LONGS (NUMA_MAX_NODES / (8 * sizeof (unsigned long)))
+
+struct _GstFFMpegThreadPlacement
+{
+  gboolean affinity_set;
+  cpu_set_t affinity;
+  gboolean policy_set;
+  int mode;
+  unsigned long nodemask[NUMA_MASK_LONGS];
+};
+
+/* parses a list like "0-3,8,10-11" as found in /sys/devices/system/cpu */
+static gboolean
+parse_cpu_list (const gchar * list, cpu_set_t * set)
+{
+  gchar **ranges, **r;
+  gboolean ret = TRUE;
+
+  CPU_ZERO (set);
+
+  ranges = g_strsplit (list, ",", -1);
+  for (r = ranges; *r && ret; r++) {
+    gchar *range = g_strstrip (*r), *end;
+    guint64 first, last;
+
+    first = last = g_ascii_strtoull (range, &end, 10);
+    if (end == range) {
+      ret = FALSE;
+      break;
+    }
+    if (*end == '-') {
+      range = end + 1;
+      last = g_ascii_strtoull (range, &end, 10);
+      if (end == range) {
+        ret = FALSE;
+        break;
+      }
+    }
+    if (*end != '\0' || last < first || last >= CPU_SETSIZE) {
+      ret = FALSE;
+      break;
+    }
+    for (; first <= last; first++)
+      CPU_SET (first, set);
+  }
+  g_strfreev (ranges);
+
+  return ret && CPU_COUNT (set) > 0;
+}
+
+GstFFMpegThreadPlacement *
+gst_ffmpeg_thread_placement_apply (GstObject * obj, const gchar * cpu_set,
+    gint numa_node)
+{
+  GstFFMpegThreadPlacement *saved;
+  cpu_set_t set;
+
+  if ((cpu_set == NULL || *cpu_set == '\0') && numa_node < 0)
+    return NULL;
+
+  saved = g_slice_new0 (GstFFMpegThreadPlacement);
+
+  if (cpu_set && *cpu_set) {
+    if (!parse_cpu_list (cpu_set, &set)) {
+      GST_WARNING_OBJECT (obj, "invalid cpu-set '%s'", cpu_set);
+    } else if (sched_getaffinity (0, sizeof (cpu_set_t), &saved->affinity) < 0
+        || sched_setaffinity (0, sizeof (cpu_set_t), &set) < 0) {
+      GST_WARNING_OBJECT (obj, "failed to set cpu affinity: %s",
+          g_strerror (errno));
+    } else {
+      saved->affinity_set = TRUE;
+    }
+  }
+
+  if (numa_node >= NUMA_MAX_NODES) {
+    GST_WARNING_OBJECT (obj, "invalid numa-node %d", numa_node);
+  } else if (numa_node >= 0) {
+    unsigned long nodemask[NUMA_MASK_LONGS] = { 0, };
+
+    nodemask[numa_node / (8 * sizeof (unsigned long))] =
+        1UL << (numa_node % (8 * sizeof (unsigned long)));
+
+    /* set_mempolicy() takes the number of bits plus one */
+    if (syscall (SYS_get_mempolicy, &saved->mode, saved->nodemask,
+            (unsigned long) NUMA_MAX_NODES, NULL, 0UL) < 0
+        || syscall (SYS_set_mempolicy, MPOL_PREFERRED, nodemask,
+            (unsigned long) NUMA_MAX_NODES + 1) < 0) {
+      GST_WARNING_OBJECT (obj, "failed to set memory policy: %s",
+          g_strerror (errno));
+    } else {
+      saved->policy_set = TRUE;
+    }
+  }
+
+  if (!saved->affinity_set && !saved->policy_set) {
+    g_slice_free (GstFFMpegThreadPlacement, saved);
+    return NULL;
+  }
+
+  return saved;
+}
+
+void
+gst_ffmpeg_thread_placement_restore (GstFFMpegThreadPlacement * saved)
+{
+  if (saved == NULL)
+    return;
+
+  if (saved->affinity_set)
+    sched_setaffinity (0, sizeof (cpu_set_t), &saved->affinity);
+  if (saved->policy_set)
+    syscall (SYS_set_mempolicy, saved->mode,
+        saved->mode == MPOL_DEFAULT ? NULL : saved->nodemask,
+        (unsigned long) NUMA_MAX_NODES + 1);
+
+  g_slice_free (GstFFMpegThreadPlacement, saved);
+}
+#else
+GstFFMpegThreadPlacement *
+gst_ffmpeg_thread_placement_apply (GstObject * obj, const gchar * cpu_set,
+    gint numa_node)
+{
+  if ((cpu_set && *cpu_set) || numa_node >= 0)
+    GST_WARNING_OBJECT (obj, "thread placement is only supported on Linux");
+
+  return NULL;
+}
+
+void
+gst_ffmpeg_thread_placement_restore (GstFFMpegThreadPlacement * saved)
+{
+}
+#endif
@@ -94,4 +94,20 @@ av_smp_format_depth(enum AVSampleFormat smp_fmt);
 GstBuffer *
 new_aligned_buffer (gint size);
 
+/*
+ * Pin the calling thread to the CPUs in @cpu_set (a Linux style list like
+ * "0-7,16") and prefer memory from @numa_node (-1 for none). Threads created
+ * in between, like the libav worker threads spawned when opening a codec,
+ * inherit the placement. Returns the previous placement for
+ * gst_ffmpeg_thread_placement_restore(), or NULL if nothing was changed.
+ */
+typedef struct _GstFFMpegThreadPlacement GstFFMpegThreadPlacement;
+
+GstFFMpegThreadPlacement *
+gst_ffmpeg_thread_placement_apply (GstObject * obj, const gchar * cpu_set,
+                                   gint numa_node);
+
+void
+gst_ffmpeg_thread_placement_restore (GstFFMpegThreadPlacement * saved);
+
 #endif /* __GST_FFMPEG_UTILS_H__ */
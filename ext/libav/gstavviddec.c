@@ -46,6 +46,11 @@
 #define DEFAULT_DEBUG_MV		FALSE
 #define DEFAULT_MAX_THREADS		0
 #define DEFAULT_OUTPUT_CORRUPT		TRUE
+#define DEFAULT_POOL_MEMORY		GST_FFMPEG_POOL_MEMORY_SYSTEM
+#define DEFAULT_INTRA_CONTEXTS		0
+#define MAX_INTRA_CONTEXTS		64
+#define DEFAULT_CPU_SET			NULL
+#define DEFAULT_NUMA_NODE		-1
 #define REQUIRED_POOL_MAX_BUFFERS       32
 #define DEFAULT_STRIDE_ALIGN            31
 #define DEFAULT_ALLOC_PARAM             { 0, DEFAULT_STRIDE_ALIGN, 0, 0, }
@@ -59,6 +64,10 @@ enum
   PROP_DEBUG_MV,
   PROP_MAX_THREADS,
   PROP_OUTPUT_CORRUPT,
+  PROP_POOL_MEMORY,
+  PROP_INTRA_CONTEXTS,
+  PROP_CPU_SET,
+  PROP_NUMA_NODE,
   PROP_LAST
 };
 
@@ -204,6 +213,7 @@ gst_ffmpegviddec_class_init (GstFFMpegVidDecClass * klass)
 {
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
   GstVideoDecoderClass *viddec_class = GST_VIDEO_DECODER_CLASS (klass);
+  const AVCodecDescriptor *desc;
   int caps;
 
   parent_class = g_type_class_peek_parent (klass);
@@ -245,6 +255,37 @@ gst_ffmpegviddec_class_init (GstFFMpegVidDecClass * klass)
             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
   }
 
+  g_object_class_install_property (gobject_class, PROP_CPU_SET,
+      g_param_spec_string ("cpu-set", "CPU set",
+          "CPUs to run the libav worker threads on, as a list like \"0-7,16\" "
+          "(NULL = inherit from the streaming thread)", DEFAULT_CPU_SET,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_NUMA_NODE,
+      g_param_spec_int ("numa-node", "NUMA node",
+          "NUMA node to prefer for the libav worker threads and frame pool "
+          "memory (-1 = default policy)", -1, G_MAXINT, DEFAULT_NUMA_NODE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  if (caps & CODEC_CAP_DR1) {
+    g_object_class_install_property (gobject_class, PROP_POOL_MEMORY,
+        g_param_spec_enum ("pool-memory", "Pool memory",
+            "Memory backing the internal direct rendering pool. Frames from "
+            "this pool are pushed downstream when it supports video meta",
+            GST_TYPE_FFMPEG_POOL_MEMORY, DEFAULT_POOL_MEMORY,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  }
+
+  desc = avcodec_descriptor_get (klass->in_plugin->id);
+  if (desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY)) {
+    g_object_class_install_property (gobject_class, PROP_INTRA_CONTEXTS,
+        g_param_spec_int ("intra-contexts", "Intra decoding contexts",
+            "Number of single threaded decoding contexts that independent "
+            "frames are dispatched to in parallel. Adds about one frame of "
+            "latency, also in live pipelines (0 = disabled)",
+            0, MAX_INTRA_CONTEXTS, DEFAULT_INTRA_CONTEXTS,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  }
+
   viddec_class->set_format = gst_ffmpegviddec_set_format;
   viddec_class->handle_frame = gst_ffmpegviddec_handle_frame;
   viddec_class->start = gst_ffmpegviddec_start;
@@ -272,6 +313,14 @@ gst_ffmpegviddec_init (GstFFMpegVidDec * ffmpegdec)
   ffmpegdec->debug_mv = DEFAULT_DEBUG_MV;
   ffmpegdec->max_threads = DEFAULT_MAX_THREADS;
   ffmpegdec->output_corrupt = DEFAULT_OUTPUT_CORRUPT;
+  ffmpegdec->pool_memory = DEFAULT_POOL_MEMORY;
+  ffmpegdec->intra_contexts = DEFAULT_INTRA_CONTEXTS;
+  ffmpegdec->cpu_set = g_strdup (DEFAULT_CPU_SET);
+  ffmpegdec->numa_node = DEFAULT_NUMA_NODE;
+
+  g_queue_init (&ffmpegdec->intra_jobs);
+  g_mutex_init (&ffmpegdec->intra_lock);
+  g_cond_init (&ffmpegdec->intra_cond);
 
   GST_PAD_SET_ACCEPT_TEMPLATE (GST_VIDEO_DECODER_SINK_PAD (ffmpegdec));
   gst_video_decoder_set_use_default_pad_acceptcaps (GST_VIDEO_DECODER_CAST
@@ -293,6 +342,10 @@ gst_ffmpegviddec_finalize (GObject * object)
     ffmpegdec->context = NULL;
   }
 
+  g_mutex_clear (&ffmpegdec->intra_lock);
+  g_cond_clear (&ffmpegdec->intra_cond);
+  g_free (ffmpegdec->cpu_set);
+
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
@@ -308,6 +361,180 @@ gst_ffmpegviddec_context_set_flags (AVCodecContext * context, guint flags,
     context->flags &= ~flags;
 }
 
+typedef struct
+{
+  GstVideoCodecFrame *frame;
+  AVPacket packet;
+  AVFrame *picture;
+  enum AVDiscard skip_frame;
+  gboolean mode_switch;
+  gint len;
+  gint have_data;
+  gboolean done;
+} GstFFMpegVidDecIntraJob;
+
+static void
+gst_ffmpegviddec_intra_job_free (GstFFMpegVidDecIntraJob * job)
+{
+  av_packet_unref (&job->packet);
+  av_frame_free (&job->picture);
+  if (job->frame)
+    gst_video_codec_frame_unref (job->frame);
+  g_slice_free (GstFFMpegVidDecIntraJob, job);
+}
+
+/* runs in the thread pool, any idle context can decode any packet */
+static void
+gst_ffmpegviddec_intra_decode (GstFFMpegVidDecIntraJob * job,
+    GstFFMpegVidDec * ffmpegdec)
+{
+  AVCodecContext *context;
+
+  context = g_async_queue_pop (ffmpegdec->intra_idle);
+  context->skip_frame = job->skip_frame;
+  job->len = avcodec_decode_video2 (context, job->picture, &job->have_data,
+      &job->packet);
+  g_async_queue_push (ffmpegdec->intra_idle, context);
+
+  g_mutex_lock (&ffmpegdec->intra_lock);
+  job->done = TRUE;
+  g_cond_broadcast (&ffmpegdec->intra_cond);
+  g_mutex_unlock (&ffmpegdec->intra_lock);
+}
+
+static void
+gst_ffmpegviddec_intra_wait (GstFFMpegVidDec * ffmpegdec,
+    GstFFMpegVidDecIntraJob * job)
+{
+  g_mutex_lock (&ffmpegdec->intra_lock);
+  while (!job->done)
+    g_cond_wait (&ffmpegdec->intra_cond, &ffmpegdec->intra_lock);
+  g_mutex_unlock (&ffmpegdec->intra_lock);
+}
+
+/* waits for all jobs in flight and drops their pictures */
+static void
+gst_ffmpegviddec_intra_discard (GstFFMpegVidDec * ffmpegdec)
+{
+  GstFFMpegVidDecIntraJob *job;
+
+  while ((job = g_queue_pop_head (&ffmpegdec->intra_jobs))) {
+    gst_ffmpegviddec_intra_wait (ffmpegdec, job);
+    gst_ffmpegviddec_intra_job_free (job);
+  }
+}
+
+static void
+gst_ffmpegviddec_intra_close (GstFFMpegVidDec * ffmpegdec)
+{
+  AVCodecContext *context;
+
+  gst_ffmpegviddec_intra_discard (ffmpegdec);
+
+  if (ffmpegdec->intra_pool) {
+    g_thread_pool_free (ffmpegdec->intra_pool, FALSE, TRUE);
+    ffmpegdec->intra_pool = NULL;
+  }
+
+  if (ffmpegdec->intra_idle) {
+    while ((context = g_async_queue_try_pop (ffmpegdec->intra_idle))) {
+      gst_ffmpeg_avcodec_close (context);
+      avcodec_free_context (&context);
+    }
+    g_async_queue_unref (ffmpegdec->intra_idle);
+    ffmpegdec->intra_idle = NULL;
+  }
+  ffmpegdec->intra_n_contexts = 0;
+}
+
+/* sets up a freshly reset @context for the caps of @state, the main one as
+ * well as the intra ones */
+static void
+gst_ffmpegviddec_configure_context (GstFFMpegVidDec * ffmpegdec,
+    AVCodecContext * context, GstVideoCodecState * state)
+{
+  GstFFMpegVidDecClass *oclass;
+
+  oclass = (GstFFMpegVidDecClass *) (G_OBJECT_GET_CLASS (ffmpegdec));
+
+  /* FIXME : Create a method that takes GstVideoCodecState instead */
+  /* get size and so */
+  gst_ffmpeg_caps_with_codecid (oclass->in_plugin->id,
+      oclass->in_plugin->type, state->caps, context);
+
+  if (!context->time_base.den || !context->time_base.num) {
+    GST_DEBUG_OBJECT (ffmpegdec, "forcing 25/1 framerate");
+    context->time_base.num = 1;
+    context->time_base.den = 25;
+  }
+
+  /* workaround encoder bugs */
+  context->workaround_bugs |= FF_BUG_AUTODETECT;
+  context->err_recognition = 1;
+
+  /* for slow cpus */
+  context->lowres = ffmpegdec->lowres;
+  context->skip_frame = ffmpegdec->skip_frame;
+
+  /* ffmpeg can draw motion vectors on top of the image (not every decoder
+   * supports it) */
+  context->debug_mv = ffmpegdec->debug_mv;
+}
+
+/* with LOCK, the main context must be open already */
+static gboolean
+gst_ffmpegviddec_intra_open (GstFFMpegVidDec * ffmpegdec,
+    GstVideoCodecState * state)
+{
+  GstFFMpegVidDecClass *oclass;
+  AVCodecContext *context;
+  gint i;
+
+  oclass = (GstFFMpegVidDecClass *) (G_OBJECT_GET_CLASS (ffmpegdec));
+
+  ffmpegdec->intra_idle = g_async_queue_new ();
+
+  for (i = 0; i < ffmpegdec->intra_contexts; i++) {
+    context = avcodec_alloc_context3 (oclass->in_plugin);
+    if (context == NULL)
+      goto could_not_open;
+    gst_ffmpegviddec_configure_context (ffmpegdec, context, state);
+    gst_ffmpegviddec_context_set_flags (context, CODEC_FLAG_OUTPUT_CORRUPT,
+        ffmpegdec->output_corrupt);
+
+    /* the workers can't take the stream lock for direct rendering, so they
+     * keep the default get_buffer2 and the pictures are copied into the
+     * output buffers instead */
+    context->thread_count = 1;
+
+    if (gst_ffmpeg_avcodec_open (context, oclass->in_plugin) < 0)
+      goto could_not_open;
+
+    g_async_queue_push (ffmpegdec->intra_idle, context);
+    ffmpegdec->intra_n_contexts++;
+  }
+
+  /* exclusive, so that the threads are started now and inherit the thread
+   * placement */
+  ffmpegdec->intra_pool =
+      g_thread_pool_new ((GFunc) gst_ffmpegviddec_intra_decode, ffmpegdec,
+      ffmpegdec->intra_n_contexts, TRUE, NULL);
+
+  GST_DEBUG_OBJECT (ffmpegdec, "decoding with %d intra contexts",
+      ffmpegdec->intra_n_contexts);
+
+  return TRUE;
+
+  /* ERRORS */
+could_not_open:
+  {
+    GST_WARNING_OBJECT (ffmpegdec, "Failed to open intra context %d", i);
+    avcodec_free_context (&context);
+    gst_ffmpegviddec_intra_close (ffmpegdec);
+    return FALSE;
+  }
+}
+
 /* with LOCK */
 static gboolean
 gst_ffmpegviddec_close (GstFFMpegVidDec * ffmpegdec, gboolean reset)
@@ -321,6 +548,7 @@ gst_ffmpegviddec_close (GstFFMpegVidDec * ffmpegdec, gboolean reset)
 
   gst_caps_replace (&ffmpegdec->last_caps, NULL);
 
+  gst_ffmpegviddec_intra_close (ffmpegdec);
   gst_ffmpeg_avcodec_close (ffmpegdec->context);
   ffmpegdec->opened = FALSE;
 
@@ -405,6 +633,9 @@ gst_ffmpegviddec_set_format (GstVideoDecoder * decoder,
   GstFFMpegVidDec *ffmpegdec;
   GstFFMpegVidDecClass *oclass;
   GstClockTime latency = GST_CLOCK_TIME_NONE;
+  GstClockTime max_latency = GST_CLOCK_TIME_NONE;
+  GstFFMpegThreadPlacement *placement;
+  gint thread_count;
   gboolean ret = FALSE;
 
   ffmpegdec = (GstFFMpegVidDec *) decoder;
@@ -462,34 +693,13 @@ gst_ffmpegviddec_set_format (GstVideoDecoder * decoder,
   GST_LOG_OBJECT (ffmpegdec, "size %dx%d", ffmpegdec->context->width,
       ffmpegdec->context->height);
 
-  /* FIXME : Create a method that takes GstVideoCodecState instead */
-  /* get size and so */
-  gst_ffmpeg_caps_with_codecid (oclass->in_plugin->id,
-      oclass->in_plugin->type, state->caps, ffmpegdec->context);
+  gst_ffmpegviddec_configure_context (ffmpegdec, ffmpegdec->context, state);
 
   GST_LOG_OBJECT (ffmpegdec, "size after %dx%d", ffmpegdec->context->width,
       ffmpegdec->context->height);
 
   gst_ffmpegviddec_get_palette (ffmpegdec, state);
 
-  if (!ffmpegdec->context->time_base.den || !ffmpegdec->context->time_base.num) {
-    GST_DEBUG_OBJECT (ffmpegdec, "forcing 25/1 framerate");
-    ffmpegdec->context->time_base.num = 1;
-    ffmpegdec->context->time_base.den = 25;
-  }
-
-  /* workaround encoder bugs */
-  ffmpegdec->context->workaround_bugs |= FF_BUG_AUTODETECT;
-  ffmpegdec->context->err_recognition = 1;
-
-  /* for slow cpus */
-  ffmpegdec->context->lowres = ffmpegdec->lowres;
-  ffmpegdec->context->skip_frame = ffmpegdec->skip_frame;
-
-  /* ffmpeg can draw motion vectors on top of the image (not every decoder
-   * supports it) */
-  ffmpegdec->context->debug_mv = ffmpegdec->debug_mv;
-
   {
     GstQuery *query;
     gboolean is_live;
@@ -517,11 +727,38 @@ gst_ffmpegviddec_set_format (GstVideoDecoder * decoder,
       ffmpegdec->context->thread_type = FF_THREAD_SLICE | FF_THREAD_FRAME;
   }
 
+  /* with intra contexts the main context never decodes */
+  thread_count = ffmpegdec->context->thread_count;
+  if (ffmpegdec->intra_contexts > 0)
+    ffmpegdec->context->thread_count = 1;
+
   /* open codec - we don't select an output pix_fmt yet,
    * simply because we don't know! We only get it
    * during playback... */
-  if (!gst_ffmpegviddec_open (ffmpegdec))
+  /* libav spawns its worker threads here, they inherit the placement */
+  placement = gst_ffmpeg_thread_placement_apply (GST_OBJECT (ffmpegdec),
+      ffmpegdec->cpu_set, ffmpegdec->numa_node);
+
+  if (!gst_ffmpegviddec_open (ffmpegdec)) {
+    gst_ffmpeg_thread_placement_restore (placement);
     goto open_failed;
+  }
+
+  if (ffmpegdec->intra_contexts > 0
+      && !gst_ffmpegviddec_intra_open (ffmpegdec, state)) {
+    GST_WARNING_OBJECT (ffmpegdec, "falling back to a single context");
+
+    /* the main context decodes after all, give it its threads back */
+    gst_ffmpeg_avcodec_close (ffmpegdec->context);
+    ffmpegdec->opened = FALSE;
+    ffmpegdec->context->thread_count = thread_count;
+    if (!gst_ffmpegviddec_open (ffmpegdec)) {
+      gst_ffmpeg_thread_placement_restore (placement);
+      goto open_failed;
+    }
+  }
+
+  gst_ffmpeg_thread_placement_restore (placement);
 
   if (ffmpegdec->input_state)
     gst_video_codec_state_unref (ffmpegdec->input_state);
@@ -532,6 +769,15 @@ gst_ffmpegviddec_set_format (GstVideoDecoder * decoder,
     latency = gst_util_uint64_scale_ceil (
         (ffmpegdec->context->has_b_frames) * GST_SECOND, info->fps_d,
         info->fps_n);
+    max_latency = latency;
+
+    /* a picture is normally pushed when the next packet comes in, but one
+     * packet per context can be in flight */
+    if (ffmpegdec->intra_pool) {
+      latency = gst_util_uint64_scale_ceil (GST_SECOND, info->fps_d,
+          info->fps_n);
+      max_latency = latency * ffmpegdec->intra_n_contexts;
+    }
   }
 
   ret = TRUE;
@@ -540,7 +786,7 @@ done:
   GST_OBJECT_UNLOCK (ffmpegdec);
 
   if (GST_CLOCK_TIME_IS_VALID (latency))
-    gst_video_decoder_set_latency (decoder, latency, latency);
+    gst_video_decoder_set_latency (decoder, latency, max_latency);
 
   return ret;
 
@@ -663,6 +909,8 @@ gst_ffmpegviddec_ensure_internal_pool (GstFFMpegVidDec * ffmpegdec,
     AVFrame * picture)
 {
   GstAllocationParams params = DEFAULT_ALLOC_PARAM;
+  GstFFMpegThreadPlacement *placement;
+  GstAllocator *allocator;
   GstVideoInfo info;
   GstVideoFormat format;
   GstCaps *caps;
@@ -692,7 +940,11 @@ gst_ffmpegviddec_ensure_internal_pool (GstFFMpegVidDec * ffmpegdec,
 
   caps = gst_video_info_to_caps (&info);
   gst_buffer_pool_config_set_params (config, caps, info.size, 2, 0);
-  gst_buffer_pool_config_set_allocator (config, NULL, &params);
+  /* NULL selects the default allocator */
+  allocator = gst_ffmpeg_pool_memory_get_allocator (ffmpegdec->pool_memory);
+  gst_buffer_pool_config_set_allocator (config, allocator, &params);
+  if (allocator)
+    gst_object_unref (allocator);
   gst_buffer_pool_config_add_option (config, GST_BUFFER_POOL_OPTION_VIDEO_META);
 
   gst_ffmpegvideodec_prepare_dr_pool (ffmpegdec,
@@ -701,7 +953,11 @@ gst_ffmpegviddec_ensure_internal_pool (GstFFMpegVidDec * ffmpegdec,
   gst_buffer_pool_set_config (ffmpegdec->internal_pool, config);
   gst_caps_unref (caps);
 
+  /* preallocate the frames on the preferred node */
+  placement = gst_ffmpeg_thread_placement_apply (GST_OBJECT (ffmpegdec),
+      NULL, ffmpegdec->numa_node);
   gst_buffer_pool_set_active (ffmpegdec->internal_pool, TRUE);
+  gst_ffmpeg_thread_placement_restore (placement);
 
   /* Remember pool size so we can detect changes */
   ffmpegdec->pool_width = picture->width;
@@ -1265,8 +1521,10 @@ gst_ffmpegviddec_negotiate (GstFFMpegVidDec * ffmpegdec,
   if (!gst_video_decoder_negotiate (GST_VIDEO_DECODER (ffmpegdec)))
     goto negotiate_failed;
 
-  /* The decoder is configured, we now know the true latency */
-  if (fps_n) {
+  /* The decoder is configured, we now know the true latency. Intra-only
+   * streams decoded on the pool keep the latency of the pool depth set in
+   * set_format, the main context never sees their packets */
+  if (fps_n && !ffmpegdec->intra_pool) {
     latency =
         gst_util_uint64_scale_ceil (ffmpegdec->context->has_b_frames *
         GST_SECOND, fps_d, fps_n);
@@ -1444,6 +1702,52 @@ not_negotiated:
   }
 }
 
+/* Extract auxilliary info not stored in the main AVframe */
+static void
+gst_ffmpegviddec_update_multiview (GstFFMpegVidDec * ffmpegdec)
+{
+  GstVideoInfo *in_info = &ffmpegdec->input_state->info;
+
+  /* Take multiview mode from upstream if present */
+  ffmpegdec->picture_multiview_mode = GST_VIDEO_INFO_MULTIVIEW_MODE (in_info);
+  ffmpegdec->picture_multiview_flags = GST_VIDEO_INFO_MULTIVIEW_FLAGS (in_info);
+
+  /* Otherwise, see if there's info in the frame */
+  if (ffmpegdec->picture_multiview_mode == GST_VIDEO_MULTIVIEW_MODE_NONE) {
+    AVFrameSideData *side_data =
+        av_frame_get_side_data (ffmpegdec->picture, AV_FRAME_DATA_STEREO3D);
+    if (side_data) {
+      AVStereo3D *stereo = (AVStereo3D *) side_data->data;
+      ffmpegdec->picture_multiview_mode = stereo_av_to_gst (stereo->type);
+      if (stereo->flags & AV_STEREO3D_FLAG_INVERT) {
+        ffmpegdec->picture_multiview_flags =
+            GST_VIDEO_MULTIVIEW_FLAGS_RIGHT_VIEW_FIRST;
+      } else {
+        ffmpegdec->picture_multiview_flags = GST_VIDEO_MULTIVIEW_FLAGS_NONE;
+      }
+    }
+  }
+}
+
+static void
+gst_ffmpegviddec_set_buffer_flags (GstFFMpegVidDec * ffmpegdec,
+    GstBuffer * buffer)
+{
+  /* Mark corrupted frames as corrupted */
+  if (ffmpegdec->picture->flags & AV_FRAME_FLAG_CORRUPT)
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_CORRUPTED);
+
+  if (ffmpegdec->pic_interlaced) {
+    /* set interlaced flags */
+    if (ffmpegdec->picture->repeat_pict)
+      GST_BUFFER_FLAG_SET (buffer, GST_VIDEO_BUFFER_FLAG_RFF);
+    if (ffmpegdec->picture->top_field_first)
+      GST_BUFFER_FLAG_SET (buffer, GST_VIDEO_BUFFER_FLAG_TFF);
+    if (ffmpegdec->picture->interlaced_frame)
+      GST_BUFFER_FLAG_SET (buffer, GST_VIDEO_BUFFER_FLAG_INTERLACED);
+  }
+}
+
 static void
 gst_avpacket_init (AVPacket * packet, guint8 * data, guint size)
 {
@@ -1536,30 +1840,7 @@ gst_ffmpegviddec_video_frame (GstFFMpegVidDec * ffmpegdec,
   gst_buffer_replace (&out_frame->output_buffer, out_dframe->buffer);
   gst_buffer_replace (&out_dframe->buffer, NULL);
 
-  /* Extract auxilliary info not stored in the main AVframe */
-  {
-    GstVideoInfo *in_info = &ffmpegdec->input_state->info;
-    /* Take multiview mode from upstream if present */
-    ffmpegdec->picture_multiview_mode = GST_VIDEO_INFO_MULTIVIEW_MODE (in_info);
-    ffmpegdec->picture_multiview_flags =
-        GST_VIDEO_INFO_MULTIVIEW_FLAGS (in_info);
-
-    /* Otherwise, see if there's info in the frame */
-    if (ffmpegdec->picture_multiview_mode == GST_VIDEO_MULTIVIEW_MODE_NONE) {
-      AVFrameSideData *side_data =
-          av_frame_get_side_data (ffmpegdec->picture, AV_FRAME_DATA_STEREO3D);
-      if (side_data) {
-        AVStereo3D *stereo = (AVStereo3D *) side_data->data;
-        ffmpegdec->picture_multiview_mode = stereo_av_to_gst (stereo->type);
-        if (stereo->flags & AV_STEREO3D_FLAG_INVERT) {
-          ffmpegdec->picture_multiview_flags =
-              GST_VIDEO_MULTIVIEW_FLAGS_RIGHT_VIEW_FIRST;
-        } else {
-          ffmpegdec->picture_multiview_flags = GST_VIDEO_MULTIVIEW_FLAGS_NONE;
-        }
-      }
-    }
-  }
+  gst_ffmpegviddec_update_multiview (ffmpegdec);
 
   GST_DEBUG_OBJECT (ffmpegdec,
       "pts %" G_GUINT64_FORMAT " duration %" G_GUINT64_FORMAT,
@@ -1607,20 +1888,7 @@ gst_ffmpegviddec_video_frame (GstFFMpegVidDec * ffmpegdec,
   if (G_UNLIKELY (*ret != GST_FLOW_OK))
     goto no_output;
 
-  /* Mark corrupted frames as corrupted */
-  if (ffmpegdec->picture->flags & AV_FRAME_FLAG_CORRUPT)
-    GST_BUFFER_FLAG_SET (out_frame->output_buffer, GST_BUFFER_FLAG_CORRUPTED);
-
-  if (ffmpegdec->pic_interlaced) {
-    /* set interlaced flags */
-    if (ffmpegdec->picture->repeat_pict)
-      GST_BUFFER_FLAG_SET (out_frame->output_buffer, GST_VIDEO_BUFFER_FLAG_RFF);
-    if (ffmpegdec->picture->top_field_first)
-      GST_BUFFER_FLAG_SET (out_frame->output_buffer, GST_VIDEO_BUFFER_FLAG_TFF);
-    if (ffmpegdec->picture->interlaced_frame)
-      GST_BUFFER_FLAG_SET (out_frame->output_buffer,
-          GST_VIDEO_BUFFER_FLAG_INTERLACED);
-  }
+  gst_ffmpegviddec_set_buffer_flags (ffmpegdec, out_frame->output_buffer);
 
   /* cleaning time */
   /* so we decoded this frame, frames preceding it in decoding order
@@ -1745,6 +2013,190 @@ no_codec:
   }
 }
 
+/* with STREAM_LOCK, waits for the oldest job in flight and pushes its
+ * picture downstream */
+static GstFlowReturn
+gst_ffmpegviddec_intra_output (GstFFMpegVidDec * ffmpegdec)
+{
+  GstFFMpegVidDecIntraJob *job;
+  GstVideoCodecFrame *out_frame;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  job = g_queue_pop_head (&ffmpegdec->intra_jobs);
+  gst_ffmpegviddec_intra_wait (ffmpegdec, job);
+
+  out_frame = job->frame;
+  job->frame = NULL;
+
+  /* like the main context, don't complain about pictures we asked to skip */
+  if (job->len < 0 && (job->mode_switch || job->skip_frame))
+    job->len = 0;
+
+  if (job->len >= 0 && job->have_data == 0 && job->skip_frame)
+    goto skipped;
+
+  if (job->len < 0 || job->have_data == 0)
+    goto decode_error;
+
+  av_frame_move_ref (ffmpegdec->picture, job->picture);
+
+  gst_ffmpegviddec_update_multiview (ffmpegdec);
+
+  /* the worker contexts are busy with other packets, take what negotiation
+   * reads from the context from the picture instead */
+  ffmpegdec->context->color_range = ffmpegdec->picture->color_range;
+  ffmpegdec->context->color_primaries = ffmpegdec->picture->color_primaries;
+  ffmpegdec->context->color_trc = ffmpegdec->picture->color_trc;
+  ffmpegdec->context->colorspace = ffmpegdec->picture->colorspace;
+  ffmpegdec->context->chroma_sample_location =
+      ffmpegdec->picture->chroma_location;
+
+  if (!gst_ffmpegviddec_negotiate (ffmpegdec, ffmpegdec->context,
+          ffmpegdec->picture))
+    goto negotiation_error;
+
+  ret = get_output_buffer (ffmpegdec, out_frame);
+  if (G_UNLIKELY (ret != GST_FLOW_OK))
+    goto no_output;
+
+  gst_ffmpegviddec_set_buffer_flags (ffmpegdec, out_frame->output_buffer);
+
+  av_frame_unref (ffmpegdec->picture);
+
+  ret =
+      gst_video_decoder_finish_frame (GST_VIDEO_DECODER (ffmpegdec), out_frame);
+
+done:
+  gst_ffmpegviddec_intra_job_free (job);
+  return ret;
+
+  /* special cases */
+skipped:
+  {
+    GST_DEBUG_OBJECT (ffmpegdec, "picture skipped (skip_frame %d)",
+        job->skip_frame);
+    gst_video_decoder_drop_frame (GST_VIDEO_DECODER (ffmpegdec), out_frame);
+    goto done;
+  }
+decode_error:
+  {
+    GST_WARNING_OBJECT (ffmpegdec, "decoding error (len: %d, have_data: %d)",
+        job->len, job->have_data);
+    gst_video_decoder_release_frame (GST_VIDEO_DECODER (ffmpegdec), out_frame);
+    goto done;
+  }
+no_output:
+  {
+    GST_DEBUG_OBJECT (ffmpegdec, "no output buffer");
+    av_frame_unref (ffmpegdec->picture);
+    gst_video_decoder_drop_frame (GST_VIDEO_DECODER (ffmpegdec), out_frame);
+    goto done;
+  }
+negotiation_error:
+  {
+    av_frame_unref (ffmpegdec->picture);
+    gst_video_decoder_release_frame (GST_VIDEO_DECODER (ffmpegdec), out_frame);
+    if (GST_PAD_IS_FLUSHING (GST_VIDEO_DECODER_SRC_PAD (ffmpegdec))) {
+      ret = GST_FLOW_FLUSHING;
+      goto done;
+    }
+    GST_WARNING_OBJECT (ffmpegdec, "Error negotiating format");
+    ret = GST_FLOW_NOT_NEGOTIATED;
+    goto done;
+  }
+}
+
+static gboolean
+gst_ffmpegviddec_intra_head_done (GstFFMpegVidDec * ffmpegdec)
+{
+  GstFFMpegVidDecIntraJob *job;
+  gboolean done;
+
+  job = g_queue_peek_head (&ffmpegdec->intra_jobs);
+  if (job == NULL)
+    return FALSE;
+
+  g_mutex_lock (&ffmpegdec->intra_lock);
+  done = job->done;
+  g_mutex_unlock (&ffmpegdec->intra_lock);
+
+  return done;
+}
+
+/* Intra-only packets don't depend on each other, so each of them is copied
+ * and handed to the thread pool. Pictures are pushed in decoding order as
+ * soon as they are ready, we only block when all contexts are busy. */
+static GstFlowReturn
+gst_ffmpegviddec_intra_handle_frame (GstFFMpegVidDec * ffmpegdec,
+    GstVideoCodecFrame * frame)
+{
+  GstFFMpegVidDecIntraJob *job;
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstMapInfo minfo;
+
+  while (ret == GST_FLOW_OK &&
+      g_queue_get_length (&ffmpegdec->intra_jobs) >=
+      ffmpegdec->intra_n_contexts)
+    ret = gst_ffmpegviddec_intra_output (ffmpegdec);
+
+  if (ret != GST_FLOW_OK) {
+    gst_video_codec_frame_unref (frame);
+    return ret;
+  }
+
+  if (!gst_buffer_map (frame->input_buffer, &minfo, GST_MAP_READ))
+    goto map_failed;
+
+  job = g_slice_new0 (GstFFMpegVidDecIntraJob);
+  job->frame = frame;
+  job->picture = av_frame_alloc ();
+
+  /* QoS and the skip-frame property apply to the worker context that
+   * picks up the job */
+  gst_ffmpegviddec_do_qos (ffmpegdec, frame, &job->mode_switch);
+  job->skip_frame = ffmpegdec->context->skip_frame;
+
+  /* the packet outlives this call, so it needs its own padded copy */
+  if (av_new_packet (&job->packet, minfo.size) < 0) {
+    gst_buffer_unmap (frame->input_buffer, &minfo);
+    gst_ffmpegviddec_intra_job_free (job);
+    goto alloc_failed;
+  }
+  memcpy (job->packet.data, minfo.data, minfo.size);
+  gst_buffer_unmap (frame->input_buffer, &minfo);
+
+  if (ffmpegdec->palette) {
+    guint8 *pal;
+
+    pal = av_packet_new_side_data (&job->packet, AV_PKT_DATA_PALETTE,
+        AVPALETTE_SIZE);
+    gst_buffer_extract (ffmpegdec->palette, 0, pal, AVPALETTE_SIZE);
+  }
+
+  g_queue_push_tail (&ffmpegdec->intra_jobs, job);
+  g_thread_pool_push (ffmpegdec->intra_pool, job, NULL);
+
+  while (ret == GST_FLOW_OK && gst_ffmpegviddec_intra_head_done (ffmpegdec))
+    ret = gst_ffmpegviddec_intra_output (ffmpegdec);
+
+  return ret;
+
+  /* ERRORS */
+map_failed:
+  {
+    GST_ELEMENT_ERROR (ffmpegdec, STREAM, DECODE, ("Decoding problem"),
+        ("Failed to map buffer for reading"));
+    gst_video_codec_frame_unref (frame);
+    return GST_FLOW_ERROR;
+  }
+alloc_failed:
+  {
+    GST_ELEMENT_ERROR (ffmpegdec, RESOURCE, FAILED,
+        ("Unable to allocate memory"), ("Failed to copy the input packet"));
+    return GST_FLOW_ERROR;
+  }
+}
+
 static GstFlowReturn
 gst_ffmpegviddec_drain (GstVideoDecoder * decoder)
 {
@@ -1754,6 +2206,18 @@ gst_ffmpegviddec_drain (GstVideoDecoder * decoder)
   if (!ffmpegdec->opened)
     return GST_FLOW_OK;
 
+  if (ffmpegdec->intra_pool) {
+    GstFlowReturn ret = GST_FLOW_OK;
+
+    GST_LOG_OBJECT (ffmpegdec, "outputting all pictures in flight");
+
+    while (ret == GST_FLOW_OK && !g_queue_is_empty (&ffmpegdec->intra_jobs))
+      ret = gst_ffmpegviddec_intra_output (ffmpegdec);
+    gst_ffmpegviddec_intra_discard (ffmpegdec);
+
+    return GST_FLOW_OK;
+  }
+
   oclass = (GstFFMpegVidDecClass *) (G_OBJECT_GET_CLASS (ffmpegdec));
 
   if (oclass->in_plugin->capabilities & CODEC_CAP_DELAY) {
@@ -1788,6 +2252,9 @@ gst_ffmpegviddec_handle_frame (GstVideoDecoder * decoder,
       gst_buffer_get_size (frame->input_buffer), GST_TIME_ARGS (frame->dts),
       GST_TIME_ARGS (frame->pts), GST_TIME_ARGS (frame->duration));
 
+  if (ffmpegdec->intra_pool)
+    return gst_ffmpegviddec_intra_handle_frame (ffmpegdec, frame);
+
   if (!gst_buffer_map (frame->input_buffer, &minfo, GST_MAP_READ)) {
     GST_ELEMENT_ERROR (ffmpegdec, STREAM, DECODE, ("Decoding problem"),
         ("Failed to map buffer for reading"));
@@ -1968,6 +2435,7 @@ gst_ffmpegviddec_flush (GstVideoDecoder * decoder)
 
   if (ffmpegdec->opened) {
     GST_LOG_OBJECT (decoder, "flushing buffers");
+    gst_ffmpegviddec_intra_discard (ffmpegdec);
     avcodec_flush_buffers (ffmpegdec->context);
   }
 
@@ -2034,8 +2502,11 @@ gst_ffmpegviddec_decide_allocation (GstVideoDecoder * decoder, GstQuery * query)
   have_alignment =
       gst_buffer_pool_has_option (pool, GST_BUFFER_POOL_OPTION_VIDEO_ALIGNMENT);
 
-  /* If we have videometa, we never have to copy */
+  /* If we have videometa, we never have to copy. Only do this when we were
+   * not asked to render into a specific kind of memory, otherwise keep
+   * pushing from the internal pool below */
   if (have_videometa && have_pool && have_alignment &&
+      ffmpegdec->pool_memory == GST_FFMPEG_POOL_MEMORY_SYSTEM &&
       gst_ffmpegviddec_can_direct_render (ffmpegdec)) {
     GstStructure *config_copy = gst_structure_copy (config);
 
@@ -2168,6 +2639,19 @@ gst_ffmpegviddec_set_property (GObject * object,
     case PROP_OUTPUT_CORRUPT:
       ffmpegdec->output_corrupt = g_value_get_boolean (value);
       break;
+    case PROP_POOL_MEMORY:
+      ffmpegdec->pool_memory = g_value_get_enum (value);
+      break;
+    case PROP_INTRA_CONTEXTS:
+      ffmpegdec->intra_contexts = g_value_get_int (value);
+      break;
+    case PROP_CPU_SET:
+      g_free (ffmpegdec->cpu_set);
+      ffmpegdec->cpu_set = g_value_dup_string (value);
+      break;
+    case PROP_NUMA_NODE:
+      ffmpegdec->numa_node = g_value_get_int (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -2199,6 +2683,18 @@ gst_ffmpegviddec_get_property (GObject * object,
     case PROP_OUTPUT_CORRUPT:
       g_value_set_boolean (value, ffmpegdec->output_corrupt);
       break;
+    case PROP_POOL_MEMORY:
+      g_value_set_enum (value, ffmpegdec->pool_memory);
+      break;
+    case PROP_INTRA_CONTEXTS:
+      g_value_set_int (value, ffmpegdec->intra_contexts);
+      break;
+    case PROP_CPU_SET:
+      g_value_set_string (value, ffmpegdec->cpu_set);
+      break;
+    case PROP_NUMA_NODE:
+      g_value_set_int (value, ffmpegdec->numa_node);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -26,6 +26,8 @@ G_BEGIN_DECLS
 #include <gst/video/gstvideodecoder.h>
 #include <libavcodec/avcodec.h>
 
+#include "gstavallocator.h"
+
 typedef struct _GstFFMpegVidDec GstFFMpegVidDec;
 struct _GstFFMpegVidDec
 {
@@ -70,6 +72,10 @@ struct _GstFFMpegVidDec
   gboolean debug_mv;
   int max_threads;
   gboolean output_corrupt;
+  GstFFMpegPoolMemory pool_memory;
+  gint intra_contexts;
+  gchar *cpu_set;
+  gint numa_node;
 
   GstCaps *last_caps;
 
@@ -79,6 +85,15 @@ struct _GstFFMpegVidDec
   gint pool_height;
   enum AVPixelFormat pool_format;
   GstVideoInfo pool_info;
+
+  /* Parallel decoding of intra-only streams: packets are decoded by a pool
+   * of single threaded contexts and output again in decoding order */
+  GThreadPool *intra_pool;
+  GAsyncQueue *intra_idle;
+  gint intra_n_contexts;
+  GQueue intra_jobs;
+  GMutex intra_lock;
+  GCond intra_cond;
 };
 
 typedef struct _GstFFMpegVidDecClass GstFFMpegVidDecClass;
@@ -27,12 +27,15 @@
 #include <stdio.h>
 #include <glib/gstdio.h>
 #include <errno.h>
+#include <math.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/stereo3d.h>
+#include <libavutil/intreadwrite.h>
 
 #include <gst/gst.h>
 #include <gst/video/gstvideometa.h>
+#include <gst/video/gstvideopool.h>
 
 #include "gstav.h"
 #include "gstavcodecmap.h"
@@ -42,6 +45,18 @@
 
 #define DEFAULT_VIDEO_BITRATE 300000    /* in bps */
 #define DEFAULT_VIDEO_GOP_SIZE 15
+#define DEFAULT_POOL_MEMORY GST_FFMPEG_POOL_MEMORY_SYSTEM
+#define DEFAULT_CPU_SET NULL
+#define DEFAULT_NUMA_NODE -1
+#define DEFAULT_ASYNC_DEPTH 0
+#define MAX_ASYNC_DEPTH 64
+#define DEFAULT_GOP_CONTEXTS 0
+#define MAX_GOP_CONTEXTS 64
+#define DEFAULT_FAST_FIRST_PASS FALSE
+#define DEFAULT_DROP_DUPLICATES FALSE
+#define DEFAULT_POST_MESSAGES FALSE
+
+#define DEFAULT_STRIDE_ALIGN 31
 
 #define DEFAULT_WIDTH 352
 #define DEFAULT_HEIGHT 288
@@ -65,6 +80,16 @@ enum
   PROP_RTP_PAYLOAD_SIZE,
   PROP_MAX_THREADS,
   PROP_COMPLIANCE,
+  PROP_POOL_MEMORY,
+  PROP_CPU_SET,
+  PROP_NUMA_NODE,
+  PROP_ASYNC_DEPTH,
+  PROP_GOP_CONTEXTS,
+  PROP_MULTIPASS_STATS,
+  PROP_FAST_FIRST_PASS,
+  PROP_DROP_DUPLICATES,
+  PROP_POST_MESSAGES,
+  PROP_STATS,
   PROP_CFG_BASE,
 };
 
@@ -104,6 +129,16 @@ static gboolean gst_ffmpegvidenc_propose_allocation (GstVideoEncoder * encoder,
     GstQuery * query);
 static gboolean gst_ffmpegvidenc_flush (GstVideoEncoder * encoder);
 
+static void gst_ffmpegvidenc_async_start (GstFFMpegVidEnc * ffmpegenc);
+static void gst_ffmpegvidenc_async_stop (GstFFMpegVidEnc * ffmpegenc);
+static void gst_ffmpegvidenc_async_wait (GstFFMpegVidEnc * ffmpegenc);
+static gboolean gst_ffmpegvidenc_gop_open (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoInfo * info, GstCaps * allowed_caps);
+static void gst_ffmpegvidenc_gop_close (GstFFMpegVidEnc * ffmpegenc);
+static GstFlowReturn gst_ffmpegvidenc_flush_buffers (GstFFMpegVidEnc *
+    ffmpegenc, gboolean send);
+static void gst_ffmpegvidenc_reset_duplicates (GstFFMpegVidEnc * ffmpegenc);
+
 static GstFlowReturn gst_ffmpegvidenc_handle_frame (GstVideoEncoder * encoder,
     GstVideoCodecFrame * frame);
 
@@ -193,6 +228,9 @@ gst_ffmpegvidenc_class_init (GstFFMpegVidEncClass * klass)
 
   /* FIXME: could use -1 for a sensible per-codec default based on
    * e.g. input resolution and framerate */
+  /* not mutable while playing: the rate control of the mpegvideo encoders
+   * only takes the target bitrate when the codec is opened, and reopening it
+   * would start a new keyframe and caps in the middle of the stream */
   g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_BIT_RATE,
       g_param_spec_int ("bitrate", "Bit Rate",
           "Target Video Bitrate", 0, G_MAXINT, DEFAULT_VIDEO_BITRATE,
@@ -229,9 +267,69 @@ gst_ffmpegvidenc_class_init (GstFFMpegVidEncClass * klass)
           GST_TYPE_FFMPEG_COMPLIANCE, FFMPEG_DEFAULT_COMPLIANCE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_POOL_MEMORY,
+      g_param_spec_enum ("pool-memory", "Pool memory",
+          "Memory backing the buffer pool proposed to upstream",
+          GST_TYPE_FFMPEG_POOL_MEMORY, DEFAULT_POOL_MEMORY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_CPU_SET,
+      g_param_spec_string ("cpu-set", "CPU set",
+          "CPUs to run the libav worker threads on, as a list like \"0-7,16\" "
+          "(NULL = inherit from the streaming thread)", DEFAULT_CPU_SET,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_NUMA_NODE,
+      g_param_spec_int ("numa-node", "NUMA node",
+          "NUMA node to prefer for the libav worker threads and their memory "
+          "(-1 = default policy)", -1, G_MAXINT, DEFAULT_NUMA_NODE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_ASYNC_DEPTH,
+      g_param_spec_int ("async-depth", "Async depth",
+          "Number of frames queued for encoding on a separate thread "
+          "(0 = encode on the streaming thread)", 0, MAX_ASYNC_DEPTH,
+          DEFAULT_ASYNC_DEPTH, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_GOP_CONTEXTS,
+      g_param_spec_int ("gop-contexts", "GOP contexts",
+          "Number of codec contexts encoding whole closed GOPs in parallel, "
+          "for non-live input with a fixed gop-size (0 = disabled)",
+          0, MAX_GOP_CONTEXTS, DEFAULT_GOP_CONTEXTS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (G_OBJECT_CLASS (klass),
+      PROP_MULTIPASS_STATS, g_param_spec_boxed ("multipass-stats",
+          "Multipass stats",
+          "Statistics of the first pass when read, only collected if "
+          "multipass-cache-file is NULL, statistics for the second pass "
+          "instead of the multipass cache file when set",
+          G_TYPE_BYTES, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (G_OBJECT_CLASS (klass),
+      PROP_DROP_DUPLICATES, g_param_spec_boolean ("drop-duplicates",
+          "Drop duplicates",
+          "Drop frames identical to the previous one and extend its duration "
+          "instead of encoding them (not with async-depth or gop-contexts)",
+          DEFAULT_DROP_DUPLICATES, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (G_OBJECT_CLASS (klass),
+      PROP_POST_MESSAGES, g_param_spec_boolean ("post-messages",
+          "Post messages",
+          "Post an avenc-frame-stats element message with the encoder "
+          "statistics of every frame (set the psnr flag to also get the PSNR)",
+          DEFAULT_POST_MESSAGES, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Statistics of the frames encoded since the encoder was started",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
   /* register additional properties, possibly dependent on the exact CODEC */
   gst_ffmpeg_cfg_install_property (klass, PROP_CFG_BASE);
 
+  if (g_object_class_find_property (gobject_class, "pass")) {
+    g_object_class_install_property (G_OBJECT_CLASS (klass),
+        PROP_FAST_FIRST_PASS, g_param_spec_boolean ("fast-first-pass",
+            "Fast first pass",
+            "Use cheaper motion search and macroblock decision in the first "
+            "pass, changes the output of pass=pass1", DEFAULT_FAST_FIRST_PASS,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  }
+
   venc_class->start = gst_ffmpegvidenc_start;
   venc_class->stop = gst_ffmpegvidenc_stop;
   venc_class->finish = gst_ffmpegvidenc_finish;
@@ -257,6 +355,7 @@ gst_ffmpegvidenc_init (GstFFMpegVidEnc * ffmpegenc)
   ffmpegenc->opened = FALSE;
 
   ffmpegenc->file = NULL;
+  ffmpegenc->stats = g_string_new (NULL);
 
   ffmpegenc->bitrate = DEFAULT_VIDEO_BITRATE;
   ffmpegenc->me_method = ME_EPZS;
@@ -265,10 +364,26 @@ gst_ffmpegvidenc_init (GstFFMpegVidEnc * ffmpegenc)
   ffmpegenc->rtp_payload_size = 0;
   ffmpegenc->compliance = FFMPEG_DEFAULT_COMPLIANCE;
   ffmpegenc->max_threads = 0;
+  ffmpegenc->pool_memory = DEFAULT_POOL_MEMORY;
+  ffmpegenc->cpu_set = g_strdup (DEFAULT_CPU_SET);
+  ffmpegenc->numa_node = DEFAULT_NUMA_NODE;
+  ffmpegenc->async_depth = DEFAULT_ASYNC_DEPTH;
+  ffmpegenc->gop_contexts = DEFAULT_GOP_CONTEXTS;
+  ffmpegenc->drop_duplicates = DEFAULT_DROP_DUPLICATES;
+  ffmpegenc->post_messages = DEFAULT_POST_MESSAGES;
+
+  g_queue_init (&ffmpegenc->async_frames);
+  g_queue_init (&ffmpegenc->duplicates);
+  g_mutex_init (&ffmpegenc->async_lock);
+  g_cond_init (&ffmpegenc->async_cond);
+  g_queue_init (&ffmpegenc->gop_jobs);
+  g_mutex_init (&ffmpegenc->gop_lock);
+  g_cond_init (&ffmpegenc->gop_cond);
 
   ffmpegenc->lmin = 2;
   ffmpegenc->lmax = 31;
   ffmpegenc->max_key_interval = 0;
+  ffmpegenc->fast_first_pass = DEFAULT_FAST_FIRST_PASS;
 
   gst_ffmpeg_cfg_set_defaults (ffmpegenc);
 }
@@ -286,87 +401,270 @@ gst_ffmpegvidenc_finalize (GObject * object)
   av_free (ffmpegenc->context);
 
   g_free (ffmpegenc->filename);
+  g_free (ffmpegenc->cpu_set);
+  g_string_free (ffmpegenc->stats, TRUE);
+  if (ffmpegenc->stats_in)
+    g_bytes_unref (ffmpegenc->stats_in);
+
+  g_mutex_clear (&ffmpegenc->async_lock);
+  g_cond_clear (&ffmpegenc->async_cond);
+  g_mutex_clear (&ffmpegenc->gop_lock);
+  g_cond_clear (&ffmpegenc->gop_cond);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
+/* the first pass only needs the size and complexity of every frame, so
+ * search less. Frame types, quantizers and the bitstream tools stay as
+ * they are so the statistics match the second pass */
+static void
+gst_ffmpegvidenc_set_fast_first_pass (AVCodecContext * ctx)
+{
+  if (ctx->me_method != ME_ZERO)
+    ctx->me_method = ME_EPZS;
+  ctx->me_cmp = FF_CMP_SAD;
+  ctx->me_sub_cmp = FF_CMP_SAD;
+  ctx->me_pre_cmp = FF_CMP_SAD;
+  ctx->mb_cmp = FF_CMP_SAD;
+  ctx->mb_decision = FF_MB_DECISION_SIMPLE;
+  ctx->pre_me = 0;
+  ctx->dia_size = 0;
+  ctx->pre_dia_size = 0;
+  ctx->last_predictor_count = 0;
+  ctx->me_subpel_quality = MIN (ctx->me_subpel_quality, 2);
+  ctx->trellis = 0;
+}
+
+/* applies the VBV rates and quantizer bounds changed while encoding to @ctx
+ * between two frames, the rate control reads them from the context for
+ * every frame. The quantizer comes with the frame. With @force even if
+ * nothing changed, for contexts that may have missed earlier changes */
+static void
+gst_ffmpegvidenc_reconfigure (GstFFMpegVidEnc * ffmpegenc,
+    AVCodecContext * ctx, gboolean force)
+{
+  GST_OBJECT_LOCK (ffmpegenc);
+  if (ffmpegenc->reconfigure || force) {
+    GST_DEBUG_OBJECT (ffmpegenc, "max rate %" G_GINT64_FORMAT
+        ", min rate %" G_GINT64_FORMAT ", quantizer %d-%d",
+        (gint64) ffmpegenc->config.rc_max_rate,
+        (gint64) ffmpegenc->config.rc_min_rate, ffmpegenc->config.qmin,
+        ffmpegenc->config.qmax);
+
+    ctx->rc_max_rate = ffmpegenc->config.rc_max_rate;
+    ctx->rc_min_rate = ffmpegenc->config.rc_min_rate;
+    ctx->qmin = ffmpegenc->config.qmin;
+    ctx->qmax = ffmpegenc->config.qmax;
+    if (!force)
+      ffmpegenc->reconfigure = FALSE;
+  }
+  GST_OBJECT_UNLOCK (ffmpegenc);
+}
+
 static gboolean
-gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
-    GstVideoCodecState * state)
+gst_ffmpegvidenc_upstream_is_live (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstQuery *query;
+  gboolean live = FALSE;
+
+  query = gst_query_new_latency ();
+  if (gst_pad_peer_query (GST_VIDEO_ENCODER_SINK_PAD (ffmpegenc), query))
+    gst_query_parse_latency (query, &live, NULL, NULL);
+  gst_query_unref (query);
+
+  return live;
+}
+
+/* frames are held back for reordering, by every frame thread, in the
+ * queue of the encode thread, for every GOP collected or in flight and
+ * until the next frame shows whether it repeats the last one */
+static void
+gst_ffmpegvidenc_update_latency (GstFFMpegVidEnc * ffmpegenc)
+{
+  AVCodecContext *ctx = ffmpegenc->context;
+  GstVideoInfo *info = &ffmpegenc->input_state->info;
+  GstClockTime latency;
+  gint frames;
+
+  /* the codec's own figure if it has one, the reorder depth otherwise */
+  frames = ctx->delay;
+  if (frames <= 0 && (ctx->codec->capabilities & CODEC_CAP_DELAY))
+    frames = ctx->max_b_frames;
+  frames = MAX (frames, 0);
+  if ((ctx->active_thread_type & FF_THREAD_FRAME) && ctx->thread_count > 1)
+    frames += ctx->thread_count - 1;
+  if (ffmpegenc->async_thread)
+    frames += ffmpegenc->async_depth;
+  if (ffmpegenc->gop_pool)
+    frames += ctx->gop_size * (ffmpegenc->gop_n_contexts + 1);
+  else if (ffmpegenc->drop_duplicates && !ffmpegenc->async_thread)
+    frames += 1;
+
+  /* not known for variable framerates, don't keep the one of the previous
+   * caps around */
+  if (info->fps_n > 0 && info->fps_d > 0)
+    latency = gst_util_uint64_scale_ceil (frames,
+        GST_SECOND * info->fps_d, info->fps_n);
+  else
+    latency = 0;
+
+  GST_DEBUG_OBJECT (ffmpegenc, "latency %d frames, %" GST_TIME_FORMAT,
+      frames, GST_TIME_ARGS (latency));
+  gst_video_encoder_set_latency (GST_VIDEO_ENCODER (ffmpegenc), latency,
+      latency);
+}
+
+/* sets up a freshly reset @context for @info and the @allowed_caps of
+ * downstream from the properties, the main context as well as the GOP ones.
+ * Returns FALSE if the framerate gives no usable time base */
+static gboolean
+gst_ffmpegvidenc_configure_context (GstFFMpegVidEnc * ffmpegenc,
+    AVCodecContext * context, GstVideoInfo * info, GstCaps * allowed_caps)
 {
-  GstCaps *other_caps;
-  GstCaps *allowed_caps;
-  GstCaps *icaps;
-  GstVideoCodecState *output_format;
-  enum AVPixelFormat pix_fmt;
-  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
   GstFFMpegVidEncClass *oclass =
       (GstFFMpegVidEncClass *) G_OBJECT_GET_CLASS (ffmpegenc);
 
-  /* close old session */
-  if (ffmpegenc->opened) {
-    gst_ffmpeg_avcodec_close (ffmpegenc->context);
-    ffmpegenc->opened = FALSE;
-    if (avcodec_get_context_defaults3 (ffmpegenc->context,
-            oclass->in_plugin) < 0) {
-      GST_DEBUG_OBJECT (ffmpegenc, "Failed to set context defaults");
-      return FALSE;
-    }
-  }
-
   /* if we set it in _getcaps we should set it also in _link */
-  ffmpegenc->context->strict_std_compliance = ffmpegenc->compliance;
+  context->strict_std_compliance = ffmpegenc->compliance;
 
   /* user defined properties */
-  ffmpegenc->context->bit_rate = ffmpegenc->bitrate;
-  ffmpegenc->context->bit_rate_tolerance = ffmpegenc->bitrate;
-  ffmpegenc->context->gop_size = ffmpegenc->gop_size;
-  ffmpegenc->context->me_method = ffmpegenc->me_method;
+  context->bit_rate = ffmpegenc->bitrate;
+  context->bit_rate_tolerance = ffmpegenc->bitrate;
+  context->gop_size = ffmpegenc->gop_size;
+  context->me_method = ffmpegenc->me_method;
   GST_DEBUG_OBJECT (ffmpegenc, "Setting avcontext to bitrate %d, gop_size %d",
       ffmpegenc->bitrate, ffmpegenc->gop_size);
 
   if (ffmpegenc->max_threads == 0) {
     if (!(oclass->in_plugin->capabilities & CODEC_CAP_AUTO_THREADS))
-      ffmpegenc->context->thread_count = gst_ffmpeg_auto_max_threads ();
+      context->thread_count = gst_ffmpeg_auto_max_threads ();
     else
-      ffmpegenc->context->thread_count = 0;
+      context->thread_count = 0;
   } else
-    ffmpegenc->context->thread_count = ffmpegenc->max_threads;
+    context->thread_count = ffmpegenc->max_threads;
 
   /* RTP payload used for GOB production (for Asterisk) */
   if (ffmpegenc->rtp_payload_size) {
-    ffmpegenc->context->rtp_payload_size = ffmpegenc->rtp_payload_size;
+    context->rtp_payload_size = ffmpegenc->rtp_payload_size;
   }
 
   /* additional avcodec settings */
   /* first fill in the majority by copying over */
-  gst_ffmpeg_cfg_fill_context (ffmpegenc, ffmpegenc->context);
+  gst_ffmpeg_cfg_fill_context (ffmpegenc, context);
 
   /* then handle some special cases */
-  ffmpegenc->context->lmin = (ffmpegenc->lmin * FF_QP2LAMBDA + 0.5);
-  ffmpegenc->context->lmax = (ffmpegenc->lmax * FF_QP2LAMBDA + 0.5);
+  context->lmin = (ffmpegenc->lmin * FF_QP2LAMBDA + 0.5);
+  context->lmax = (ffmpegenc->lmax * FF_QP2LAMBDA + 0.5);
 
   if (ffmpegenc->interlaced) {
-    ffmpegenc->context->flags |=
-        CODEC_FLAG_INTERLACED_DCT | CODEC_FLAG_INTERLACED_ME;
+    context->flags |= CODEC_FLAG_INTERLACED_DCT | CODEC_FLAG_INTERLACED_ME;
   }
 
   /* some other defaults */
-  ffmpegenc->context->rc_strategy = 2;
-  ffmpegenc->context->b_frame_strategy = 0;
-  ffmpegenc->context->coder_type = 0;
-  ffmpegenc->context->context_model = 0;
-  ffmpegenc->context->scenechange_threshold = 0;
+  context->rc_strategy = 2;
+  context->b_frame_strategy = 0;
+  context->coder_type = 0;
+  context->context_model = 0;
+  context->scenechange_threshold = 0;
 
   /* and last but not least the pass; CBR, 2-pass, etc */
-  ffmpegenc->context->flags |= ffmpegenc->pass;
+  context->flags |= ffmpegenc->pass;
+  if (ffmpegenc->pass == CODEC_FLAG_QSCALE)
+    context->global_quality = FF_QP2LAMBDA * ffmpegenc->quantizer;
+  else if (ffmpegenc->pass == CODEC_FLAG_PASS1 && ffmpegenc->fast_first_pass)
+    gst_ffmpegvidenc_set_fast_first_pass (context);
+
+  GST_DEBUG_OBJECT (ffmpegenc, "Extracting common video information");
+  /* fetch pix_fmt, fps, par, width, height... */
+  gst_ffmpeg_videoinfo_to_context (info, context);
+
+  /* sanitize time base */
+  if (context->time_base.num <= 0 || context->time_base.den <= 0)
+    return FALSE;
+
+  if ((oclass->in_plugin->id == AV_CODEC_ID_MPEG4)
+      && (context->time_base.den > 65535)) {
+    /* MPEG4 Standards do not support time_base denominator greater than
+     * (1<<16) - 1 . We therefore scale them down.
+     * Agreed, it will not be the exact framerate... but the difference
+     * shouldn't be that noticeable */
+    context->time_base.num =
+        (gint) gst_util_uint64_scale_int (context->time_base.num,
+        65535, context->time_base.den);
+    context->time_base.den = 65535;
+    GST_LOG_OBJECT (ffmpegenc, "MPEG4 : scaled down framerate to %d / %d",
+        context->time_base.den, context->time_base.num);
+  }
+
+  /* max-key-interval may need the framerate set above */
+  if (ffmpegenc->max_key_interval) {
+    /* override gop-size */
+    context->gop_size = (ffmpegenc->max_key_interval < 0) ?
+        (-ffmpegenc->max_key_interval
+        * (context->time_base.den * context->ticks_per_frame /
+            context->time_base.num))
+        : ffmpegenc->max_key_interval;
+  }
+
+  gst_ffmpeg_caps_with_codecid (oclass->in_plugin->id,
+      oclass->in_plugin->type, allowed_caps, context);
+
+  return TRUE;
+}
+
+static gboolean
+gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
+    GstVideoCodecState * state)
+{
+  GstCaps *other_caps;
+  GstCaps *allowed_caps;
+  GstCaps *icaps;
+  GstVideoCodecState *output_format;
+  enum AVPixelFormat pix_fmt;
+  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
+  GstFFMpegVidEncClass *oclass =
+      (GstFFMpegVidEncClass *) G_OBJECT_GET_CLASS (ffmpegenc);
+  GstFFMpegThreadPlacement *placement;
+  gint res;
+
+  /* finish the frames still in flight with the old settings, closing the
+   * GOP contexts or the codec would drop them */
+  if (ffmpegenc->opened)
+    gst_ffmpegvidenc_flush_buffers (ffmpegenc, TRUE);
+
+  /* close old session */
+  gst_ffmpegvidenc_gop_close (ffmpegenc);
+  if (ffmpegenc->async_thread) {
+    gst_ffmpegvidenc_async_wait (ffmpegenc);
+    gst_ffmpegvidenc_async_stop (ffmpegenc);
+  }
+  if (ffmpegenc->opened) {
+    gst_ffmpeg_avcodec_close (ffmpegenc->context);
+    ffmpegenc->opened = FALSE;
+    if (avcodec_get_context_defaults3 (ffmpegenc->context,
+            oclass->in_plugin) < 0) {
+      GST_DEBUG_OBJECT (ffmpegenc, "Failed to set context defaults");
+      return FALSE;
+    }
+  }
+
+  /* the new session picks up all changes */
+  GST_OBJECT_LOCK (ffmpegenc);
+  ffmpegenc->reconfigure = FALSE;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+  gst_ffmpegvidenc_reset_duplicates (ffmpegenc);
+  ffmpegenc->stats_pending = 0;
+
+  /* the statistics of multi-pass encoding */
   switch (ffmpegenc->pass) {
       /* some additional action depends on type of pass */
     case CODEC_FLAG_QSCALE:
-      ffmpegenc->context->global_quality
-          = ffmpegenc->picture->quality = FF_QP2LAMBDA * ffmpegenc->quantizer;
+      ffmpegenc->picture->quality = FF_QP2LAMBDA * ffmpegenc->quantizer;
       break;
     case CODEC_FLAG_PASS1:     /* need to prepare a stats file */
+      /* without a file the stats are collected in memory */
+      if (!ffmpegenc->filename || !*ffmpegenc->filename)
+        break;
       /* we don't close when changing caps, fingers crossed */
       if (!ffmpegenc->file)
         ffmpegenc->file = g_fopen (ffmpegenc->filename, "w");
@@ -377,7 +675,18 @@ gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
     {                           /* need to read the whole stats file ! */
       gsize size;
 
-      if (!g_file_get_contents (ffmpegenc->filename,
+      /* stats handed in take precedence over the file */
+      GST_OBJECT_LOCK (ffmpegenc);
+      if (ffmpegenc->stats_in) {
+        gconstpointer data = g_bytes_get_data (ffmpegenc->stats_in, &size);
+
+        ffmpegenc->context->stats_in = g_strndup (data, size);
+        GST_OBJECT_UNLOCK (ffmpegenc);
+        break;
+      }
+      GST_OBJECT_UNLOCK (ffmpegenc);
+
+      if (!ffmpegenc->filename || !g_file_get_contents (ffmpegenc->filename,
               &ffmpegenc->context->stats_in, &size, NULL))
         goto file_read_err;
 
@@ -387,43 +696,6 @@ gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
       break;
   }
 
-  GST_DEBUG_OBJECT (ffmpegenc, "Extracting common video information");
-  /* fetch pix_fmt, fps, par, width, height... */
-  gst_ffmpeg_videoinfo_to_context (&state->info, ffmpegenc->context);
-
-  /* sanitize time base */
-  if (ffmpegenc->context->time_base.num <= 0
-      || ffmpegenc->context->time_base.den <= 0)
-    goto insane_timebase;
-
-  if ((oclass->in_plugin->id == AV_CODEC_ID_MPEG4)
-      && (ffmpegenc->context->time_base.den > 65535)) {
-    /* MPEG4 Standards do not support time_base denominator greater than
-     * (1<<16) - 1 . We therefore scale them down.
-     * Agreed, it will not be the exact framerate... but the difference
-     * shouldn't be that noticeable */
-    ffmpegenc->context->time_base.num =
-        (gint) gst_util_uint64_scale_int (ffmpegenc->context->time_base.num,
-        65535, ffmpegenc->context->time_base.den);
-    ffmpegenc->context->time_base.den = 65535;
-    GST_LOG_OBJECT (ffmpegenc, "MPEG4 : scaled down framerate to %d / %d",
-        ffmpegenc->context->time_base.den, ffmpegenc->context->time_base.num);
-  }
-
-  pix_fmt = ffmpegenc->context->pix_fmt;
-
-  /* max-key-interval may need the framerate set above */
-  if (ffmpegenc->max_key_interval) {
-    AVCodecContext *ctx;
-
-    /* override gop-size */
-    ctx = ffmpegenc->context;
-    ctx->gop_size = (ffmpegenc->max_key_interval < 0) ?
-        (-ffmpegenc->max_key_interval
-        * (ctx->time_base.den * ctx->ticks_per_frame / ctx->time_base.num))
-        : ffmpegenc->max_key_interval;
-  }
-
   /* some codecs support more than one format, first auto-choose one */
   GST_DEBUG_OBJECT (ffmpegenc, "picking an output format ...");
   allowed_caps = gst_pad_get_allowed_caps (GST_VIDEO_ENCODER_SRC_PAD (encoder));
@@ -435,11 +707,22 @@ gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
         gst_pad_get_pad_template_caps (GST_VIDEO_ENCODER_SRC_PAD (encoder));
   }
   GST_DEBUG_OBJECT (ffmpegenc, "chose caps %" GST_PTR_FORMAT, allowed_caps);
-  gst_ffmpeg_caps_with_codecid (oclass->in_plugin->id,
-      oclass->in_plugin->type, allowed_caps, ffmpegenc->context);
 
-  /* open codec */
-  if (gst_ffmpeg_avcodec_open (ffmpegenc->context, oclass->in_plugin) < 0) {
+  if (!gst_ffmpegvidenc_configure_context (ffmpegenc, ffmpegenc->context,
+          &state->info, allowed_caps)) {
+    gst_caps_unref (allowed_caps);
+    goto insane_timebase;
+  }
+
+  pix_fmt = ffmpegenc->context->pix_fmt;
+
+  /* open codec, libav spawns its worker threads here and they inherit the
+   * placement */
+  placement = gst_ffmpeg_thread_placement_apply (GST_OBJECT (ffmpegenc),
+      ffmpegenc->cpu_set, ffmpegenc->numa_node);
+  res = gst_ffmpeg_avcodec_open (ffmpegenc->context, oclass->in_plugin);
+  gst_ffmpeg_thread_placement_restore (placement);
+  if (res < 0) {
     gst_caps_unref (allowed_caps);
     goto open_codec_fail;
   }
@@ -471,10 +754,10 @@ gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
   }
 
   icaps = gst_caps_intersect (allowed_caps, other_caps);
-  gst_caps_unref (allowed_caps);
   gst_caps_unref (other_caps);
   if (gst_caps_is_empty (icaps)) {
     gst_caps_unref (icaps);
+    gst_caps_unref (allowed_caps);
     goto unsupported_codec;
   }
   icaps = gst_caps_fixate (icaps);
@@ -489,6 +772,20 @@ gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
   output_format = gst_video_encoder_set_output_state (encoder, icaps, state);
   gst_video_codec_state_unref (output_format);
 
+  /* GOPs are only independent with a fixed keyframe interval and no stats
+   * carried between them, and waiting for whole GOPs only suits offline
+   * encoding. Falls back to a single context if opening fails */
+  if (ffmpegenc->gop_contexts > 0 && ffmpegenc->context->gop_size > 0
+      && !(ffmpegenc->pass & (CODEC_FLAG_PASS1 | CODEC_FLAG_PASS2))
+      && !gst_ffmpegvidenc_upstream_is_live (ffmpegenc))
+    gst_ffmpegvidenc_gop_open (ffmpegenc, &state->info, allowed_caps);
+  gst_caps_unref (allowed_caps);
+
+  if (ffmpegenc->async_depth > 0 && !ffmpegenc->gop_pool)
+    gst_ffmpegvidenc_async_start (ffmpegenc);
+
+  gst_ffmpegvidenc_update_latency (ffmpegenc);
+
   /* Store some tags */
   {
     GstTagList *tags = gst_tag_list_new_empty ();
@@ -506,6 +803,12 @@ gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
     gst_tag_list_unref (tags);
   }
 
+  /* repeats are only finished in order on the streaming thread */
+  if (ffmpegenc->drop_duplicates && (ffmpegenc->gop_pool
+          || ffmpegenc->async_thread))
+    GST_WARNING_OBJECT (ffmpegenc,
+        "drop-duplicates is ignored with async-depth or gop-contexts");
+
   /* success! */
   ffmpegenc->opened = TRUE;
 
@@ -575,12 +878,114 @@ cleanup_stats_in:
 }
 
 
+/* offers upstream frames with the padding and stride alignment the codec
+ * uses for its own frames, so it can encode from them without a copy */
+static void
+gst_ffmpegvidenc_propose_pool (GstFFMpegVidEnc * ffmpegenc, GstQuery * query,
+    GstCaps * caps)
+{
+  GstAllocationParams params;
+  GstVideoAlignment align;
+  GstAllocator *allocator;
+  GstBufferPool *pool;
+  GstStructure *config;
+  GstVideoInfo info;
+  gint width, height;
+  gint linesize_align[AV_NUM_DATA_POINTERS];
+  guint size;
+  gsize max_align;
+  gint i;
+
+  if (!gst_video_info_from_caps (&info, caps))
+    return;
+
+  width = GST_VIDEO_INFO_WIDTH (&info);
+  height = GST_VIDEO_INFO_HEIGHT (&info);
+
+  /* let ffmpeg find the alignment and padding */
+  avcodec_align_dimensions2 (ffmpegenc->context, &width, &height,
+      linesize_align);
+
+  gst_video_alignment_reset (&align);
+  align.padding_right = width - GST_VIDEO_INFO_WIDTH (&info);
+  align.padding_bottom = height - GST_VIDEO_INFO_HEIGHT (&info);
+
+  max_align = DEFAULT_STRIDE_ALIGN;
+  for (i = 0; i < 4; i++) {
+    if (linesize_align[i] > 0)
+      max_align |= linesize_align[i] - 1;
+  }
+
+  for (i = 0; i < GST_VIDEO_MAX_PLANES; i++)
+    align.stride_align[i] = max_align;
+
+  GST_DEBUG_OBJECT (ffmpegenc, "aligned dimension %dx%d -> %dx%d, "
+      "stride_align %" G_GSIZE_FORMAT, GST_VIDEO_INFO_WIDTH (&info),
+      GST_VIDEO_INFO_HEIGHT (&info), width, height, max_align);
+
+  /* for the size of the padded frames */
+  gst_video_info_align (&info, &align);
+
+  pool = gst_video_buffer_pool_new ();
+  config = gst_buffer_pool_get_config (pool);
+  gst_buffer_pool_config_set_params (config, caps, info.size, 0, 0);
+
+  /* NULL selects the default allocator */
+  allocator = gst_ffmpeg_pool_memory_get_allocator (ffmpegenc->pool_memory);
+  gst_allocation_params_init (&params);
+  params.align = max_align;
+  gst_buffer_pool_config_set_allocator (config, allocator, &params);
+
+  gst_buffer_pool_config_add_option (config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+  gst_buffer_pool_config_add_option (config,
+      GST_BUFFER_POOL_OPTION_VIDEO_ALIGNMENT);
+  gst_buffer_pool_config_set_video_alignment (config, &align);
+
+  if (!gst_buffer_pool_set_config (pool, config)) {
+    GST_WARNING_OBJECT (ffmpegenc, "failed to configure aligned pool");
+    goto done;
+  }
+
+  /* the pool may have changed the size */
+  config = gst_buffer_pool_get_config (pool);
+  gst_buffer_pool_config_get_params (config, NULL, &size, NULL, NULL);
+  gst_structure_free (config);
+
+  gst_query_add_allocation_pool (query, pool, size, 0, 0);
+
+done:
+  if (allocator)
+    gst_object_unref (allocator);
+  gst_object_unref (pool);
+}
+
 static gboolean
 gst_ffmpegvidenc_propose_allocation (GstVideoEncoder * encoder,
     GstQuery * query)
 {
+  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
+  GstAllocator *allocator;
+  GstCaps *caps;
+  gboolean need_pool;
+
+  /* the alignment is only known once the codec is set up */
+  gst_query_parse_allocation (query, &caps, &need_pool);
+  if (need_pool && caps && ffmpegenc->opened)
+    gst_ffmpegvidenc_propose_pool (ffmpegenc, query, caps);
+
   gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
 
+  /* the default implementation builds its pool with the first allocator */
+  allocator = gst_ffmpeg_pool_memory_get_allocator (ffmpegenc->pool_memory);
+  if (allocator) {
+    GstAllocationParams params;
+
+    gst_allocation_params_init (&params);
+    params.align = DEFAULT_STRIDE_ALIGN;
+    gst_query_add_allocation_param (query, allocator, &params);
+    gst_object_unref (allocator);
+  }
+
   return GST_VIDEO_ENCODER_CLASS (parent_class)->propose_allocation (encoder,
       query);
 }
@@ -633,79 +1038,984 @@ stereo_gst_to_av (GstVideoMultiviewMode mview_mode)
   return AV_STEREO3D_2D;
 }
 
-static GstFlowReturn
-gst_ffmpegvidenc_handle_frame (GstVideoEncoder * encoder,
-    GstVideoCodecFrame * frame)
+/* save stats info if there is some, to the stats file or in memory when
+ * there is no file */
+static void
+gst_ffmpegvidenc_save_stats (GstFFMpegVidEnc * ffmpegenc)
 {
-  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
-  GstBuffer *outbuf;
-  gint ret = 0, c;
-  GstVideoInfo *info = &ffmpegenc->input_state->info;
-  AVPacket *pkt;
-  int have_data = 0;
-  BufferInfo *buffer_info;
+  const gchar *stats_out = ffmpegenc->context->stats_out;
 
-  if (ffmpegenc->interlaced) {
-    ffmpegenc->picture->interlaced_frame = TRUE;
-    /* if this is not the case, a filter element should be used to swap fields */
-    ffmpegenc->picture->top_field_first =
-        GST_BUFFER_FLAG_IS_SET (frame->input_buffer, GST_VIDEO_BUFFER_FLAG_TFF);
+  if (!stats_out || !(ffmpegenc->pass & CODEC_FLAG_PASS1))
+    return;
+
+  if (ffmpegenc->file) {
+    if (fprintf (ffmpegenc->file, "%s", stats_out) < 0)
+      GST_ELEMENT_ERROR (ffmpegenc, RESOURCE, WRITE,
+          (("Could not write to file \"%s\"."), ffmpegenc->filename),
+          GST_ERROR_SYSTEM);
+    return;
   }
 
-  if (GST_VIDEO_INFO_MULTIVIEW_MODE (info) != GST_VIDEO_MULTIVIEW_MODE_NONE) {
-    AVStereo3D *stereo = av_stereo3d_create_side_data (ffmpegenc->picture);
-    stereo->type = stereo_gst_to_av (GST_VIDEO_INFO_MULTIVIEW_MODE (info));
+  GST_OBJECT_LOCK (ffmpegenc);
+  g_string_append (ffmpegenc->stats, stats_out);
+  GST_OBJECT_UNLOCK (ffmpegenc);
+}
 
-    if (GST_VIDEO_INFO_MULTIVIEW_FLAGS (info) &
-        GST_VIDEO_MULTIVIEW_FLAGS_RIGHT_VIEW_FIRST) {
-      stereo->flags = AV_STEREO3D_FLAG_INVERT;
+/* accounts the packet of @frame, which took @encode_time to produce, in
+ * the totals and posts its statistics if requested, in an element message
+ * with an "avenc-frame-stats" structure with the fields
+ *   "timestamp" (guint64): PTS of the frame
+ *   "duration" (guint64): duration of the frame
+ *   "encode-time" (guint64): wall time spent in libav to produce the packet
+ *   "qp" (gdouble): average quantizer of the picture, -1 if unknown
+ *   "picture-type" (gchararray): "I", "P", "B", ... or "?" if unknown
+ *   "bits" (guint64): size of the packet in bits
+ *   "psnr" (GstValueArray of gdouble): PSNR of every plane in dB, only with
+ *   the psnr flag */
+static void
+gst_ffmpegvidenc_add_frame_stats (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame, AVPacket * pkt, GstClockTime encode_time)
+{
+  GstVideoInfo *info = &ffmpegenc->input_state->info;
+  GstStructure *stats;
+  enum AVPictureType pict_type = AV_PICTURE_TYPE_NONE;
+  gdouble qp = -1, psnr[4], max, err;
+  gchar picture_type[2] = { 0, };
+  guint8 *side_data;
+  gint size = 0;
+  guint i, n_psnr = 0;
+
+  side_data = av_packet_get_side_data (pkt, AV_PKT_DATA_QUALITY_STATS, &size);
+  if (side_data && size >= 6) {
+    qp = (gdouble) AV_RL32 (side_data) / FF_QP2LAMBDA;
+    pict_type = side_data[4];
+
+    /* the errors are only summed up with the psnr flag */
+    if (ffmpegenc->context->flags & CODEC_FLAG_PSNR) {
+      n_psnr = MIN (side_data[5], (size - 8) / 8);
+      n_psnr = MIN (n_psnr, GST_VIDEO_INFO_N_COMPONENTS (info));
+      n_psnr = MIN (n_psnr, G_N_ELEMENTS (psnr));
+    }
+    for (i = 0; i < n_psnr; i++) {
+      max = (1 << GST_VIDEO_INFO_COMP_DEPTH (info, i)) - 1;
+      err = AV_RL64 (side_data + 8 + 8 * i);
+      if (err > 0)
+        psnr[i] = 10 * log10 (max * max * GST_VIDEO_INFO_COMP_WIDTH (info, i)
+            * GST_VIDEO_INFO_COMP_HEIGHT (info, i) / err);
+      else
+        psnr[i] = 100;
     }
+  } else if (pkt->flags & AV_PKT_FLAG_KEY) {
+    pict_type = AV_PICTURE_TYPE_I;
   }
 
-  if (GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame))
-    ffmpegenc->picture->pict_type = AV_PICTURE_TYPE_I;
-
-  buffer_info = g_slice_new0 (BufferInfo);
-  buffer_info->buffer = gst_buffer_ref (frame->input_buffer);
-
-  if (!gst_video_frame_map (&buffer_info->vframe, info, frame->input_buffer,
-          GST_MAP_READ)) {
-    GST_ERROR_OBJECT (encoder, "Failed to map input buffer");
-    gst_buffer_unref (buffer_info->buffer);
-    g_slice_free (BufferInfo, buffer_info);
-    gst_video_codec_frame_unref (frame);
-    return GST_FLOW_ERROR;
+  GST_OBJECT_LOCK (ffmpegenc);
+  ffmpegenc->stats_frames++;
+  ffmpegenc->stats_bytes += pkt->size;
+  ffmpegenc->stats_time += encode_time;
+  if (qp >= 0) {
+    ffmpegenc->stats_qp += qp;
+    ffmpegenc->stats_n_qp++;
+  }
+  if (pict_type == AV_PICTURE_TYPE_I)
+    ffmpegenc->stats_types[0]++;
+  else if (pict_type == AV_PICTURE_TYPE_P)
+    ffmpegenc->stats_types[1]++;
+  else if (pict_type == AV_PICTURE_TYPE_B)
+    ffmpegenc->stats_types[2]++;
+  for (i = 0; i < MIN (n_psnr, G_N_ELEMENTS (ffmpegenc->stats_psnr)); i++) {
+    ffmpegenc->stats_psnr[i] += psnr[i];
+    ffmpegenc->stats_n_psnr[i]++;
   }
+  GST_OBJECT_UNLOCK (ffmpegenc);
 
-  /* Fill avpicture */
-  ffmpegenc->picture->buf[0] =
-      av_buffer_create (NULL, 0, buffer_info_free, buffer_info, 0);
-  for (c = 0; c < AV_NUM_DATA_POINTERS; c++) {
-    if (c < GST_VIDEO_INFO_N_COMPONENTS (info)) {
-      ffmpegenc->picture->data[c] =
-          GST_VIDEO_FRAME_PLANE_DATA (&buffer_info->vframe, c);
-      ffmpegenc->picture->linesize[c] =
-          GST_VIDEO_FRAME_COMP_STRIDE (&buffer_info->vframe, c);
-    } else {
-      ffmpegenc->picture->data[c] = NULL;
-      ffmpegenc->picture->linesize[c] = 0;
+  if (!ffmpegenc->post_messages)
+    return;
+
+  picture_type[0] = pict_type != AV_PICTURE_TYPE_NONE ?
+      av_get_picture_type_char (pict_type) : '?';
+  stats = gst_structure_new ("avenc-frame-stats",
+      "timestamp", G_TYPE_UINT64, frame->pts,
+      "duration", G_TYPE_UINT64, frame->duration,
+      "encode-time", G_TYPE_UINT64, encode_time,
+      "qp", G_TYPE_DOUBLE, qp,
+      "picture-type", G_TYPE_STRING, picture_type,
+      "bits", G_TYPE_UINT64, (guint64) pkt->size * 8, NULL);
+
+  if (n_psnr > 0) {
+    GValue array = G_VALUE_INIT;
+    GValue value = G_VALUE_INIT;
+
+    g_value_init (&array, GST_TYPE_ARRAY);
+    g_value_init (&value, G_TYPE_DOUBLE);
+    for (i = 0; i < n_psnr; i++) {
+      g_value_set_double (&value, psnr[i]);
+      gst_value_array_append_value (&array, &value);
     }
+    gst_structure_take_value (stats, "psnr", &array);
+    g_value_unset (&value);
   }
 
-  ffmpegenc->picture->format = ffmpegenc->context->pix_fmt;
-  ffmpegenc->picture->width = GST_VIDEO_FRAME_WIDTH (&buffer_info->vframe);
-  ffmpegenc->picture->height = GST_VIDEO_FRAME_HEIGHT (&buffer_info->vframe);
+  gst_element_post_message (GST_ELEMENT_CAST (ffmpegenc),
+      gst_message_new_element (GST_OBJECT_CAST (ffmpegenc), stats));
+}
 
-  ffmpegenc->picture->pts =
-      gst_ffmpeg_time_gst_to_ff (frame->pts /
-      ffmpegenc->context->ticks_per_frame, ffmpegenc->context->time_base);
+static GstStructure *
+gst_ffmpegvidenc_get_stats (GstFFMpegVidEnc * ffmpegenc)
+{
+  static const gchar *psnr_fields[] = { "psnr-y", "psnr-u", "psnr-v" };
+  GstStructure *s;
+  guint i;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  s = gst_structure_new ("avenc-stats",
+      "frames", G_TYPE_UINT64, ffmpegenc->stats_frames,
+      "bytes", G_TYPE_UINT64, ffmpegenc->stats_bytes,
+      "encode-time", G_TYPE_UINT64, ffmpegenc->stats_time,
+      "average-qp", G_TYPE_DOUBLE, ffmpegenc->stats_n_qp > 0 ?
+      ffmpegenc->stats_qp / ffmpegenc->stats_n_qp : -1.0,
+      "i-frames", G_TYPE_UINT64, ffmpegenc->stats_types[0],
+      "p-frames", G_TYPE_UINT64, ffmpegenc->stats_types[1],
+      "b-frames", G_TYPE_UINT64, ffmpegenc->stats_types[2], NULL);
+  /* only the planes the format has */
+  for (i = 0; i < G_N_ELEMENTS (psnr_fields); i++) {
+    if (ffmpegenc->stats_n_psnr[i] > 0)
+      gst_structure_set (s, psnr_fields[i], G_TYPE_DOUBLE,
+          ffmpegenc->stats_psnr[i] / ffmpegenc->stats_n_psnr[i], NULL);
+  }
+  GST_OBJECT_UNLOCK (ffmpegenc);
 
-  have_data = 0;
-  pkt = g_slice_new0 (AVPacket);
+  return s;
+}
 
+static void
+gst_ffmpegvidenc_reset_stats (GstFFMpegVidEnc * ffmpegenc)
+{
+  GST_OBJECT_LOCK (ffmpegenc);
+  ffmpegenc->stats_frames = 0;
+  ffmpegenc->stats_bytes = 0;
+  ffmpegenc->stats_time = 0;
+  ffmpegenc->stats_qp = 0;
+  ffmpegenc->stats_n_qp = 0;
+  memset (ffmpegenc->stats_types, 0, sizeof (ffmpegenc->stats_types));
+  memset (ffmpegenc->stats_psnr, 0, sizeof (ffmpegenc->stats_psnr));
+  memset (ffmpegenc->stats_n_psnr, 0, sizeof (ffmpegenc->stats_n_psnr));
+  GST_OBJECT_UNLOCK (ffmpegenc);
+}
+
+/* feeds @picture, or NULL to drain, to the codec and pushes the packets
+ * that become available. @picture carries a ref to its codec frame in
+ * opaque */
+static GstFlowReturn
+gst_ffmpegvidenc_send_frame (GstFFMpegVidEnc * ffmpegenc, AVFrame * picture,
+    gboolean send)
+{
+  GstVideoEncoder *encoder = GST_VIDEO_ENCODER (ffmpegenc);
+  GstVideoCodecFrame *frame;
+  GstFlowReturn flow_ret = GST_FLOW_OK;
+  GstClockTime start;
+  AVPacket *pkt;
+  gint ret;
+
+  if (picture)
+    gst_ffmpegvidenc_reconfigure (ffmpegenc, ffmpegenc->context, FALSE);
+
+  start = gst_util_get_timestamp ();
+  ret = avcodec_send_frame (ffmpegenc->context, picture);
+  ffmpegenc->stats_pending += gst_util_get_timestamp () - start;
+  if (ret < 0)
+    goto encode_fail;
+
+  while (TRUE) {
+    pkt = g_slice_new0 (AVPacket);
+    start = gst_util_get_timestamp ();
+    ret = avcodec_receive_packet (ffmpegenc->context, pkt);
+    ffmpegenc->stats_pending += gst_util_get_timestamp () - start;
+    if (ret < 0) {
+      g_slice_free (AVPacket, pkt);
+      break;
+    }
+
+    gst_ffmpegvidenc_save_stats (ffmpegenc);
+
+    GST_VIDEO_ENCODER_STREAM_LOCK (encoder);
+    frame = gst_video_encoder_get_oldest_frame (encoder);
+    if (!frame) {
+      GST_VIDEO_ENCODER_STREAM_UNLOCK (encoder);
+      gst_ffmpegvidenc_free_avpacket (pkt);
+      ffmpegenc->stats_pending = 0;
+      continue;
+    }
+
+    if (send) {
+      frame->output_buffer =
+          gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, pkt->data,
+          pkt->size, 0, pkt->size, pkt, gst_ffmpegvidenc_free_avpacket);
+      gst_ffmpegvidenc_add_frame_stats (ffmpegenc, frame, pkt,
+          ffmpegenc->stats_pending);
+
+      if (pkt->flags & AV_PKT_FLAG_KEY)
+        GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (frame);
+      else
+        GST_VIDEO_CODEC_FRAME_UNSET_SYNC_POINT (frame);
+    } else {
+      gst_ffmpegvidenc_free_avpacket (pkt);
+    }
+    ffmpegenc->stats_pending = 0;
+
+    flow_ret = gst_video_encoder_finish_frame (encoder, frame);
+    GST_VIDEO_ENCODER_STREAM_UNLOCK (encoder);
+  }
+
+  if (ret != AVERROR (EAGAIN) && ret != AVERROR_EOF)
+    goto encode_fail;
+
+  if (picture)
+    gst_video_codec_frame_unref (picture->opaque);
+
+  return flow_ret;
+
+  /* ERRORS */
+encode_fail:
+  {
+#ifndef GST_DISABLE_GST_DEBUG
+    GstFFMpegVidEncClass *oclass =
+        (GstFFMpegVidEncClass *) (G_OBJECT_GET_CLASS (ffmpegenc));
+    GST_ERROR_OBJECT (ffmpegenc,
+        "avenc_%s: failed to encode buffer", oclass->in_plugin->name);
+#endif /* GST_DISABLE_GST_DEBUG */
+    if (picture) {
+      /* avoid frame (and ts etc) piling up */
+      GST_VIDEO_ENCODER_STREAM_LOCK (encoder);
+      flow_ret = gst_video_encoder_finish_frame (encoder, picture->opaque);
+      GST_VIDEO_ENCODER_STREAM_UNLOCK (encoder);
+    }
+    return flow_ret;
+  }
+}
+
+static void
+gst_ffmpegvidenc_async_frame_free (AVFrame * picture)
+{
+  gst_video_codec_frame_unref (picture->opaque);
+  av_frame_free (&picture);
+}
+
+static gpointer
+gst_ffmpegvidenc_async_loop (GstFFMpegVidEnc * ffmpegenc)
+{
+  AVFrame *picture;
+  GstFlowReturn ret;
+
+  g_mutex_lock (&ffmpegenc->async_lock);
+  while (TRUE) {
+    while (!ffmpegenc->async_quit
+        && g_queue_is_empty (&ffmpegenc->async_frames))
+      g_cond_wait (&ffmpegenc->async_cond, &ffmpegenc->async_lock);
+    if (ffmpegenc->async_quit)
+      break;
+
+    picture = g_queue_pop_head (&ffmpegenc->async_frames);
+    ffmpegenc->async_busy = TRUE;
+    g_cond_broadcast (&ffmpegenc->async_cond);
+    g_mutex_unlock (&ffmpegenc->async_lock);
+
+    ret = gst_ffmpegvidenc_send_frame (ffmpegenc, picture, TRUE);
+    av_frame_free (&picture);
+
+    g_mutex_lock (&ffmpegenc->async_lock);
+    ffmpegenc->async_busy = FALSE;
+    ffmpegenc->async_flow = ret;
+    g_cond_broadcast (&ffmpegenc->async_cond);
+  }
+  g_mutex_unlock (&ffmpegenc->async_lock);
+
+  return NULL;
+}
+
+static void
+gst_ffmpegvidenc_async_start (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstFFMpegThreadPlacement *placement;
+
+  ffmpegenc->async_quit = FALSE;
+  ffmpegenc->async_busy = FALSE;
+  ffmpegenc->async_flow = GST_FLOW_OK;
+
+  placement = gst_ffmpeg_thread_placement_apply (GST_OBJECT (ffmpegenc),
+      ffmpegenc->cpu_set, ffmpegenc->numa_node);
+  ffmpegenc->async_thread = g_thread_new ("avenc-encode",
+      (GThreadFunc) gst_ffmpegvidenc_async_loop, ffmpegenc);
+  gst_ffmpeg_thread_placement_restore (placement);
+
+  GST_DEBUG_OBJECT (ffmpegenc, "encoding on a separate thread, %d frames "
+      "queued at most", ffmpegenc->async_depth);
+}
+
+static void
+gst_ffmpegvidenc_async_discard (GstFFMpegVidEnc * ffmpegenc)
+{
+  AVFrame *picture;
+
+  g_mutex_lock (&ffmpegenc->async_lock);
+  while ((picture = g_queue_pop_head (&ffmpegenc->async_frames)))
+    gst_ffmpegvidenc_async_frame_free (picture);
+  g_mutex_unlock (&ffmpegenc->async_lock);
+}
+
+static void
+gst_ffmpegvidenc_async_stop (GstFFMpegVidEnc * ffmpegenc)
+{
+  gst_ffmpegvidenc_async_discard (ffmpegenc);
+
+  g_mutex_lock (&ffmpegenc->async_lock);
+  ffmpegenc->async_quit = TRUE;
+  g_cond_broadcast (&ffmpegenc->async_cond);
+  g_mutex_unlock (&ffmpegenc->async_lock);
+
+  g_thread_join (ffmpegenc->async_thread);
+  ffmpegenc->async_thread = NULL;
+}
+
+/* with STREAM_LOCK, which is released meanwhile as the encode thread needs
+ * it to push its packets */
+static void
+gst_ffmpegvidenc_async_wait (GstFFMpegVidEnc * ffmpegenc)
+{
+  GST_VIDEO_ENCODER_STREAM_UNLOCK (ffmpegenc);
+  g_mutex_lock (&ffmpegenc->async_lock);
+  while (ffmpegenc->async_busy || !g_queue_is_empty (&ffmpegenc->async_frames))
+    g_cond_wait (&ffmpegenc->async_cond, &ffmpegenc->async_lock);
+  g_mutex_unlock (&ffmpegenc->async_lock);
+  GST_VIDEO_ENCODER_STREAM_LOCK (ffmpegenc);
+}
+
+/* with STREAM_LOCK, hands the prepared picture to the encode thread once
+ * there is room in the queue */
+static GstFlowReturn
+gst_ffmpegvidenc_async_push (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  AVFrame *picture;
+  GstFlowReturn ret;
+
+  picture = av_frame_alloc ();
+  av_frame_move_ref (picture, ffmpegenc->picture);
+  picture->opaque = frame;
+
+  GST_VIDEO_ENCODER_STREAM_UNLOCK (ffmpegenc);
+  g_mutex_lock (&ffmpegenc->async_lock);
+  while (g_queue_get_length (&ffmpegenc->async_frames) >=
+      ffmpegenc->async_depth)
+    g_cond_wait (&ffmpegenc->async_cond, &ffmpegenc->async_lock);
+  g_mutex_unlock (&ffmpegenc->async_lock);
+  GST_VIDEO_ENCODER_STREAM_LOCK (ffmpegenc);
+
+  /* frames keep going to the codec after an error so they don't pile up,
+   * upstream learns about it from the last return of the encode thread */
+  g_mutex_lock (&ffmpegenc->async_lock);
+  g_queue_push_tail (&ffmpegenc->async_frames, picture);
+  g_cond_broadcast (&ffmpegenc->async_cond);
+  ret = ffmpegenc->async_flow;
+  g_mutex_unlock (&ffmpegenc->async_lock);
+
+  return ret;
+}
+
+typedef struct
+{
+  GPtrArray *pictures;
+  GQueue packets;
+  /* encode time of every packet and since the last one */
+  GArray *times;
+  GstClockTime pending;
+  gboolean done;
+} GstFFMpegVidEncGopJob;
+
+static void
+gst_ffmpegvidenc_gop_picture_free (AVFrame * picture)
+{
+  av_frame_free (&picture);
+}
+
+static void
+gst_ffmpegvidenc_gop_job_free (GstFFMpegVidEncGopJob * job)
+{
+  g_ptr_array_unref (job->pictures);
+  g_array_unref (job->times);
+  g_queue_foreach (&job->packets, (GFunc) gst_ffmpegvidenc_free_avpacket,
+      NULL);
+  g_queue_clear (&job->packets);
+  g_slice_free (GstFFMpegVidEncGopJob, job);
+}
+
+static void
+gst_ffmpegvidenc_gop_encode_picture (GstFFMpegVidEnc * ffmpegenc,
+    AVCodecContext * context, AVFrame * picture, GstFFMpegVidEncGopJob * job)
+{
+  GstClockTime start;
+  AVPacket *pkt;
+  int have_data = 0;
+  gint ret;
+
+  pkt = g_slice_new0 (AVPacket);
+  start = gst_util_get_timestamp ();
+  ret = avcodec_encode_video2 (context, pkt, picture, &have_data);
+  job->pending += gst_util_get_timestamp () - start;
+  if (ret < 0)
+    GST_WARNING_OBJECT (ffmpegenc, "failed to encode GOP picture");
+
+  if (ret < 0 || !have_data) {
+    g_slice_free (AVPacket, pkt);
+  } else {
+    g_queue_push_tail (&job->packets, pkt);
+    g_array_append_val (job->times, job->pending);
+    job->pending = 0;
+  }
+}
+
+/* encodes one GOP and drains the context so it starts clean on the next */
+static void
+gst_ffmpegvidenc_gop_encode (GstFFMpegVidEncGopJob * job,
+    GstFFMpegVidEnc * ffmpegenc)
+{
+  AVCodecContext *context;
+  guint i, n_packets;
+
+  context = g_async_queue_pop (ffmpegenc->gop_idle);
+  gst_ffmpegvidenc_reconfigure (ffmpegenc, context, TRUE);
+
+  for (i = 0; i < job->pictures->len; i++)
+    gst_ffmpegvidenc_gop_encode_picture (ffmpegenc, context,
+        g_ptr_array_index (job->pictures, i), job);
+
+  do {
+    n_packets = job->packets.length;
+    gst_ffmpegvidenc_gop_encode_picture (ffmpegenc, context, NULL, job);
+  } while (job->packets.length > n_packets);
+
+  g_async_queue_push (ffmpegenc->gop_idle, context);
+
+  g_mutex_lock (&ffmpegenc->gop_lock);
+  job->done = TRUE;
+  g_cond_broadcast (&ffmpegenc->gop_cond);
+  g_mutex_unlock (&ffmpegenc->gop_lock);
+}
+
+static void
+gst_ffmpegvidenc_gop_wait (GstFFMpegVidEnc * ffmpegenc,
+    GstFFMpegVidEncGopJob * job)
+{
+  g_mutex_lock (&ffmpegenc->gop_lock);
+  while (!job->done)
+    g_cond_wait (&ffmpegenc->gop_cond, &ffmpegenc->gop_lock);
+  g_mutex_unlock (&ffmpegenc->gop_lock);
+}
+
+static void
+gst_ffmpegvidenc_gop_discard (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstFFMpegVidEncGopJob *job;
+
+  if (ffmpegenc->gop_chunk)
+    g_ptr_array_set_size (ffmpegenc->gop_chunk, 0);
+
+  while ((job = g_queue_pop_head (&ffmpegenc->gop_jobs))) {
+    gst_ffmpegvidenc_gop_wait (ffmpegenc, job);
+    gst_ffmpegvidenc_gop_job_free (job);
+  }
+}
+
+static void
+gst_ffmpegvidenc_gop_close (GstFFMpegVidEnc * ffmpegenc)
+{
+  AVCodecContext *context;
+
+  gst_ffmpegvidenc_gop_discard (ffmpegenc);
+
+  if (ffmpegenc->gop_pool) {
+    g_thread_pool_free (ffmpegenc->gop_pool, FALSE, TRUE);
+    ffmpegenc->gop_pool = NULL;
+  }
+
+  if (ffmpegenc->gop_idle) {
+    while ((context = g_async_queue_try_pop (ffmpegenc->gop_idle))) {
+      gst_ffmpeg_avcodec_close (context);
+      avcodec_free_context (&context);
+    }
+    g_async_queue_unref (ffmpegenc->gop_idle);
+    ffmpegenc->gop_idle = NULL;
+  }
+  ffmpegenc->gop_n_contexts = 0;
+
+  if (ffmpegenc->gop_chunk) {
+    g_ptr_array_unref (ffmpegenc->gop_chunk);
+    ffmpegenc->gop_chunk = NULL;
+  }
+}
+
+/* the main context must be open already */
+static gboolean
+gst_ffmpegvidenc_gop_open (GstFFMpegVidEnc * ffmpegenc, GstVideoInfo * info,
+    GstCaps * allowed_caps)
+{
+  GstFFMpegVidEncClass *oclass;
+  GstFFMpegThreadPlacement *placement;
+  AVCodecContext *context;
+  gint i;
+
+  oclass = (GstFFMpegVidEncClass *) (G_OBJECT_GET_CLASS (ffmpegenc));
+
+  ffmpegenc->gop_idle = g_async_queue_new ();
+
+  placement = gst_ffmpeg_thread_placement_apply (GST_OBJECT (ffmpegenc),
+      ffmpegenc->cpu_set, ffmpegenc->numa_node);
+
+  for (i = 0; i < ffmpegenc->gop_contexts; i++) {
+    context = avcodec_alloc_context3 (oclass->in_plugin);
+    if (context == NULL || !gst_ffmpegvidenc_configure_context (ffmpegenc,
+            context, info, allowed_caps))
+      goto could_not_open;
+
+    /* the GOPs already keep all cores busy */
+    context->thread_count = 1;
+    context->flags |= CODEC_FLAG_CLOSED_GOP;
+
+    if (gst_ffmpeg_avcodec_open (context, oclass->in_plugin) < 0)
+      goto could_not_open;
+
+    g_async_queue_push (ffmpegenc->gop_idle, context);
+    ffmpegenc->gop_n_contexts++;
+  }
+
+  ffmpegenc->gop_pool =
+      g_thread_pool_new ((GFunc) gst_ffmpegvidenc_gop_encode, ffmpegenc,
+      ffmpegenc->gop_n_contexts, TRUE, NULL);
+  gst_ffmpeg_thread_placement_restore (placement);
+
+  ffmpegenc->gop_chunk = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gst_ffmpegvidenc_gop_picture_free);
+
+  GST_DEBUG_OBJECT (ffmpegenc, "encoding GOPs of %d frames on %d contexts",
+      ffmpegenc->context->gop_size, ffmpegenc->gop_n_contexts);
+
+  return TRUE;
+
+  /* ERRORS */
+could_not_open:
+  {
+    GST_WARNING_OBJECT (ffmpegenc, "Failed to open GOP context %d", i);
+    gst_ffmpeg_thread_placement_restore (placement);
+    avcodec_free_context (&context);
+    gst_ffmpegvidenc_gop_close (ffmpegenc);
+    return FALSE;
+  }
+}
+
+/* with STREAM_LOCK, waits for the oldest GOP and finishes its frames in
+ * order, those without a packet are dropped */
+static GstFlowReturn
+gst_ffmpegvidenc_gop_output (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstVideoEncoder *encoder = GST_VIDEO_ENCODER (ffmpegenc);
+  GstFFMpegVidEncGopJob *job;
+  GstVideoCodecFrame *frame;
+  GstFlowReturn ret = GST_FLOW_OK, res;
+  AVPacket *pkt;
+  guint i, n = 0;
+
+  job = g_queue_pop_head (&ffmpegenc->gop_jobs);
+  gst_ffmpegvidenc_gop_wait (ffmpegenc, job);
+
+  for (i = 0; i < job->pictures->len; i++) {
+    frame = gst_video_encoder_get_oldest_frame (encoder);
+    if (!frame)
+      break;
+
+    if ((pkt = g_queue_pop_head (&job->packets))) {
+      frame->output_buffer =
+          gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, pkt->data,
+          pkt->size, 0, pkt->size, pkt, gst_ffmpegvidenc_free_avpacket);
+      gst_ffmpegvidenc_add_frame_stats (ffmpegenc, frame, pkt,
+          g_array_index (job->times, GstClockTime, n++));
+
+      if (pkt->flags & AV_PKT_FLAG_KEY)
+        GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (frame);
+      else
+        GST_VIDEO_CODEC_FRAME_UNSET_SYNC_POINT (frame);
+    }
+
+    /* keep finishing the GOP so no frames pile up */
+    res = gst_video_encoder_finish_frame (encoder, frame);
+    if (ret == GST_FLOW_OK)
+      ret = res;
+  }
+
+  gst_ffmpegvidenc_gop_job_free (job);
+
+  return ret;
+}
+
+static gboolean
+gst_ffmpegvidenc_gop_head_done (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstFFMpegVidEncGopJob *job;
+  gboolean done;
+
+  job = g_queue_peek_head (&ffmpegenc->gop_jobs);
+  if (!job)
+    return FALSE;
+
+  g_mutex_lock (&ffmpegenc->gop_lock);
+  done = job->done;
+  g_mutex_unlock (&ffmpegenc->gop_lock);
+
+  return done;
+}
+
+/* with STREAM_LOCK, hands the collected GOP to a context and pushes the
+ * GOPs that are done, waiting for the oldest when all contexts are busy */
+static GstFlowReturn
+gst_ffmpegvidenc_gop_submit (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstFFMpegVidEncGopJob *job;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  job = g_slice_new0 (GstFFMpegVidEncGopJob);
+  job->pictures = ffmpegenc->gop_chunk;
+  g_queue_init (&job->packets);
+  job->times = g_array_new (FALSE, FALSE, sizeof (GstClockTime));
+  ffmpegenc->gop_chunk = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gst_ffmpegvidenc_gop_picture_free);
+
+  g_queue_push_tail (&ffmpegenc->gop_jobs, job);
+  g_thread_pool_push (ffmpegenc->gop_pool, job, NULL);
+
+  while (ret == GST_FLOW_OK && (gst_ffmpegvidenc_gop_head_done (ffmpegenc)
+          || g_queue_get_length (&ffmpegenc->gop_jobs) >
+          ffmpegenc->gop_n_contexts))
+    ret = gst_ffmpegvidenc_gop_output (ffmpegenc);
+
+  return ret;
+}
+
+/* with STREAM_LOCK, adds the prepared picture to the GOP being collected */
+static GstFlowReturn
+gst_ffmpegvidenc_gop_push (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  AVFrame *picture;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  /* GOPs are held for a while, so don't keep the upstream buffers */
+  picture = av_frame_alloc ();
+  picture->format = ffmpegenc->picture->format;
+  picture->width = ffmpegenc->picture->width;
+  picture->height = ffmpegenc->picture->height;
+  if (av_frame_get_buffer (picture, 0) < 0
+      || av_frame_copy (picture, ffmpegenc->picture) < 0
+      || av_frame_copy_props (picture, ffmpegenc->picture) < 0)
+    goto copy_fail;
+  av_frame_unref (ffmpegenc->picture);
+
+  /* a forced keyframe starts a new GOP */
+  if (picture->pict_type == AV_PICTURE_TYPE_I
+      && ffmpegenc->gop_chunk->len > 0)
+    ret = gst_ffmpegvidenc_gop_submit (ffmpegenc);
+
+  if (ffmpegenc->gop_chunk->len == 0)
+    picture->pict_type = AV_PICTURE_TYPE_I;
+  g_ptr_array_add (ffmpegenc->gop_chunk, picture);
+
+  if (ret == GST_FLOW_OK
+      && ffmpegenc->gop_chunk->len >= ffmpegenc->context->gop_size)
+    ret = gst_ffmpegvidenc_gop_submit (ffmpegenc);
+
+  gst_video_codec_frame_unref (frame);
+
+  return ret;
+
+  /* ERRORS */
+copy_fail:
+  {
+    GST_ERROR_OBJECT (ffmpegenc, "failed to copy picture");
+    av_frame_free (&picture);
+    av_frame_unref (ffmpegenc->picture);
+    /* avoid frame (and ts etc) piling up */
+    return gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (ffmpegenc),
+        frame);
+  }
+}
+
+/* mixes in 8 bytes at a time, only equal frames need to hash the same */
+static guint64
+gst_ffmpegvidenc_hash_line (guint64 hash, const guint8 * data, gint len)
+{
+  const guint64 k = G_GUINT64_CONSTANT (0x9e3779b97f4a7c15);
+  guint64 word;
+  gint i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy (&word, data + i, 8);
+    hash = (hash ^ word) * k;
+    hash ^= hash >> 32;
+  }
+  for (; i < len; i++)
+    hash = (hash ^ data[i]) * k;
+
+  return hash;
+}
+
+/* hashes the visible pixels of all planes, leaving out the padding */
+static guint64
+gst_ffmpegvidenc_frame_hash (GstVideoFrame * vframe)
+{
+  const GstVideoFormatInfo *finfo = vframe->info.finfo;
+  gint plane_bytes[GST_VIDEO_MAX_PLANES] = { 0, };
+  gint plane_height[GST_VIDEO_MAX_PLANES] = { 0, };
+  guint64 hash = 0;
+  const guint8 *line;
+  gint c, p, y, bytes, stride;
+
+  for (c = 0; c < GST_VIDEO_FRAME_N_COMPONENTS (vframe); c++) {
+    p = GST_VIDEO_FORMAT_INFO_PLANE (finfo, c);
+    if (GST_VIDEO_FORMAT_INFO_PSTRIDE (finfo, c) > 0) {
+      /* up to the last byte of the last pixel of this component */
+      bytes = GST_VIDEO_FORMAT_INFO_POFFSET (finfo, c) +
+          (GST_VIDEO_FRAME_COMP_WIDTH (vframe, c) - 1) *
+          GST_VIDEO_FORMAT_INFO_PSTRIDE (finfo, c) +
+          (GST_VIDEO_FORMAT_INFO_DEPTH (finfo, c) +
+          GST_VIDEO_FORMAT_INFO_SHIFT (finfo, c) + 7) / 8;
+    } else {
+      /* packed in a way that only the whole line describes */
+      bytes = GST_VIDEO_FRAME_PLANE_STRIDE (vframe, p);
+    }
+    plane_bytes[p] = MAX (plane_bytes[p], bytes);
+    plane_height[p] = GST_VIDEO_FRAME_COMP_HEIGHT (vframe, c);
+  }
+
+  for (p = 0; p < GST_VIDEO_FRAME_N_PLANES (vframe); p++) {
+    line = GST_VIDEO_FRAME_PLANE_DATA (vframe, p);
+    stride = GST_VIDEO_FRAME_PLANE_STRIDE (vframe, p);
+    bytes = MIN (plane_bytes[p], ABS (stride));
+
+    for (y = 0; y < plane_height[p]; y++, line += stride)
+      hash = gst_ffmpegvidenc_hash_line (hash, line, bytes);
+  }
+
+  return hash;
+}
+
+/* a frame that repeats the previous one is not encoded */
+static gboolean
+gst_ffmpegvidenc_is_duplicate (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame, GstVideoFrame * vframe)
+{
+  guint64 hash;
+  gboolean duplicate;
+
+  hash = gst_ffmpegvidenc_frame_hash (vframe);
+  duplicate = ffmpegenc->have_last_hash && hash == ffmpegenc->last_hash;
+
+  ffmpegenc->last_hash = hash;
+  ffmpegenc->have_last_hash = TRUE;
+
+  /* requested keyframes are always encoded */
+  return duplicate && !GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame);
+}
+
+/* finishes the repeats that are the oldest frames now that the frame they
+ * repeat is out, without output */
+static GstFlowReturn
+gst_ffmpegvidenc_finish_duplicates (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstVideoEncoder *encoder = GST_VIDEO_ENCODER (ffmpegenc);
+  GstVideoCodecFrame *oldest;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  while (ret == GST_FLOW_OK && !g_queue_is_empty (&ffmpegenc->duplicates)) {
+    oldest = gst_video_encoder_get_oldest_frame (encoder);
+    if (oldest)
+      gst_video_codec_frame_unref (oldest);
+    if (oldest != g_queue_peek_head (&ffmpegenc->duplicates))
+      break;
+
+    ret = gst_video_encoder_finish_frame (encoder,
+        g_queue_pop_head (&ffmpegenc->duplicates));
+  }
+
+  return ret;
+}
+
+/* finishes @frame and the repeats after it */
+static GstFlowReturn
+gst_ffmpegvidenc_finish_frame (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  GstFlowReturn ret;
+
+  ret = gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (ffmpegenc), frame);
+  if (ret == GST_FLOW_OK)
+    ret = gst_ffmpegvidenc_finish_duplicates (ffmpegenc);
+
+  return ret;
+}
+
+/* pushes the output held back in case the next frame repeats it */
+static GstFlowReturn
+gst_ffmpegvidenc_release_held (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstVideoCodecFrame *frame = ffmpegenc->held_frame;
+
+  if (!frame)
+    return GST_FLOW_OK;
+
+  ffmpegenc->held_frame = NULL;
+  return gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
+}
+
+/* forgets the repeats, the base class still has the frames */
+static void
+gst_ffmpegvidenc_reset_duplicates (GstFFMpegVidEnc * ffmpegenc)
+{
+  if (ffmpegenc->held_frame) {
+    gst_video_codec_frame_unref (ffmpegenc->held_frame);
+    ffmpegenc->held_frame = NULL;
+  }
+  if (ffmpegenc->last_frame) {
+    gst_video_codec_frame_unref (ffmpegenc->last_frame);
+    ffmpegenc->last_frame = NULL;
+  }
+  g_queue_foreach (&ffmpegenc->duplicates,
+      (GFunc) gst_video_codec_frame_unref, NULL);
+  g_queue_clear (&ffmpegenc->duplicates);
+  ffmpegenc->have_last_hash = FALSE;
+}
+
+static GstFlowReturn
+gst_ffmpegvidenc_handle_frame (GstVideoEncoder * encoder,
+    GstVideoCodecFrame * frame)
+{
+  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
+  GstBuffer *outbuf;
+  GstClockTime start;
+  gint ret = 0, c;
+  GstVideoInfo *info = &ffmpegenc->input_state->info;
+  AVPacket *pkt;
+  int have_data = 0;
+  BufferInfo *buffer_info;
+
+  if (ffmpegenc->interlaced) {
+    ffmpegenc->picture->interlaced_frame = TRUE;
+    /* if this is not the case, a filter element should be used to swap fields */
+    ffmpegenc->picture->top_field_first =
+        GST_BUFFER_FLAG_IS_SET (frame->input_buffer, GST_VIDEO_BUFFER_FLAG_TFF);
+  }
+
+  if (GST_VIDEO_INFO_MULTIVIEW_MODE (info) != GST_VIDEO_MULTIVIEW_MODE_NONE) {
+    AVStereo3D *stereo = av_stereo3d_create_side_data (ffmpegenc->picture);
+    stereo->type = stereo_gst_to_av (GST_VIDEO_INFO_MULTIVIEW_MODE (info));
+
+    if (GST_VIDEO_INFO_MULTIVIEW_FLAGS (info) &
+        GST_VIDEO_MULTIVIEW_FLAGS_RIGHT_VIEW_FIRST) {
+      stereo->flags = AV_STEREO3D_FLAG_INVERT;
+    }
+  }
+
+  if (GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame))
+    ffmpegenc->picture->pict_type = AV_PICTURE_TYPE_I;
+
+  buffer_info = g_slice_new0 (BufferInfo);
+  buffer_info->buffer = gst_buffer_ref (frame->input_buffer);
+
+  if (!gst_video_frame_map (&buffer_info->vframe, info, frame->input_buffer,
+          GST_MAP_READ)) {
+    GST_ERROR_OBJECT (encoder, "Failed to map input buffer");
+    gst_buffer_unref (buffer_info->buffer);
+    g_slice_free (BufferInfo, buffer_info);
+    gst_video_codec_frame_unref (frame);
+    return GST_FLOW_ERROR;
+  }
+
+  /* a repeat isn't encoded, the frame it repeats lasts until its end
+   * instead. The repeat is finished right after that frame to keep the
+   * frames in order */
+  if (ffmpegenc->drop_duplicates && !ffmpegenc->gop_pool
+      && !ffmpegenc->async_thread) {
+    GstVideoCodecFrame *last = ffmpegenc->last_frame;
+    GstFlowReturn flow_ret;
+
+    if (gst_ffmpegvidenc_is_duplicate (ffmpegenc, frame,
+            &buffer_info->vframe)) {
+      GST_LOG_OBJECT (ffmpegenc, "dropping duplicate frame %u",
+          frame->system_frame_number);
+      buffer_info_free (buffer_info, NULL);
+      av_frame_unref (ffmpegenc->picture);
+      if (GST_CLOCK_TIME_IS_VALID (last->duration)
+          && GST_CLOCK_TIME_IS_VALID (frame->duration))
+        last->duration += frame->duration;
+      g_queue_push_tail (&ffmpegenc->duplicates, frame);
+      return gst_ffmpegvidenc_finish_duplicates (ffmpegenc);
+    }
+
+    flow_ret = gst_ffmpegvidenc_release_held (ffmpegenc);
+    if (flow_ret != GST_FLOW_OK) {
+      buffer_info_free (buffer_info, NULL);
+      av_frame_unref (ffmpegenc->picture);
+      gst_video_codec_frame_unref (frame);
+      return flow_ret;
+    }
+
+    if (last)
+      gst_video_codec_frame_unref (last);
+    ffmpegenc->last_frame = gst_video_codec_frame_ref (frame);
+  }
+
+  /* Fill avpicture */
+  ffmpegenc->picture->buf[0] =
+      av_buffer_create (NULL, 0, buffer_info_free, buffer_info, 0);
+  for (c = 0; c < AV_NUM_DATA_POINTERS; c++) {
+    if (c < GST_VIDEO_INFO_N_COMPONENTS (info)) {
+      ffmpegenc->picture->data[c] =
+          GST_VIDEO_FRAME_PLANE_DATA (&buffer_info->vframe, c);
+      ffmpegenc->picture->linesize[c] =
+          GST_VIDEO_FRAME_COMP_STRIDE (&buffer_info->vframe, c);
+    } else {
+      ffmpegenc->picture->data[c] = NULL;
+      ffmpegenc->picture->linesize[c] = 0;
+    }
+  }
+
+  ffmpegenc->picture->format = ffmpegenc->context->pix_fmt;
+  ffmpegenc->picture->width = GST_VIDEO_FRAME_WIDTH (&buffer_info->vframe);
+  ffmpegenc->picture->height = GST_VIDEO_FRAME_HEIGHT (&buffer_info->vframe);
+
+  ffmpegenc->picture->pts =
+      gst_ffmpeg_time_gst_to_ff (frame->pts /
+      ffmpegenc->context->ticks_per_frame, ffmpegenc->context->time_base);
+
+  /* libav takes the constant quantizer from every frame */
+  if (ffmpegenc->pass == CODEC_FLAG_QSCALE) {
+    GST_OBJECT_LOCK (ffmpegenc);
+    ffmpegenc->picture->quality = FF_QP2LAMBDA * ffmpegenc->quantizer;
+    GST_OBJECT_UNLOCK (ffmpegenc);
+  }
+
+  if (ffmpegenc->gop_pool)
+    return gst_ffmpegvidenc_gop_push (ffmpegenc, frame);
+  if (ffmpegenc->async_thread)
+    return gst_ffmpegvidenc_async_push (ffmpegenc, frame);
+
+  gst_ffmpegvidenc_reconfigure (ffmpegenc, ffmpegenc->context, FALSE);
+
+  have_data = 0;
+  pkt = g_slice_new0 (AVPacket);
+
+  start = gst_util_get_timestamp ();
   ret =
       avcodec_encode_video2 (ffmpegenc->context, pkt, ffmpegenc->picture,
       &have_data);
+  ffmpegenc->stats_pending += gst_util_get_timestamp () - start;
 
   av_frame_unref (ffmpegenc->picture);
 
@@ -721,12 +2031,7 @@ gst_ffmpegvidenc_handle_frame (GstVideoEncoder * encoder,
     return GST_FLOW_OK;
   }
 
-  /* save stats info if there is some as well as a stats file */
-  if (ffmpegenc->file && ffmpegenc->context->stats_out)
-    if (fprintf (ffmpegenc->file, "%s", ffmpegenc->context->stats_out) < 0)
-      GST_ELEMENT_ERROR (ffmpegenc, RESOURCE, WRITE,
-          (("Could not write to file \"%s\"."), ffmpegenc->filename),
-          GST_ERROR_SYSTEM);
+  gst_ffmpegvidenc_save_stats (ffmpegenc);
 
   gst_video_codec_frame_unref (frame);
 
@@ -737,13 +2042,22 @@ gst_ffmpegvidenc_handle_frame (GstVideoEncoder * encoder,
       gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, pkt->data,
       pkt->size, 0, pkt->size, pkt, gst_ffmpegvidenc_free_avpacket);
   frame->output_buffer = outbuf;
+  gst_ffmpegvidenc_add_frame_stats (ffmpegenc, outbuf, pkt,
+      ffmpegenc->stats_pending);
+  ffmpegenc->stats_pending = 0;
 
   if (pkt->flags & AV_PKT_FLAG_KEY)
     GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (frame);
   else
     GST_VIDEO_CODEC_FRAME_UNSET_SYNC_POINT (frame);
 
-  return gst_video_encoder_finish_frame (encoder, frame);
+  /* the next frame may repeat this one and extend its duration */
+  if (frame == ffmpegenc->last_frame) {
+    ffmpegenc->held_frame = frame;
+    return GST_FLOW_OK;
+  }
+
+  return gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
 
   /* ERRORS */
 encode_fail:
@@ -755,7 +2069,7 @@ encode_fail:
         "avenc_%s: failed to encode buffer", oclass->in_plugin->name);
 #endif /* GST_DISABLE_GST_DEBUG */
     /* avoid frame (and ts etc) piling up */
-    return gst_video_encoder_finish_frame (encoder, frame);
+    return gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
   }
 }
 
@@ -765,6 +2079,7 @@ gst_ffmpegvidenc_flush_buffers (GstFFMpegVidEnc * ffmpegenc, gboolean send)
   GstVideoCodecFrame *frame;
   GstFlowReturn flow_ret = GST_FLOW_OK;
   GstBuffer *outbuf;
+  GstClockTime start;
   gint ret;
   AVPacket *pkt;
   int have_data = 0;
@@ -775,12 +2090,43 @@ gst_ffmpegvidenc_flush_buffers (GstFFMpegVidEnc * ffmpegenc, gboolean send)
   if (!ffmpegenc->opened)
     goto done;
 
+  if (ffmpegenc->gop_pool) {
+    if (send && ffmpegenc->gop_chunk->len > 0)
+      flow_ret = gst_ffmpegvidenc_gop_submit (ffmpegenc);
+    while (send && flow_ret == GST_FLOW_OK
+        && !g_queue_is_empty (&ffmpegenc->gop_jobs))
+      flow_ret = gst_ffmpegvidenc_gop_output (ffmpegenc);
+    gst_ffmpegvidenc_gop_discard (ffmpegenc);
+    goto done;
+  }
+
+  if (ffmpegenc->async_thread) {
+    gst_ffmpegvidenc_async_wait (ffmpegenc);
+    flow_ret = gst_ffmpegvidenc_send_frame (ffmpegenc, NULL, send);
+    /* leave draining mode for the frames after this */
+    avcodec_flush_buffers (ffmpegenc->context);
+    goto done;
+  }
+
+  /* no more frames to extend the held output */
+  if (ffmpegenc->held_frame) {
+    if (send) {
+      flow_ret = gst_ffmpegvidenc_release_held (ffmpegenc);
+    } else {
+      gst_buffer_replace (&ffmpegenc->held_frame->output_buffer, NULL);
+      gst_video_codec_frame_unref (ffmpegenc->held_frame);
+      ffmpegenc->held_frame = NULL;
+    }
+  }
+
   while ((frame =
           gst_video_encoder_get_oldest_frame (GST_VIDEO_ENCODER (ffmpegenc)))) {
     pkt = g_slice_new0 (AVPacket);
     have_data = 0;
 
+    start = gst_util_get_timestamp ();
     ret = avcodec_encode_video2 (ffmpegenc->context, pkt, NULL, &have_data);
+    ffmpegenc->stats_pending += gst_util_get_timestamp () - start;
 
     if (ret < 0) {              /* there should be something, notify and give up */
 #ifndef GST_DISABLE_GST_DEBUG
@@ -794,29 +2140,26 @@ gst_ffmpegvidenc_flush_buffers (GstFFMpegVidEnc * ffmpegenc, gboolean send)
       break;
     }
 
-    /* save stats info if there is some as well as a stats file */
-    if (ffmpegenc->file && ffmpegenc->context->stats_out)
-      if (fprintf (ffmpegenc->file, "%s", ffmpegenc->context->stats_out) < 0)
-        GST_ELEMENT_ERROR (ffmpegenc, RESOURCE, WRITE,
-            (("Could not write to file \"%s\"."), ffmpegenc->filename),
-            GST_ERROR_SYSTEM);
+    gst_ffmpegvidenc_save_stats (ffmpegenc);
 
     if (send && have_data) {
       outbuf =
           gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, pkt->data,
           pkt->size, 0, pkt->size, pkt, gst_ffmpegvidenc_free_avpacket);
       frame->output_buffer = outbuf;
+      gst_ffmpegvidenc_add_frame_stats (ffmpegenc, outbuf, pkt,
+          ffmpegenc->stats_pending);
+      ffmpegenc->stats_pending = 0;
 
       if (pkt->flags & AV_PKT_FLAG_KEY)
         GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (frame);
       else
         GST_VIDEO_CODEC_FRAME_UNSET_SYNC_POINT (frame);
 
-      flow_ret =
-          gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (ffmpegenc), frame);
+      flow_ret = gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
     } else {
       /* no frame attached, so will be skipped and removed from frame list */
-      gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (ffmpegenc), frame);
+      gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
     }
   }
 
@@ -836,8 +2179,17 @@ gst_ffmpegvidenc_set_property (GObject * object,
   ffmpegenc = (GstFFMpegVidEnc *) (object);
 
   if (ffmpegenc->opened) {
-    GST_WARNING_OBJECT (ffmpegenc,
-        "Can't change properties once decoder is setup !");
+    if (!(pspec->flags & GST_PARAM_MUTABLE_PLAYING)) {
+      GST_WARNING_OBJECT (ffmpegenc,
+          "Can't change properties once decoder is setup !");
+      return;
+    }
+
+    /* rate control, picked up at the next frame without reopening */
+    GST_OBJECT_LOCK (ffmpegenc);
+    gst_ffmpeg_cfg_set_property (object, value, pspec);
+    ffmpegenc->reconfigure = TRUE;
+    GST_OBJECT_UNLOCK (ffmpegenc);
     return;
   }
 
@@ -863,6 +2215,38 @@ gst_ffmpegvidenc_set_property (GObject * object,
     case PROP_MAX_THREADS:
       ffmpegenc->max_threads = g_value_get_int (value);
       break;
+    case PROP_POOL_MEMORY:
+      ffmpegenc->pool_memory = g_value_get_enum (value);
+      break;
+    case PROP_CPU_SET:
+      g_free (ffmpegenc->cpu_set);
+      ffmpegenc->cpu_set = g_value_dup_string (value);
+      break;
+    case PROP_NUMA_NODE:
+      ffmpegenc->numa_node = g_value_get_int (value);
+      break;
+    case PROP_ASYNC_DEPTH:
+      ffmpegenc->async_depth = g_value_get_int (value);
+      break;
+    case PROP_GOP_CONTEXTS:
+      ffmpegenc->gop_contexts = g_value_get_int (value);
+      break;
+    case PROP_FAST_FIRST_PASS:
+      ffmpegenc->fast_first_pass = g_value_get_boolean (value);
+      break;
+    case PROP_DROP_DUPLICATES:
+      ffmpegenc->drop_duplicates = g_value_get_boolean (value);
+      break;
+    case PROP_POST_MESSAGES:
+      ffmpegenc->post_messages = g_value_get_boolean (value);
+      break;
+    case PROP_MULTIPASS_STATS:
+      GST_OBJECT_LOCK (ffmpegenc);
+      if (ffmpegenc->stats_in)
+        g_bytes_unref (ffmpegenc->stats_in);
+      ffmpegenc->stats_in = g_value_dup_boxed (value);
+      GST_OBJECT_UNLOCK (ffmpegenc);
+      break;
     default:
       if (!gst_ffmpeg_cfg_set_property (object, value, pspec))
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -902,6 +2286,39 @@ gst_ffmpegvidenc_get_property (GObject * object,
     case PROP_MAX_THREADS:
       g_value_set_int (value, ffmpegenc->max_threads);
       break;
+    case PROP_POOL_MEMORY:
+      g_value_set_enum (value, ffmpegenc->pool_memory);
+      break;
+    case PROP_CPU_SET:
+      g_value_set_string (value, ffmpegenc->cpu_set);
+      break;
+    case PROP_NUMA_NODE:
+      g_value_set_int (value, ffmpegenc->numa_node);
+      break;
+    case PROP_ASYNC_DEPTH:
+      g_value_set_int (value, ffmpegenc->async_depth);
+      break;
+    case PROP_GOP_CONTEXTS:
+      g_value_set_int (value, ffmpegenc->gop_contexts);
+      break;
+    case PROP_FAST_FIRST_PASS:
+      g_value_set_boolean (value, ffmpegenc->fast_first_pass);
+      break;
+    case PROP_DROP_DUPLICATES:
+      g_value_set_boolean (value, ffmpegenc->drop_duplicates);
+      break;
+    case PROP_POST_MESSAGES:
+      g_value_set_boolean (value, ffmpegenc->post_messages);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_ffmpegvidenc_get_stats (ffmpegenc));
+      break;
+    case PROP_MULTIPASS_STATS:
+      GST_OBJECT_LOCK (ffmpegenc);
+      g_value_take_boxed (value, g_bytes_new (ffmpegenc->stats->str,
+              ffmpegenc->stats->len));
+      GST_OBJECT_UNLOCK (ffmpegenc);
+      break;
     default:
       if (!gst_ffmpeg_cfg_get_property (object, value, pspec))
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -914,6 +2331,16 @@ gst_ffmpegvidenc_flush (GstVideoEncoder * encoder)
 {
   GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
 
+  gst_ffmpegvidenc_reset_duplicates (ffmpegenc);
+  ffmpegenc->stats_pending = 0;
+
+  gst_ffmpegvidenc_gop_discard (ffmpegenc);
+  if (ffmpegenc->async_thread) {
+    gst_ffmpegvidenc_async_discard (ffmpegenc);
+    gst_ffmpegvidenc_async_wait (ffmpegenc);
+    ffmpegenc->async_flow = GST_FLOW_OK;
+  }
+
   if (ffmpegenc->opened)
     avcodec_flush_buffers (ffmpegenc->context);
 
@@ -934,6 +2361,13 @@ gst_ffmpegvidenc_start (GstVideoEncoder * encoder)
     return FALSE;
   }
 
+  /* a new first pass */
+  GST_OBJECT_LOCK (ffmpegenc);
+  g_string_truncate (ffmpegenc->stats, 0);
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  gst_ffmpegvidenc_reset_stats (ffmpegenc);
+
   return TRUE;
 }
 
@@ -942,7 +2376,15 @@ gst_ffmpegvidenc_stop (GstVideoEncoder * encoder)
 {
   GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
 
-  gst_ffmpegvidenc_flush_buffers (ffmpegenc, FALSE);
+  /* the codec was fed by the encode thread or not at all, leave the frames
+   * to the base class */
+  if (ffmpegenc->gop_pool)
+    gst_ffmpegvidenc_gop_close (ffmpegenc);
+  else if (ffmpegenc->async_thread)
+    gst_ffmpegvidenc_async_stop (ffmpegenc);
+  else
+    gst_ffmpegvidenc_flush_buffers (ffmpegenc, FALSE);
+  gst_ffmpegvidenc_reset_duplicates (ffmpegenc);
   gst_ffmpeg_avcodec_close (ffmpegenc->context);
   ffmpegenc->opened = FALSE;
 
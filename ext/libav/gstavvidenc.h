@@ -30,6 +30,8 @@ G_BEGIN_DECLS
 #include <gst/video/gstvideoencoder.h>
 #include <libavcodec/avcodec.h>
 
+#include "gstavallocator.h"
+
 typedef struct _GstFFMpegVidEnc GstFFMpegVidEnc;
 
 struct _GstFFMpegVidEnc
@@ -51,6 +53,9 @@ struct _GstFFMpegVidEnc
   gint rtp_payload_size;
   gint compliance;
   gint max_threads;
+  GstFFMpegPoolMemory pool_memory;
+  gchar *cpu_set;
+  gint numa_node;
 
   guint8 *working_buf;
   gsize working_buf_size;
@@ -63,9 +68,61 @@ struct _GstFFMpegVidEnc
   guint lmax;
   gint max_key_interval;
   gboolean interlaced;
+  gboolean fast_first_pass;
+  /* rate control properties changed while encoding */
+  gboolean reconfigure;
+
+  /* hash of the last frame to detect repeated frames */
+  gboolean drop_duplicates;
+  gboolean have_last_hash;
+  guint64 last_hash;
+  /* the last frame that wasn't a repeat, its encoded output while the next
+   * frame may still extend it, and the repeats waiting to be finished in
+   * order after it */
+  GstVideoCodecFrame *last_frame;
+  GstVideoCodecFrame *held_frame;
+  GQueue duplicates;
+
+  /* per-frame statistics as element messages, totals protected by the
+   * object lock */
+  gboolean post_messages;
+  /* time spent in the main context since its last packet */
+  GstClockTime stats_pending;
+  guint64 stats_frames;
+  guint64 stats_bytes;
+  GstClockTime stats_time;
+  gdouble stats_qp;
+  guint stats_n_qp;
+  guint64 stats_types[3];
+  gdouble stats_psnr[3];
+  guint stats_n_psnr[3];
 
   /* statistics file */
   FILE *file;
+  /* first pass statistics collected in memory when there is no file,
+   * second pass statistics handed in, protected by the object lock */
+  GString *stats;
+  GBytes *stats_in;
+
+  /* encoding on a separate thread */
+  gint async_depth;
+  GThread *async_thread;
+  GQueue async_frames;
+  GMutex async_lock;
+  GCond async_cond;
+  gboolean async_busy;
+  gboolean async_quit;
+  GstFlowReturn async_flow;
+
+  /* whole GOPs encoded on parallel contexts */
+  gint gop_contexts;
+  GThreadPool *gop_pool;
+  GAsyncQueue *gop_idle;
+  gint gop_n_contexts;
+  GPtrArray *gop_chunk;
+  GQueue gop_jobs;
+  GMutex gop_lock;
+  GCond gop_cond;
 
   /* other settings are copied over straight,
    * include a context here, rather than copy-and-past it from avcodec.h */
@@ -0,0 +1,336 @@
+/* GStreamer unit tests for the avenc audio encoders
+ *
+ * Copyright (C) <2018> GStreamer developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+#include <gst/audio/audio.h>
+
+#include <gst/gst.h>
+
+#define ALAC_FRAME_SIZE 4096
+#define RATE 44100
+#define WARMUP_BUFFERS 8
+#define COUNTED_BUFFERS 32
+/* more than the AVFrame has data pointers for */
+#define MANY_CHANNELS 10
+
+/* Only the allocations of the encoder itself are counted: everything the
+ * streaming thread allocates while it is in the subclass' handle_frame,
+ * except in gst_audio_encoder_finish_frame(), where the base class does its
+ * own bookkeeping for the output buffer. */
+static gboolean counting_enabled;
+static gboolean counting;
+static pthread_t counting_thread;
+static gint n_allocs;
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+
+static void
+count_alloc (void)
+{
+  if (counting && pthread_equal (pthread_self (), counting_thread))
+    n_allocs++;
+}
+
+void *
+malloc (size_t size)
+{
+  count_alloc ();
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  count_alloc ();
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  count_alloc ();
+  return __libc_realloc (ptr, size);
+}
+
+void *
+memalign (size_t alignment, size_t size)
+{
+  count_alloc ();
+  return __libc_memalign (alignment, size);
+}
+
+void *
+aligned_alloc (size_t alignment, size_t size)
+{
+  count_alloc ();
+  return __libc_memalign (alignment, size);
+}
+
+/* what av_malloc() uses */
+int
+posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+  void *mem;
+
+  count_alloc ();
+  mem = __libc_memalign (alignment, size);
+  if (mem == NULL)
+    return ENOMEM;
+  *memptr = mem;
+
+  return 0;
+}
+
+GstFlowReturn
+gst_audio_encoder_finish_frame (GstAudioEncoder * enc, GstBuffer * buf,
+    gint frames)
+{
+  static GstFlowReturn (*real_finish_frame) (GstAudioEncoder *, GstBuffer *,
+      gint);
+  gboolean was_counting = counting;
+  GstFlowReturn ret;
+
+  counting = FALSE;
+  if (!real_finish_frame)
+    real_finish_frame = dlsym (RTLD_NEXT, "gst_audio_encoder_finish_frame");
+  ret = real_finish_frame (enc, buf, frames);
+  counting = was_counting;
+
+  return ret;
+}
+
+static GstFlowReturn (*real_handle_frame) (GstAudioEncoder *, GstBuffer *);
+
+static GstFlowReturn
+counting_handle_frame (GstAudioEncoder * enc, GstBuffer * buf)
+{
+  GstFlowReturn ret;
+
+  counting_thread = pthread_self ();
+  counting = counting_enabled;
+  ret = real_handle_frame (enc, buf);
+  counting = FALSE;
+
+  return ret;
+}
+
+static GstHarness *
+setup_encoder (const gchar * factory, const gchar * layout, gint channels)
+{
+  GstAudioEncoderClass *klass;
+  GstHarness *h;
+
+  h = gst_harness_new (factory);
+  gst_harness_set_src_caps (h, gst_caps_new_simple ("audio/x-raw",
+          "format", G_TYPE_STRING, "S16LE", "layout", G_TYPE_STRING, layout,
+          "rate", G_TYPE_INT, RATE, "channels", G_TYPE_INT, channels,
+          "channel-mask", GST_TYPE_BITMASK,
+          channels == 2 ? G_GUINT64_CONSTANT (0x3) : G_GUINT64_CONSTANT (0),
+          NULL));
+
+  klass = GST_AUDIO_ENCODER_CLASS (G_OBJECT_GET_CLASS (h->element));
+  real_handle_frame = klass->handle_frame;
+  klass->handle_frame = counting_handle_frame;
+
+  return h;
+}
+
+static void
+teardown_encoder (GstHarness * h)
+{
+  GstAudioEncoderClass *klass;
+
+  klass = GST_AUDIO_ENCODER_CLASS (G_OBJECT_GET_CLASS (h->element));
+  klass->handle_frame = real_handle_frame;
+
+  gst_harness_teardown (h);
+}
+
+static GstFlowReturn
+push_buffer (GstHarness * h, gint channels, gint samples, gboolean planar,
+    guint64 offset)
+{
+  GstBuffer *buf;
+  GstMapInfo map;
+  gint j;
+
+  buf = gst_buffer_new_allocate (NULL, samples * channels * 2, NULL);
+  gst_buffer_map (buf, &map, GST_MAP_WRITE);
+  for (j = 0; j < samples * channels; j++)
+    ((gint16 *) map.data)[j] = ((offset + j) * 104729) & 0xffff;
+  gst_buffer_unmap (buf, &map);
+
+#if GST_CHECK_VERSION(1,15,1)
+  if (planar) {
+    GstAudioInfo info;
+
+    gst_audio_info_set_format (&info, GST_AUDIO_FORMAT_S16LE, RATE, channels,
+        NULL);
+    info.layout = GST_AUDIO_LAYOUT_NON_INTERLEAVED;
+    gst_buffer_add_audio_meta (buf, &info, samples, NULL);
+  }
+#endif
+
+  GST_BUFFER_PTS (buf) = gst_util_uint64_scale (offset, GST_SECOND, RATE);
+  GST_BUFFER_DURATION (buf) = gst_util_uint64_scale (samples, GST_SECOND,
+      RATE);
+
+  return gst_harness_push (h, buf);
+}
+
+static gint
+pull_packets (GstHarness * h)
+{
+  GstBuffer *buf;
+  gint n = 0;
+
+  while ((buf = gst_harness_try_pull (h))) {
+    gst_buffer_unref (buf);
+    n++;
+  }
+
+  return n;
+}
+
+/* once the first buffers have sized everything, the encoder must not
+ * allocate anymore */
+static void
+check_steady_state_allocations (const gchar * factory, const gchar * layout,
+    gint channels, gint samples)
+{
+  gboolean planar = g_str_equal (layout, "non-interleaved");
+  GstHarness *h;
+  guint64 offset = 0;
+  gint i, n_packets = 0;
+
+  h = setup_encoder (factory, layout, channels);
+
+  for (i = 0; i < WARMUP_BUFFERS; i++, offset += samples) {
+    fail_unless_equals_int (push_buffer (h, channels, samples, planar,
+            offset), GST_FLOW_OK);
+    pull_packets (h);
+  }
+
+  /* log messages are formatted into allocated strings */
+  gst_debug_set_active (FALSE);
+  n_allocs = 0;
+  counting_enabled = TRUE;
+  for (i = 0; i < COUNTED_BUFFERS; i++, offset += samples) {
+    fail_unless_equals_int (push_buffer (h, channels, samples, planar,
+            offset), GST_FLOW_OK);
+    n_packets += pull_packets (h);
+  }
+  counting_enabled = FALSE;
+  gst_debug_set_active (TRUE);
+
+  fail_unless (n_packets > 0);
+  fail_unless_equals_int (n_allocs, 0);
+
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  pull_packets (h);
+
+  teardown_encoder (h);
+}
+
+/* interleaved input to a planar encoder goes through the staging area */
+GST_START_TEST (test_interleaved_allocations)
+{
+  check_steady_state_allocations ("avenc_alac", "interleaved", 2,
+      ALAC_FRAME_SIZE);
+}
+
+GST_END_TEST;
+
+/* the planes don't fit in the AVFrame's data pointers anymore */
+GST_START_TEST (test_many_channels_allocations)
+{
+  check_steady_state_allocations ("avenc_wavpack", "interleaved",
+      MANY_CHANNELS, ALAC_FRAME_SIZE);
+}
+
+GST_END_TEST;
+
+#if GST_CHECK_VERSION(1,15,1)
+/* whole frames are encoded straight from the input planes, anything else
+ * is collected in the fifo first */
+GST_START_TEST (test_non_interleaved_allocations)
+{
+  check_steady_state_allocations ("avenc_alac", "non-interleaved", 2,
+      ALAC_FRAME_SIZE);
+  check_steady_state_allocations ("avenc_alac", "non-interleaved", 2,
+      ALAC_FRAME_SIZE / 4);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_many_channels_non_interleaved)
+{
+  GstHarness *h;
+  gint i, n_packets = 0;
+
+  h = setup_encoder ("avenc_wavpack", "non-interleaved", MANY_CHANNELS);
+
+  for (i = 0; i < COUNTED_BUFFERS; i++) {
+    fail_unless_equals_int (push_buffer (h, MANY_CHANNELS, 1000, TRUE,
+            i * 1000), GST_FLOW_OK);
+    n_packets += pull_packets (h);
+  }
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  n_packets += pull_packets (h);
+
+  fail_unless (n_packets > 0);
+
+  teardown_encoder (h);
+}
+
+GST_END_TEST;
+#endif
+
+static Suite *
+avaudenc_suite (void)
+{
+  Suite *s = suite_create ("avaudenc");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_interleaved_allocations);
+  tcase_add_test (tc_chain, test_many_channels_allocations);
+#if GST_CHECK_VERSION(1,15,1)
+  tcase_add_test (tc_chain, test_non_interleaved_allocations);
+  tcase_add_test (tc_chain, test_many_channels_non_interleaved);
+#endif
+
+  return s;
+}
+
+GST_CHECK_MAIN (avaudenc)
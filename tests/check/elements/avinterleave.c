@@ -0,0 +1,335 @@
+/* GStreamer unit tests for the planar audio conversions of avenc and avdec
+ *
+ * Copyright (C) <2018> GStreamer developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* the kernels are static, build them into the test so each one can be
+ * checked directly, whatever the CPU dispatch picks */
+#include "gstavinterleave.c"
+
+#include <string.h>
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+
+#include <gst/gst.h>
+
+GST_DEBUG_CATEGORY (ffmpeg_debug);
+
+/* ALAC is lossless, takes planar input and produces planar output, so a
+ * round trip through avenc_alac and avdec_alac runs interleaved input
+ * through the deinterleave kernels of the encoder and the interleave
+ * kernels of the decoder and has to give back the same samples */
+#define ALAC_FRAME_SIZE 4096
+#define N_FRAMES 4
+#define N_SAMPLES (ALAC_FRAME_SIZE * N_FRAMES)
+#define RATE 44100
+
+/* the kernels are checked against the scalar reference with up to 11
+ * channels */
+#define MAX_CHANNELS 11
+/* bytes after the end of every output that must stay untouched */
+#define GUARD_SIZE 64
+#define GUARD_BYTE 0xa5
+
+/* shorter than a vector, odd, and around the vector and block sizes */
+static const gint lengths[] = {
+  1, 3, 7, 15, 17, 31, 33, 255, 257, 1023
+};
+#define MAX_LENGTH 1023
+
+typedef struct
+{
+  gint channels;
+  gint width;
+  guint64 channel_mask;
+} InterleaveParams;
+
+/* the 5.1 and 7.1 layouts ALAC supports */
+static const InterleaveParams params[] = {
+  {2, 16, 0x3}, {6, 16, 0x3f}, {8, 16, 0xff},
+  {2, 32, 0x3}, {6, 32, 0x3f}, {8, 32, 0xff},
+};
+
+/* a different value for every sample of every channel, 32 bit samples are
+ * encoded with 24 bits so the lowest byte stays 0 */
+static void
+fill_planes (gpointer * planes, gint channels, gint width, gint nsamples)
+{
+  gint i, c;
+
+  for (c = 0; c < channels; c++) {
+    for (i = 0; i < nsamples; i++) {
+      guint32 v = (c * 0x9e3779b9u) ^ (i * 0x85ebca6bu);
+
+      if (width == 16)
+        ((gint16 *) planes[c])[i] = v >> 16;
+      else
+        ((gint32 *) planes[c])[i] = v & 0xffffff00;
+    }
+  }
+}
+
+/* scalar reference */
+static void
+interleave_scalar (gpointer dest, gpointer * planes, gint channels,
+    gint width, gint nsamples)
+{
+  gint i, c, bps = width / 8;
+
+  for (i = 0; i < nsamples; i++)
+    for (c = 0; c < channels; c++)
+      memcpy ((guint8 *) dest + (i * channels + c) * bps,
+          (guint8 *) planes[c] + i * bps, bps);
+}
+
+/* a different byte pattern for every plane, whatever the sample width */
+static void
+fill_bytes (gpointer * planes, gint channels, gsize size)
+{
+  gsize i;
+  gint c;
+
+  for (c = 0; c < channels; c++)
+    for (i = 0; i < size; i++)
+      ((guint8 *) planes[c])[i] =
+          (((c + 1) * 0x9e3779b9u) ^ (i * 0x85ebca6bu)) >> 24;
+}
+
+static gboolean
+guard_intact (gconstpointer mem, gsize size)
+{
+  gint i;
+
+  for (i = 0; i < GUARD_SIZE; i++)
+    if (((const guint8 *) mem)[size + i] != GUARD_BYTE)
+      return FALSE;
+
+  return TRUE;
+}
+
+typedef struct
+{
+  const gchar *name;
+  gint width;
+  gint channels;
+  InterleaveFunc interleave;
+  DeinterleaveFunc deinterleave;
+  gboolean avx2;
+} Kernel;
+
+/* checks @kernel, or the dispatching functions for @width and @channels
+ * when it is NULL, against the scalar reference for all lengths */
+static void
+check_against_scalar (const Kernel * kernel, gint width, gint channels)
+{
+  gpointer planes[MAX_CHANNELS], out_planes[MAX_CHANNELS];
+  guint8 *expected, *interleaved;
+  gsize max_plane_size = MAX_LENGTH * width / 8;
+  gint l, c;
+
+  for (c = 0; c < channels; c++) {
+    planes[c] = g_malloc (max_plane_size);
+    out_planes[c] = g_malloc (max_plane_size + GUARD_SIZE);
+  }
+  expected = g_malloc (max_plane_size * channels);
+  interleaved = g_malloc (max_plane_size * channels + GUARD_SIZE);
+
+  for (l = 0; l < G_N_ELEMENTS (lengths); l++) {
+    gint n = lengths[l];
+    gsize plane_size = n * width / 8;
+    gsize size = plane_size * channels;
+
+    fill_bytes (planes, channels, plane_size);
+    interleave_scalar (expected, planes, channels, width, n);
+
+    memset (interleaved + size, GUARD_BYTE, GUARD_SIZE);
+    if (kernel)
+      kernel->interleave (interleaved, (const gpointer *) planes, n);
+    else
+      gst_ffmpeg_audio_interleave (interleaved, (const gpointer *) planes,
+          width, channels, n);
+    fail_unless (memcmp (interleaved, expected, size) == 0,
+        "%s: %d channels of %d bits, %d samples interleaved wrongly",
+        kernel ? kernel->name : "dispatch", channels, width, n);
+    fail_unless (guard_intact (interleaved, size),
+        "%s: %d channels of %d bits, %d samples written past the end",
+        kernel ? kernel->name : "dispatch", channels, width, n);
+
+    for (c = 0; c < channels; c++)
+      memset ((guint8 *) out_planes[c] + plane_size, GUARD_BYTE, GUARD_SIZE);
+    if (kernel)
+      kernel->deinterleave (out_planes, expected, n);
+    else
+      gst_ffmpeg_audio_deinterleave (out_planes, expected, width, channels,
+          n);
+    for (c = 0; c < channels; c++) {
+      fail_unless (memcmp (out_planes[c], planes[c], plane_size) == 0,
+          "%s: channel %d of %d, %d bits, %d samples deinterleaved wrongly",
+          kernel ? kernel->name : "dispatch", c, channels, width, n);
+      fail_unless (guard_intact (out_planes[c], plane_size),
+          "%s: channel %d of %d, %d bits, %d samples written past the end",
+          kernel ? kernel->name : "dispatch", c, channels, width, n);
+    }
+  }
+
+  for (c = 0; c < channels; c++) {
+    g_free (planes[c]);
+    g_free (out_planes[c]);
+  }
+  g_free (expected);
+  g_free (interleaved);
+}
+
+GST_START_TEST (test_alac_round_trip)
+{
+  const InterleaveParams *p = &params[__i__];
+  gint bpf = p->channels * p->width / 8;
+  gpointer planes[8];
+  guint8 *expected;
+  GstHarness *h;
+  GstBuffer *buf;
+  GstMapInfo map;
+  GstCaps *caps;
+  gsize offset = 0;
+  gint i;
+
+  for (i = 0; i < p->channels; i++)
+    planes[i] = g_malloc (N_SAMPLES * p->width / 8);
+  fill_planes (planes, p->channels, p->width, N_SAMPLES);
+  expected = g_malloc (N_SAMPLES * bpf);
+  interleave_scalar (expected, planes, p->channels, p->width, N_SAMPLES);
+
+  h = gst_harness_new_parse ("avenc_alac ! avdec_alac");
+  caps = gst_caps_new_simple ("audio/x-raw",
+      "format", G_TYPE_STRING, p->width == 16 ? "S16LE" : "S32LE",
+      "layout", G_TYPE_STRING, "interleaved",
+      "rate", G_TYPE_INT, RATE, "channels", G_TYPE_INT, p->channels,
+      "channel-mask", GST_TYPE_BITMASK, p->channel_mask, NULL);
+  gst_harness_set_src_caps (h, caps);
+  gst_harness_set_sink_caps_str (h, "audio/x-raw, layout=interleaved");
+
+  for (i = 0; i < N_FRAMES; i++) {
+    buf = gst_buffer_new_allocate (NULL, ALAC_FRAME_SIZE * bpf, NULL);
+    gst_buffer_fill (buf, 0, expected + i * ALAC_FRAME_SIZE * bpf,
+        ALAC_FRAME_SIZE * bpf);
+    GST_BUFFER_PTS (buf) =
+        gst_util_uint64_scale (i * ALAC_FRAME_SIZE, GST_SECOND, RATE);
+    GST_BUFFER_DURATION (buf) =
+        gst_util_uint64_scale (ALAC_FRAME_SIZE, GST_SECOND, RATE);
+    fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+  }
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  while ((buf = gst_harness_try_pull (h))) {
+    gst_buffer_map (buf, &map, GST_MAP_READ);
+    fail_unless (offset + map.size <= N_SAMPLES * bpf);
+    fail_unless (memcmp (expected + offset, map.data, map.size) == 0,
+        "%d channels, %d bits: samples differ after %" G_GSIZE_FORMAT,
+        p->channels, p->width, offset / bpf);
+    offset += map.size;
+    gst_buffer_unmap (buf, &map);
+    gst_buffer_unref (buf);
+  }
+  fail_unless_equals_int (offset, N_SAMPLES * bpf);
+
+  gst_harness_teardown (h);
+  g_free (expected);
+  for (i = 0; i < p->channels; i++)
+    g_free (planes[i]);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_dispatch)
+{
+  static const gint widths[] = { 8, 16, 32, 64 };
+  gint w, channels;
+
+  /* the kernels for 2, 6 and 8 channels and the generic code for the rest */
+  for (w = 0; w < G_N_ELEMENTS (widths); w++)
+    for (channels = 1; channels <= MAX_CHANNELS; channels++)
+      check_against_scalar (NULL, widths[w], channels);
+}
+
+GST_END_TEST;
+
+#define KERNEL(n, bits, isa, avx2)                                            \
+  { G_STRINGIFY (n) "ch_" G_STRINGIFY (bits) "_" G_STRINGIFY (isa), bits, n,  \
+    interleave_##n##ch_##bits##_##isa, deinterleave_##n##ch_##bits##_##isa,   \
+    avx2 }
+
+/* every kernel that is built for this architecture */
+static const Kernel kernels[] = {
+  KERNEL (2, 8, c, FALSE), KERNEL (6, 8, c, FALSE), KERNEL (8, 8, c, FALSE),
+  KERNEL (2, 16, c, FALSE), KERNEL (6, 16, c, FALSE),
+  KERNEL (8, 16, c, FALSE),
+  KERNEL (2, 32, c, FALSE), KERNEL (6, 32, c, FALSE),
+  KERNEL (8, 32, c, FALSE),
+  KERNEL (2, 64, c, FALSE), KERNEL (6, 64, c, FALSE),
+  KERNEL (8, 64, c, FALSE),
+#ifdef HAVE_INTERLEAVE_SSE2
+  KERNEL (2, 16, sse2, FALSE), KERNEL (2, 32, sse2, FALSE),
+  KERNEL (6, 32, sse2, FALSE), KERNEL (8, 32, sse2, FALSE),
+  KERNEL (2, 64, sse2, FALSE),
+#endif
+#ifdef HAVE_INTERLEAVE_AVX2
+  KERNEL (2, 16, avx2, TRUE), KERNEL (2, 32, avx2, TRUE),
+  KERNEL (8, 32, avx2, TRUE),
+#endif
+#ifdef HAVE_INTERLEAVE_NEON
+  KERNEL (2, 16, neon, FALSE), KERNEL (2, 32, neon, FALSE),
+  KERNEL (6, 32, neon, FALSE), KERNEL (8, 32, neon, FALSE),
+#endif
+};
+
+GST_START_TEST (test_kernels)
+{
+  const Kernel *k = &kernels[__i__];
+
+#ifdef HAVE_INTERLEAVE_AVX2
+  __builtin_cpu_init ();
+  if (k->avx2 && !__builtin_cpu_supports ("avx2")) {
+    GST_INFO ("skipping %s, no AVX2", k->name);
+    return;
+  }
+#endif
+
+  check_against_scalar (k, k->width, k->channels);
+}
+
+GST_END_TEST;
+
+static Suite *
+avinterleave_suite (void)
+{
+  Suite *s = suite_create ("avinterleave");
+  TCase *tc_chain = tcase_create ("general");
+
+  GST_DEBUG_CATEGORY_INIT (ffmpeg_debug, "libav", 0, "libav elements");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_dispatch);
+  tcase_add_loop_test (tc_chain, test_kernels, 0, G_N_ELEMENTS (kernels));
+  tcase_add_loop_test (tc_chain, test_alac_round_trip, 0,
+      G_N_ELEMENTS (params));
+
+  return s;
+}
+
+GST_CHECK_MAIN (avinterleave)
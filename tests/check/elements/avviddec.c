@@ -0,0 +1,171 @@
+/* GStreamer unit tests for the avdec video decoders
+ *
+ * Copyright (C) <2018> GStreamer developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+#include <gst/video/video.h>
+
+#include <gst/gst.h>
+
+/* a frame spans a few huge pages */
+#define WIDTH 1920
+#define HEIGHT 1088
+#define N_FRAMES 4
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* encodes @n_frames moving gradients, returns the encoded buffers and the
+ * caps to decode them with */
+static GList *
+encode_frames (gint width, gint height, gint n_frames, GstCaps ** caps)
+{
+  GstHarness *h;
+  GstVideoInfo info;
+  GstBuffer *buf;
+  GstMapInfo map;
+  GList *packets = NULL;
+  gint i, x, y;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 bitrate=20000000");
+  gst_video_info_set_format (&info, GST_VIDEO_FORMAT_I420, width, height);
+  info.fps_n = 30;
+  info.fps_d = 1;
+  gst_harness_set_src_caps (h, gst_video_info_to_caps (&info));
+
+  for (i = 0; i < n_frames; i++) {
+    buf = gst_harness_create_buffer (h, GST_VIDEO_INFO_SIZE (&info));
+    gst_buffer_map (buf, &map, GST_MAP_WRITE);
+    for (y = 0; y < height; y++)
+      for (x = 0; x < width; x++)
+        map.data[y * width + x] = (x + y + 4 * i) & 0xff;
+    memset (map.data + width * height, 128,
+        GST_VIDEO_INFO_SIZE (&info) - width * height);
+    gst_buffer_unmap (buf, &map);
+
+    GST_BUFFER_PTS (buf) = gst_util_uint64_scale (i, GST_SECOND, 30);
+    GST_BUFFER_DURATION (buf) = GST_SECOND / 30;
+    fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+  }
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  while ((buf = gst_harness_try_pull (h)))
+    packets = g_list_append (packets, buf);
+
+  *caps = gst_pad_get_current_caps (h->sinkpad);
+  gst_harness_teardown (h);
+
+  return packets;
+}
+
+/* decodes frames with the given pool memory and returns the decoded
+ * frames */
+static GList *
+decode_frames (const gchar * pool_memory)
+{
+  GstHarness *h;
+  GstBuffer *buf;
+  GstCaps *caps;
+  GList *packets, *l, *frames = NULL;
+  gchar *launch;
+
+  packets = encode_frames (WIDTH, HEIGHT, N_FRAMES, &caps);
+  fail_unless (packets != NULL);
+
+  launch = g_strdup_printf ("avdec_mpeg4 pool-memory=%s", pool_memory);
+  h = gst_harness_new_parse (launch);
+  g_free (launch);
+  gst_harness_set_src_caps (h, caps);
+
+  for (l = packets; l; l = l->next)
+    fail_unless_equals_int (gst_harness_push (h, gst_buffer_ref (l->data)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  while ((buf = gst_harness_try_pull (h)))
+    frames = g_list_append (frames, buf);
+  fail_unless_equals_int (g_list_length (frames), g_list_length (packets));
+
+  g_list_free_full (packets, (GDestroyNotify) gst_buffer_unref);
+  gst_harness_teardown (h);
+
+  return frames;
+}
+
+GST_START_TEST (test_pool_memory_system)
+{
+  GList *frames, *l;
+  GstMemory *mem;
+
+  frames = decode_frames ("system");
+
+  for (l = frames; l; l = l->next) {
+    mem = gst_buffer_peek_memory (l->data, 0);
+    fail_unless (gst_memory_is_type (mem, GST_ALLOCATOR_SYSMEM));
+  }
+
+  g_list_free_full (frames, (GDestroyNotify) gst_buffer_unref);
+}
+
+GST_END_TEST;
+
+#ifdef __linux__
+/* every frame has to start on a huge page to be backed by them */
+GST_START_TEST (test_pool_memory_huge_pages)
+{
+  GList *frames, *l;
+  GstMemory *mem;
+  GstMapInfo map;
+
+  frames = decode_frames ("huge-pages");
+
+  for (l = frames; l; l = l->next) {
+    mem = gst_buffer_peek_memory (l->data, 0);
+    fail_unless_equals_string (G_OBJECT_TYPE_NAME (mem->allocator),
+        "GstFFMpegHugePageAllocator");
+
+    fail_unless (gst_memory_map (mem, &map, GST_MAP_READ));
+    fail_unless_equals_uint64 (((guintptr) map.data - mem->offset) %
+        HUGE_PAGE_SIZE, 0);
+    gst_memory_unmap (mem, &map);
+  }
+
+  g_list_free_full (frames, (GDestroyNotify) gst_buffer_unref);
+}
+
+GST_END_TEST;
+#endif
+
+static Suite *
+avviddec_suite (void)
+{
+  Suite *s = suite_create ("avviddec");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_pool_memory_system);
+#ifdef __linux__
+  tcase_add_test (tc_chain, test_pool_memory_huge_pages);
+#endif
+
+  return s;
+}
+
+GST_CHECK_MAIN (avviddec)
@@ -0,0 +1,250 @@
+/* GStreamer unit tests for the avenc video encoders
+ *
+ * Copyright (C) <2018> GStreamer developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+#include <gst/video/video.h>
+
+#include <gst/gst.h>
+
+#define WIDTH 320
+#define HEIGHT 240
+#define FPS 30
+#define HIGH_BITRATE 1000000
+#define HIGH_QUANTIZER 20
+#define LOW_QUANTIZER 2
+/* frames per setting, the rate control settles during the first half */
+#define N_FRAMES 60
+
+/* a gradient with some texture moving to the right, so the quantizer
+ * matters but motion estimation always finds the previous picture */
+static GstBuffer *
+create_frame (GstHarness * h, GstVideoInfo * info, gint i)
+{
+  GstBuffer *buf;
+  GstMapInfo map;
+  gint x, y, u;
+
+  buf = gst_harness_create_buffer (h, GST_VIDEO_INFO_SIZE (info));
+  gst_buffer_map (buf, &map, GST_MAP_WRITE);
+  for (y = 0; y < HEIGHT; y++) {
+    for (x = 0; x < WIDTH; x++) {
+      u = x + 3 * i;
+      map.data[y * WIDTH + x] =
+          ((u + y) & 0x7f) + (((u * 7919) ^ (y * 104729)) & 0x1f);
+    }
+  }
+  memset (map.data + WIDTH * HEIGHT, 128,
+      GST_VIDEO_INFO_SIZE (info) - WIDTH * HEIGHT);
+  gst_buffer_unmap (buf, &map);
+
+  GST_BUFFER_PTS (buf) = gst_util_uint64_scale (i, GST_SECOND, FPS);
+  GST_BUFFER_DURATION (buf) = GST_SECOND / FPS;
+
+  return buf;
+}
+
+static GstHarness *
+setup_encoder (GstVideoInfo * info)
+{
+  GstHarness *h;
+
+  h = gst_harness_new ("avenc_mpeg4");
+  /* only the first frame is a keyframe */
+  g_object_set (h->element, "gop-size", 10 * N_FRAMES, NULL);
+  gst_video_info_set_format (info, GST_VIDEO_FORMAT_I420, WIDTH, HEIGHT);
+  info->fps_n = FPS;
+  info->fps_d = 1;
+  gst_harness_set_src_caps (h, gst_video_info_to_caps (info));
+
+  return h;
+}
+
+/* pushes N_FRAMES frames starting at @first and returns the size of the
+ * packets of the second half, fails on keyframes after the first frame */
+static gsize
+encode_frames (GstHarness * h, GstVideoInfo * info, gint first)
+{
+  GstBuffer *buf;
+  gsize size = 0;
+  gint i, n = 0;
+
+  for (i = first; i < first + N_FRAMES; i++) {
+    fail_unless_equals_int (gst_harness_push (h, create_frame (h, info, i)),
+        GST_FLOW_OK);
+    while ((buf = gst_harness_try_pull (h))) {
+      if (first + n > 0)
+        fail_unless (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT),
+            "keyframe at frame %d", first + n);
+      if (n++ >= N_FRAMES / 2)
+        size += gst_buffer_get_size (buf);
+      gst_buffer_unref (buf);
+    }
+  }
+
+  return size;
+}
+
+/* changes have to be applied in place, new caps would make muxers start
+ * a new stream */
+static void
+check_single_caps (GstHarness * h)
+{
+  GstEvent *event;
+  gint n_caps = 0;
+
+  while ((event = gst_harness_try_pull_event (h))) {
+    if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS)
+      n_caps++;
+    gst_event_unref (event);
+  }
+  fail_unless_equals_int (n_caps, 1);
+}
+
+GST_START_TEST (test_quantizer_change)
+{
+  GstHarness *h;
+  GstVideoInfo info;
+  gsize coarse, fine;
+
+  h = setup_encoder (&info);
+  gst_util_set_object_arg (G_OBJECT (h->element), "pass", "quant");
+  g_object_set (h->element, "quantizer", (gfloat) HIGH_QUANTIZER, NULL);
+
+  coarse = encode_frames (h, &info, 0);
+
+  /* while encoding, the encoder has to pick it up without new caps */
+  g_object_set (h->element, "quantizer", (gfloat) LOW_QUANTIZER, NULL);
+  fine = encode_frames (h, &info, N_FRAMES);
+
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  check_single_caps (h);
+
+  GST_INFO ("%" G_GSIZE_FORMAT " bytes at quantizer %d, %" G_GSIZE_FORMAT
+      " bytes at %d", coarse, HIGH_QUANTIZER, fine, LOW_QUANTIZER);
+  fail_unless (coarse > 0);
+  fail_unless (fine > 2 * coarse, "%" G_GSIZE_FORMAT " bytes at quantizer %d, %"
+      G_GSIZE_FORMAT " bytes at %d", coarse, HIGH_QUANTIZER, fine,
+      LOW_QUANTIZER);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_qmin_change)
+{
+  GstHarness *h;
+  GstVideoInfo info;
+  gsize fine, coarse;
+
+  h = setup_encoder (&info);
+  g_object_set (h->element, "bitrate", HIGH_BITRATE, "qmin", LOW_QUANTIZER,
+      NULL);
+
+  fine = encode_frames (h, &info, 0);
+
+  /* the rate control may not go below the new minimum anymore */
+  g_object_set (h->element, "qmin", HIGH_QUANTIZER, NULL);
+  coarse = encode_frames (h, &info, N_FRAMES);
+
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  check_single_caps (h);
+
+  GST_INFO ("%" G_GSIZE_FORMAT " bytes at qmin %d, %" G_GSIZE_FORMAT
+      " bytes at %d", fine, LOW_QUANTIZER, coarse, HIGH_QUANTIZER);
+  fail_unless (coarse > 0);
+  fail_unless (fine > 2 * coarse, "%" G_GSIZE_FORMAT " bytes at qmin %d, %"
+      G_GSIZE_FORMAT " bytes at %d", fine, LOW_QUANTIZER, coarse,
+      HIGH_QUANTIZER);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_stats_messages)
+{
+  GstHarness *h;
+  GstVideoInfo info;
+  GstBuffer *buf;
+  GstBus *bus;
+  GstMessage *msg;
+  const GstStructure *stats;
+  guint64 bits, timestamp;
+  gint i;
+
+  h = gst_harness_new ("avenc_mpeg4");
+  bus = gst_bus_new ();
+  gst_element_set_bus (h->element, bus);
+  g_object_set (h->element, "post-messages", TRUE, NULL);
+  gst_video_info_set_format (&info, GST_VIDEO_FORMAT_I420, WIDTH, HEIGHT);
+  info.fps_n = FPS;
+  info.fps_d = 1;
+  gst_harness_set_src_caps (h, gst_video_info_to_caps (&info));
+
+  for (i = 0; i < 2; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (h, &info, i)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  /* one message per packet, posted before it is pushed */
+  for (i = 0; (buf = gst_harness_try_pull (h)); i++) {
+    msg = gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT);
+    fail_unless (msg != NULL);
+    fail_unless (GST_MESSAGE_SRC (msg) == GST_OBJECT (h->element));
+    stats = gst_message_get_structure (msg);
+    fail_unless (gst_structure_has_name (stats, "avenc-frame-stats"));
+    fail_unless (gst_structure_get_uint64 (stats, "timestamp", &timestamp));
+    fail_unless_equals_uint64 (timestamp, GST_BUFFER_PTS (buf));
+    fail_unless (gst_structure_get_uint64 (stats, "bits", &bits));
+    fail_unless_equals_uint64 (bits, gst_buffer_get_size (buf) * 8);
+    fail_unless_equals_string (gst_structure_get_string (stats,
+            "picture-type"), i == 0 ? "I" : "P");
+    gst_message_unref (msg);
+    gst_buffer_unref (buf);
+  }
+  fail_unless_equals_int (i, 2);
+  fail_unless (gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT) == NULL);
+
+  gst_element_set_bus (h->element, NULL);
+  gst_object_unref (bus);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+static Suite *
+avvidenc_suite (void)
+{
+  Suite *s = suite_create ("avvidenc");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_quantizer_change);
+  tcase_add_test (tc_chain, test_qmin_change);
+  tcase_add_test (tc_chain, test_stats_messages);
+
+  return s;
+}
+
+GST_CHECK_MAIN (avvidenc)